@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "mtask_lua_seri.h"
 #include "mtask.h"
@@ -114,6 +115,8 @@ lcallback(lua_State *L)
 		mtask_callback(context, gL, forward_cb);
 	} else {
 		mtask_callback(context, gL, _cb);
+		// _cb 总是返回0 共享消息不必拷贝
+		mtask_callback_borrow(context, 1);
 	}
 
 	return 0;
@@ -276,6 +279,76 @@ lsend(lua_State *L)
 {
     return send_message(L, 0, 2);
 }
+/*
+	table addresses (uint32 address or string address)
+	integer type
+	string message
+	 lightuserdata message_ptr
+	 integer len
+ */
+// 同一份消息发给多个服务 只打包/拷贝一次 各个接收者共享(引用计数)同一块内存
+// 返回发送成功的个数
+static int
+lsendmany(lua_State *L)
+{
+	mtask_context_t * context = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int type = (int)luaL_checkinteger(L, 2);
+	void * msg = NULL;
+	size_t sz = 0;
+	int owned = 0;
+	switch (lua_type(L, 3)) {
+		case LUA_TSTRING:
+			msg = (void *)lua_tolstring(L, 3, &sz);
+			break;
+		case LUA_TLIGHTUSERDATA:
+			msg = lua_touserdata(L, 3);
+			sz = (size_t)luaL_checkinteger(L, 4);
+			owned = 1;
+			break;
+		default:
+			return luaL_error(L, "invalid param %s", lua_typename(L, lua_type(L,3)));
+	}
+	int n = (int)lua_rawlen(L, 1);
+	int i;
+	// 先检查所有地址 保证创建共享消息后不会中途出错
+	for (i=1;i<=n;i++) {
+		lua_rawgeti(L, 1, i);
+		if (lua_type(L, -1) == LUA_TNUMBER) {
+			if (lua_tointeger(L, -1) == 0) {
+				if (owned)
+					mtask_free(msg);
+				return luaL_error(L, "Invalid service address 0");
+			}
+		} else if (lua_type(L, -1) != LUA_TSTRING) {
+			if (owned)
+				mtask_free(msg);
+			return luaL_error(L, "dest address type (%s) must be a string or number.", luaL_typename(L, -1));
+		}
+		lua_pop(L, 1);
+	}
+	int count = 0;
+	if (n > 0) {
+		void * shared = mtask_shared_new(msg, sz, n);
+		for (i=1;i<=n;i++) {
+			lua_rawgeti(L, 1, i);
+			int r;
+			if (lua_type(L, -1) == LUA_TNUMBER) {
+				uint32_t dest = (uint32_t)lua_tointeger(L, -1);
+				r = mtask_send(context, 0, dest, type | PTYPE_TAG_SHARED, 0, shared, sz);
+			} else {
+				r = mtask_sendname(context, 0, lua_tostring(L, -1), type | PTYPE_TAG_SHARED, 0, shared, sz);
+			}
+			lua_pop(L, 1);
+			if (r >= 0)
+				++count;
+		}
+	}
+	if (owned)
+		mtask_free(msg);
+	lua_pushinteger(L, count);
+	return 1;
+}
 //和_send 功能类似 但是可以指定一个发送发送地址和消息发送的session
 static int
 lredirect(lua_State *L)
@@ -375,6 +448,90 @@ lnow(lua_State *L)
     return 1;
 }
 
+static int
+lnowms(lua_State *L)
+{
+    uint64_t ti = mtask_now_ms(); //启动时长 毫秒
+    lua_pushinteger(L, ti);
+    return 1;
+}
+//单调时钟 纳秒 用于测量时间间隔
+static int
+lhpc(lua_State *L)
+{
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    lua_pushinteger(L, (lua_Integer)ti.tv_sec * 1000000000 + ti.tv_nsec);
+    return 1;
+}
+
+/*
+	integer time (1/100 second)
+	boolean ms (time is in millisecond)
+	return session, timer id (0 if time is 0)
+ */
+static int
+ltimeout(lua_State *L)
+{
+	mtask_context_t * context = lua_touserdata(L, lua_upvalueindex(1));
+	int ti = (int)luaL_checkinteger(L, 1);
+	int session;
+	uint32_t id;
+	if (lua_toboolean(L, 2)) {
+		id = mtask_timer_newms(context, ti, &session);
+	} else {
+		id = mtask_timer_new(context, ti, &session);
+	}
+	lua_pushinteger(L, session);
+	lua_pushinteger(L, id);
+	return 2;
+}
+/*
+	integer timer id
+	return session of the canceled timer, or nil if it has expired
+ */
+static int
+lcanceltimeout(lua_State *L)
+{
+	mtask_context_t * context = lua_touserdata(L, lua_upvalueindex(1));
+	uint32_t id = (uint32_t)luaL_checkinteger(L, 1);
+	int session = mtask_timer_cancel(context, id);
+	if (session == 0) {
+		return 0;
+	}
+	lua_pushinteger(L, session);
+	return 1;
+}
+/*
+	boolean enable
+	timers added later and expiring on the same tick come as one PTYPE_TIMER message
+ */
+static int
+ltimerbatch(lua_State *L)
+{
+	mtask_context_t * context = lua_touserdata(L, lua_upvalueindex(1));
+	mtask_timer_batch(context, lua_toboolean(L, 1));
+	return 0;
+}
+/*
+	lightuserdata msg
+	integer sz
+	return table of the sessions in a PTYPE_TIMER message
+ */
+static int
+ltimersession(lua_State *L)
+{
+	const int * session = lua_touserdata(L, 1);
+	int n = (int)(luaL_checkinteger(L, 2) / sizeof(int));
+	lua_createtable(L, n, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_pushinteger(L, session[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
 LUAMOD_API int
 luaopen_mtask_core(lua_State *L)
 {
@@ -382,6 +539,7 @@ luaopen_mtask_core(lua_State *L)
 
 	luaL_Reg l[] = {
 		{ "send" , lsend },
+		{ "sendmany" , lsendmany },
 		{ "genid", lgenid },
 		{ "redirect", lredirect },
 		{ "command" , lcommand },
@@ -395,6 +553,12 @@ luaopen_mtask_core(lua_State *L)
 		{ "trash" , ltrash },
 		{ "callback", lcallback },
         { "now", lnow }, //节点进程启动时间
+        { "nowms", lnowms },
+        { "hpc", lhpc },
+		{ "timeout", ltimeout },
+		{ "canceltimeout", lcanceltimeout },
+		{ "timerbatch", ltimerbatch },
+		{ "timersession", ltimersession },
 		{ NULL, NULL },
 	};
    //这里先通过luaL_newlibtable创建一张表T（函数指针表l并未实际注册到表T中，只是分配了相应大小的空间）;
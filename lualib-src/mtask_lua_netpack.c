@@ -326,9 +326,9 @@ static inline int
 filter_data(lua_State *L, int fd, uint8_t * buffer, int size)
 {
     int ret = filter_data_(L, fd, buffer, size);
-    // buffer is the data of socket message, it malloc at socket_server.c : function forward_message .
-    // it should be free before return,
-    mtask_free(buffer);
+    // buffer is the data of socket message, it comes from the receive pool of socket_server.c .
+    // it should be returned before return,
+    mtask_socket_recycle(buffer, size);
     return ret;
 }
 
@@ -15,6 +15,7 @@
 #include <arpa/inet.h>
 
 #include "mtask_socket.h"
+#include "socket_server.h"
 #include "mtask.h"
 
 #define BACKLOG 32
@@ -43,7 +44,7 @@ lfreepool(lua_State *L) {
     for (i=0;i<sz;i++) {
         struct buffer_node *node = &pool[i];
         if (node->msg) {
-            mtask_free(node->msg);
+            mtask_socket_recycle(node->msg, node->sz);
             node->msg = NULL;
         }
     }
@@ -94,7 +95,9 @@ lnewbuffer(lua_State *L) {
 	and the second size is 32 ... The largest size of chunk is LARGE_PAGE_NODE (4096)
  
 	lpushbbuffer will get a free struct buffer_node from table pool, and then put the msg/size in it.
-	lpopbuffer return the struct buffer_node back to table pool (By calling return_free_node).
+	The msg block is referenced, not copied, until it is consumed.
+	lpopbuffer return the struct buffer_node back to table pool (By calling return_free_node),
+	and the msg block back to the receive pool of the socket thread (mtask_socket_recycle).
  */
 static int
 lpushbuffer(lua_State *L) {
@@ -157,7 +160,7 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
     lua_rawgeti(L,pool,1);
     free_node->next = lua_touserdata(L,-1);
     lua_pop(L,1);
-    mtask_free(free_node->msg);
+    mtask_socket_recycle(free_node->msg, free_node->sz);
     free_node->msg = NULL;
     
     free_node->sz = 0;
@@ -294,6 +297,17 @@ lreadall(lua_State *L)
     return 1;
 }
 
+static int
+lbuffersize(lua_State *L)
+{
+    struct socket_buffer * sb = lua_touserdata(L, 1);
+    if (sb == NULL) {
+        return luaL_error(L, "Need buffer object at param 1");
+    }
+    lua_pushinteger(L, sb->size);
+    return 1;
+}
+
 static int
 ldrop(lua_State *L) {
     void * msg = lua_touserdata(L,1);
@@ -618,6 +632,40 @@ lnodelay(lua_State *L) {
     return 0;
 }
 
+static int
+lpause(lua_State *L) {
+    mtask_context_t * ctx = lua_touserdata(L, lua_upvalueindex(1));
+    int id = (int)luaL_checkinteger(L, 1);
+    mtask_socket_pause(ctx,id);
+    return 0;
+}
+
+static int
+lresume(lua_State *L) {
+    mtask_context_t * ctx = lua_touserdata(L, lua_upvalueindex(1));
+    int id = (int)luaL_checkinteger(L, 1);
+    mtask_socket_resume(ctx,id);
+    return 0;
+}
+
+static int
+lcoalesce(lua_State *L) {
+    mtask_context_t * ctx = lua_touserdata(L, lua_upvalueindex(1));
+    int id = (int)luaL_checkinteger(L, 1);
+    int usec = (int)luaL_optinteger(L, 2, 0);
+    int size = (int)luaL_optinteger(L, 3, 0);
+    mtask_socket_coalesce(ctx,id,usec,size);
+    return 0;
+}
+
+static int
+lflush(lua_State *L) {
+    mtask_context_t * ctx = lua_touserdata(L, lua_upvalueindex(1));
+    int id = (int)luaL_checkinteger(L, 1);
+    mtask_socket_flush(ctx,id);
+    return 0;
+}
+
 static int
 ludp(lua_State *L)
 {
@@ -675,6 +723,74 @@ ludp_send(lua_State *L)
     return 1;
 }
 
+static const char *
+socket_info_type(int type)
+{
+    switch (type) {
+    case SOCKET_INFO_LISTEN:
+        return "LISTEN";
+    case SOCKET_INFO_TCP:
+        return "TCP";
+    case SOCKET_INFO_UDP:
+        return "UDP";
+    case SOCKET_INFO_BIND:
+        return "BIND";
+    case SOCKET_INFO_CLOSING:
+        return "CLOSING";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+// 返回所有 socket 的流量统计 每个 socket 一个 table
+static int
+linfo(lua_State *L)
+{
+    struct socket_info * si = mtask_socket_info();
+    struct socket_info * head = si;
+    lua_newtable(L);
+    int n = 0;
+    while (si) {
+        lua_createtable(L, 0, 16);
+        lua_pushinteger(L, si->id);
+        lua_setfield(L, -2, "id");
+        lua_pushstring(L, socket_info_type(si->type));
+        lua_setfield(L, -2, "type");
+        lua_pushinteger(L, (lua_Integer)si->opaque);
+        lua_setfield(L, -2, "address");
+        lua_pushboolean(L, si->reading);
+        lua_setfield(L, -2, "reading");
+        lua_pushinteger(L, (lua_Integer)si->read);
+        lua_setfield(L, -2, "read");
+        lua_pushinteger(L, (lua_Integer)si->write);
+        lua_setfield(L, -2, "write");
+        lua_pushinteger(L, (lua_Integer)si->rmsg);
+        lua_setfield(L, -2, "rmsg");
+        lua_pushinteger(L, (lua_Integer)si->wmsg);
+        lua_setfield(L, -2, "wmsg");
+        lua_pushinteger(L, (lua_Integer)si->rcall);
+        lua_setfield(L, -2, "rcall");
+        lua_pushinteger(L, (lua_Integer)si->wcall);
+        lua_setfield(L, -2, "wcall");
+        lua_pushinteger(L, (lua_Integer)si->rtime);
+        lua_setfield(L, -2, "rtime");
+        lua_pushinteger(L, (lua_Integer)si->wtime);
+        lua_setfield(L, -2, "wtime");
+        lua_pushinteger(L, (lua_Integer)si->wbuffer);
+        lua_setfield(L, -2, "wbuffer");
+        lua_pushinteger(L, (lua_Integer)si->wb_max);
+        lua_setfield(L, -2, "wbmax");
+        if (si->name[0]) {
+            lua_pushstring(L, si->name);
+            lua_setfield(L, -2, "peer");
+        }
+        lua_rawseti(L, -2, ++n);
+        si = si->next;
+    }
+    mtask_socket_info_release(head);
+    return 1;
+}
+
 static int
 ludp_address(lua_State *L)
 {
@@ -702,6 +818,33 @@ ludp_address(lua_State *L)
     return 2;
 }
 
+/*
+	userdata msg
+	integer size
+	把 MTASK_SOCKET_TYPE_UDP_BATCH 的数据块拆成 { data1, address1, data2, address2, ... } 然后把块还给 socket 线程
+ */
+static int
+ludp_unpack(lua_State *L)
+{
+    const char * msg = lua_touserdata(L, 1);
+    int size = (int)luaL_checkinteger(L, 2);
+    if (msg == NULL) {
+        return luaL_error(L, "Need udp batch at param 1");
+    }
+    lua_newtable(L);
+    int i, sz, addrsz;
+    const char * data;
+    const char * address;
+    for (i=0;(data = mtask_socket_udp_batch(msg, i, &sz, &address, &addrsz)) != NULL;i++) {
+        lua_pushlstring(L, data, sz);
+        lua_rawseti(L, -2, i*2+1);
+        lua_pushlstring(L, address, addrsz);
+        lua_rawseti(L, -2, i*2+2);
+    }
+    mtask_socket_recycle((void *)msg, size);
+    return 1;
+}
+
 LUAMOD_API int
 luaopen_mtask_socketdriver(lua_State *L) {
     luaL_checkversion(L);
@@ -712,6 +855,7 @@ luaopen_mtask_socketdriver(lua_State *L) {
         { "drop", ldrop },
         { "readall", lreadall },
         { "clear", lclearbuffer },
+        { "size", lbuffersize },
         { "readline", lreadline },
         { "str2p", lstr2p },
         { "header", lheader },
@@ -730,10 +874,16 @@ luaopen_mtask_socketdriver(lua_State *L) {
         { "bind", lbind },
         { "start", lstart },
         { "nodelay", lnodelay },
+        { "pause", lpause },
+        { "resume", lresume },
+        { "coalesce", lcoalesce },
+        { "flush", lflush },
+        { "info", linfo },
         { "udp", ludp },
         { "udp_connect", ludp_connect },
         { "udp_send", ludp_send },
         { "udp_address", ludp_address },
+        { "udp_unpack", ludp_unpack },
         { NULL, NULL },
     };
     lua_getfield(L, LUA_REGISTRYINDEX, "mtask_context");
@@ -100,9 +100,9 @@ function httpc.request(method, host, url, recvheader, header, content)
 		hostname = dns.resolve(hostname)
 	end
 	local fd = socket.connect(hostname, port, timeout)
-	local finish
+	local finish, timer
 	if timeout then
-		mtask.timeout(timeout, function()
+		timer = mtask.timeout(timeout, function()
 			if not finish then
 				socket.shutdown(fd)	-- shutdown the socket fd, need close later.
 			end
@@ -110,6 +110,9 @@ function httpc.request(method, host, url, recvheader, header, content)
 	end
 	local ok , statuscode, body = pcall(request, fd,method, host, url, recvheader, header, content)
 	finish = true
+	if timer then
+		mtask.canceltimeout(timer)
+	end
 	socket.close(fd)
 	if ok then
 		return statuscode, body
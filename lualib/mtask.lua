@@ -28,6 +28,7 @@ local mtask = {
 	PTYPE_DEBUG = 9,
 	PTYPE_LUA = 10,
 	PTYPE_SNAX = 11,
+	PTYPE_TIMER = 12,
 }
 
 -- code cache
@@ -119,17 +120,25 @@ end
 -- coroutine reuse
 
 local coroutine_pool = setmetatable({}, { __mode = "kv" })
+-- 用 co_cancel 作为参数 resume 还没执行的协程时不调用 f ，协程直接回到池里
+local co_cancel = {}
+
+local function co_call(f, ...)
+	if ... ~= co_cancel then
+		f(...)
+	end
+end
 --co_create 是从协程池找到空闲的协程来执行这个函数，没有空闲的协程则创建。
 local function co_create(f)
 	local co = table.remove(coroutine_pool)-- 从协程池取出一个协程
 	if co == nil then -- 如果没有可用的协程
 		co = coroutine.create(function(...) -- 创建新的协程
-			f(...)	-- 当调用coroutine.resume时，执行函数f
+			co_call(f, ...)	-- 当调用coroutine.resume时，执行函数f
 			while true do
 				f = nil 	-- 将函数置空
 				coroutine_pool[#coroutine_pool+1] = co-- 协程执行完后，回收协程
 				f = coroutine_yield "EXIT" -- a. yield 第一次获取函数   
-				f(coroutine_yield()) -- b. yield 第二次获取函数参数，然后执行函数f 
+				co_call(f, coroutine_yield()) -- b. yield 第二次获取函数参数，然后执行函数f 
 			end
 		end)
 	else
@@ -297,36 +306,68 @@ end
 --非阻塞 API ，当前 coroutine 会继续向下运行，而 func 将来会在新的 coroutine 中执行。
 --mtask 的定时器实现的非常高效，所以一般不用太担心性能问题。不过，如果你的服务想大量使用定时器的话，可以考虑一个更好的方法：即在一个service里，尽量只使用一个 mtask.timeout ，用它来触发自己的定时事件模块。这样可以减少大量从框架发送到服务的消息数量。毕竟一个服务在同一个单位时间能处理的外部消息数量是有限的。
 
---timeout 没有取消接口，这是因为你可以简单的封装它获得取消的能力
+--返回定时器 id，可以用 mtask.canceltimeout 取消，取消后定时器节点立刻从时间轮上摘除，不会再收到消息
 
--- 向框架注册一个定时器，并得到一个session，从定时器发过来的消息源地址是 0
-function mtask.timeout(ti, func)
-	local session = c.intcommand("TIMEOUT",ti)
-	assert(session)
+local function timeout(func, session, id)
 	local co = co_create(func)
 	assert(session_id_coroutine[session] == nil)
 	session_id_coroutine[session] = co
+	return id
+end
+-- 向框架注册一个定时器，并得到一个session，从定时器发过来的消息源地址是 0
+function mtask.timeout(ti, func)
+	return timeout(func, c.timeout(ti))
+end
+-- 同 mtask.timeout，ti 的单位是毫秒，精度取决于配置 timer_resolution
+function mtask.timeoutms(ti, func)
+	return timeout(func, c.timeout(ti, true))
+end
+-- 取消 mtask.timeout 注册的定时器，func 不会再被调用。定时器已经到期返回 false
+function mtask.canceltimeout(id)
+	local session = c.canceltimeout(id)
+	if session then
+		local co = session_id_coroutine[session]
+		session_id_coroutine[session] = nil
+		-- 协程还停在 co_create 里没有执行 func ，让它跳过 func 回到协程池
+		coroutine_resume(co, co_cancel)
+		return true
+	end
+	return false
+end
+-- 开启后，之后注册的定时器(sleep/timeout)在同一个滴答到期时由框架合并成一条消息，一次分发唤醒所有协程
+-- 适合大量对齐到同一时刻的定时器
+function mtask.timerbatch(enable)
+	c.timerbatch(enable ~= false)
 end
 --阻塞 API
 --将当前 coroutine 挂起 ti 个单位时间。一个单位是 1/100 秒。
 --它是向框架注册一个定时器实现的。框架会在 ti 时间后，发送一个定时器消息来唤醒这个 coroutine
 --它的返回值会告诉你是时间到了，还是被 mtask.wakeup 唤醒 （返回 "BREAK"）
 
--- 将当前协程挂起ti时间，实际上也是向框架注册一个定时器，区别是挂起的时间可以被mtask.wakeup"打断"
-function mtask.sleep(ti)
-	local session = c.intcommand("TIMEOUT",ti)
-	assert(session)
+local function sleep(session, id)
 	local succ, ret = coroutine_yield("SLEEP", session)
 	sleep_session[coroutine.running()] = nil
 	if succ then
 		return
 	end
 	if ret == "BREAK" then
+		-- 被 mtask.wakeup 提前唤醒，取消定时器，不再等它到期
+		if c.canceltimeout(id) then
+			session_id_coroutine[session] = nil
+		end
 		return "BREAK"
 	else
 		error(ret)
 	end
 end
+-- 将当前协程挂起ti时间，实际上也是向框架注册一个定时器，区别是挂起的时间可以被mtask.wakeup"打断"
+function mtask.sleep(ti)
+	return sleep(c.timeout(ti))
+end
+-- 同 mtask.sleep，ti 的单位是毫秒
+function mtask.sleepms(ti)
+	return sleep(c.timeout(ti, true))
+end
 -- 相当于 mtask.sleep(0) 。交出当前服务对 CPU 的控制权。
 --通常在你想做大量的操作，又没有机会调用阻塞 API 时，可以选择调用 yield 让系统跑的更平滑
 function mtask.yield()
@@ -365,6 +406,10 @@ end
 --这个函数的开销小于查询系统时钟。在同一个时间片内这个值是不变的。
 --(注意:这里的时间片表示小于mtask内部时钟周期的时间片,假如执行了比较费时的操作如超长时间的循环,或者调用了外部的阻塞调用,如os.execute('sleep 1'), 即使中间没有mtask的阻塞api调用,两次调用的返回值还是会不同的.)
 mtask.now = c.now
+-- 同 mtask.now，单位为毫秒，精度取决于配置 timer_resolution
+mtask.nowms = c.nowms
+-- 单调时钟，单位为纳秒，用于测量很短的时间间隔
+mtask.hpc = c.hpc
 
 local starttime
 --返回 mtask 节点进程启动的 UTC 时间，以秒为单位
@@ -425,6 +470,13 @@ function mtask.send(addr, typename, ...)
 	return c.send(addr, p.id, 0 , p.pack(...))
 end
 
+-- 同一条消息发给 addresses 中的所有服务 只打包一次 接收者共享同一份数据
+-- 返回发送成功的个数
+function mtask.sendmany(addresses, typename, ...)
+	local p = proto[typename]
+	return c.sendmany(addresses, p.id, p.pack(...))
+end
+
 function mtask.rawsend(addr, typename, msg, sz)
     local p = proto[typename]
     return c.send(addr, p.id, 0 , msg, sz)
@@ -578,18 +630,33 @@ end
 -- 这里的第一个参数 prototype 是同时支持 字符串与枚举类型索引的
 -- 关于proto[typename] 可以看作是对数据的封装，方便不同服务间、不同节点间，以及前后端的数据通讯，
 -- 不需要手动封包解包。默认支持lua/response/error这3个协议，还有log和debug协议，除了这几个，其他要自己调用mtask.register_protocol 注册
+local function dispatch_response(session, source, msg, sz)
+	local co = session_id_coroutine[session]
+	if co == "BREAK" then
+		session_id_coroutine[session] = nil
+	elseif co == nil then
+		unknown_response(session, source, msg, sz)
+	else
+		session_id_coroutine[session] = nil
+		-- 唤醒yield_call中的coroutine_yield("CALL", session)
+		suspend(co, coroutine.resume(co, true, msg, sz))
+	end
+end
+
 local function raw_dispatch_message(prototype, msg, sz, session, source)
 	-- mtask.PTYPE_RESPONSE = 1, read mtask.h
 	if prototype == 1 then-- 处理远端发送过来的返回值
-		local co = session_id_coroutine[session]
-		if co == "BREAK" then
-			session_id_coroutine[session] = nil
-		elseif co == nil then
-			unknown_response(session, source, msg, sz)
-		else
-			session_id_coroutine[session] = nil
-			-- 唤醒yield_call中的coroutine_yield("CALL", session)
-			suspend(co, coroutine.resume(co, true, msg, sz))
+		dispatch_response(session, source, msg, sz)
+	elseif prototype == 12 then -- mtask.PTYPE_TIMER 合并投递的定时器，一个协程出错不影响唤醒其它协程
+		local err
+		for _, s in ipairs(c.timersession(msg, sz)) do
+			local ok, e = pcall(dispatch_response, s, 0, nil, 0)
+			if not ok then
+				err = err and (err .. "\n" .. tostring(e)) or tostring(e)
+			end
+		end
+		if err then
+			error(err)
 		end
 	else
 		local p = proto[prototype]
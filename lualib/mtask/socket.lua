@@ -30,6 +30,65 @@ local socket_pool = setmetatable( -- store all socket object
 
 local socket_message = {}
 
+-- 读侧背压: 暂停读以后 socket 线程不再读这个连接，数据留在内核缓冲区，缓冲区满了对端被 tcp 流控挡住
+-- s.paused 为 true 表示手动暂停，"buffer" 表示缓冲区里未读的数据太多，"mqlen" 表示服务的消息队列太长
+local mqlen_paused = {}	-- 因为消息队列太长而暂停的 socket
+local mqlen_checking = false
+
+-- 只有连上的 socket 在 C 层才会真的暂停，还在连接或者已经断开的不记暂停状态
+local function pause(s, why)
+	if not s.paused and s.connected then
+		s.paused = why
+		driver.pause(s.id)
+	end
+end
+
+local function resume(s)
+	if s.paused then
+		s.paused = nil
+		driver.resume(s.id)
+	end
+end
+
+-- 消息队列降到阈值的一半以下时恢复读，否则下一个 tick 再看
+local function check_mqlen()
+	local mqlen = mtask.stat "mqlen"
+	for id, s in pairs(mqlen_paused) do
+		if s.paused ~= "mqlen" or socket_pool[id] ~= s or not s.autopause then
+			mqlen_paused[id] = nil
+		elseif mqlen < s.autopause.mqlen // 2 then
+			mqlen_paused[id] = nil
+			resume(s)
+		end
+	end
+	if next(mqlen_paused) then
+		mtask.timeout(1, check_mqlen)
+	else
+		mqlen_checking = false
+	end
+end
+
+local function autopause(s, sz)
+	local ap = s.autopause
+	if ap.size and sz >= ap.size then
+		pause(s, "buffer")
+	elseif ap.mqlen and mtask.stat "mqlen" >= ap.mqlen then
+		pause(s, "mqlen")
+		mqlen_paused[s.id] = s
+		if not mqlen_checking then
+			mqlen_checking = true
+			mtask.timeout(1, check_mqlen)
+		end
+	end
+end
+
+-- 读走数据以后缓冲区降到阈值的一半以下时恢复读
+local function autoresume(s)
+	if s.paused == "buffer" and driver.size(s.buffer) < s.autopause.size // 2 then
+		resume(s)
+	end
+end
+
 local function wakeup(s)
 	local co = s.co
 	if co then
@@ -62,6 +121,9 @@ socket_message[1] = function(id, size, data)
 
 	local sz = driver.push(s.buffer, buffer_pool, data, size)
 	-- 将接收到的数据放到buffer里面
+	if s.autopause and not s.paused then
+		autopause(s, sz)
+	end
 	local rr = s.read_required
 	local rrt = type(rr)
 	if rrt == "number" then
@@ -151,6 +213,31 @@ socket_message[6] = function(id, size, data, address)
 	s.callback(str, address)
 end
 
+-- mtask_SOCKET_TYPE_UDP_BATCH = 8 一次 recvmmsg 收到的多个包在一个数据块里
+socket_message[8] = function(id, size, data)
+	local s = socket_pool[id]
+	if s == nil or s.callback == nil then
+		mtask.error("socket: drop udp package from " .. id)
+		driver.drop(data, size)
+		return
+	end
+	local packets = driver.udp_unpack(data, size)
+	local err
+	for i = 1, #packets, 2 do
+		-- 回调里可能关闭了 socket 剩下的包丢掉
+		if socket_pool[id] ~= s or s.callback == nil then
+			break
+		end
+		local ok, e = pcall(s.callback, packets[i], packets[i+1])
+		if not ok and err == nil then
+			err = e
+		end
+	end
+	if err then
+		error(err)
+	end
+end
+
 local function default_warning(id, size)
 	local s = socket_pool[id]
 	if not s then
@@ -296,6 +383,14 @@ function socket.disconnected(id)
 	end
 end
 
+-- 等待更多数据 因为缓冲区太满而暂停的读要先恢复，否则等不到
+local function suspend_read(s)
+	if s.paused == "buffer" then
+		resume(s)
+	end
+	suspend(s)
+end
+
 --从一个 socket 上读 sz 指定的字节数。
 --如果读到了指定长度的字符串，它把这个字符串返回。
 --如果连接断开导致字节数不够，将返回一个 false 加上读到的字符串。
@@ -307,6 +402,7 @@ function socket.read(id, sz)
 		-- read some bytes
 		local ret = driver.readall(s.buffer, buffer_pool)
 		if ret ~= "" then
+			autoresume(s)
 			return ret
 		end
 
@@ -315,7 +411,7 @@ function socket.read(id, sz)
 		end
 		assert(not s.read_required)
 		s.read_required = 0
-		suspend(s)
+		suspend_read(s)
 		ret = driver.readall(s.buffer, buffer_pool)
 		if ret ~= "" then
 			return ret
@@ -326,6 +422,7 @@ function socket.read(id, sz)
 
 	local ret = driver.pop(s.buffer, buffer_pool, sz)
 	if ret then
+		autoresume(s)
 		return ret
 	end
 	if not s.connected then
@@ -334,7 +431,7 @@ function socket.read(id, sz)
 
 	assert(not s.read_required)
 	s.read_required = sz
-	suspend(s)
+	suspend_read(s)
 	ret = driver.pop(s.buffer, buffer_pool, sz)
 	if ret then
 		return ret
@@ -353,7 +450,7 @@ function socket.readall(id)
 	end
 	assert(not s.read_required)
 	s.read_required = true
-	suspend(s)
+	suspend_read(s)
 	assert(s.connected == false)
 	return driver.readall(s.buffer, buffer_pool)
 end
@@ -365,6 +462,7 @@ function socket.readline(id, sep)
 	assert(s)
 	local ret = driver.readline(s.buffer, buffer_pool, sep)
 	if ret then
+		autoresume(s)
 		return ret
 	end
 	if not s.connected then
@@ -372,7 +470,7 @@ function socket.readline(id, sep)
 	end
 	assert(not s.read_required)
 	s.read_required = sep
-	suspend(s)
+	suspend_read(s)
 	if s.connected then
 		return driver.readline(s.buffer, buffer_pool, sep)
 	else
@@ -387,7 +485,7 @@ function socket.block(id)
 	end
 	assert(not s.read_required)
 	s.read_required = 0
-	suspend(s)
+	suspend_read(s)
 	return s.connected
 end
 
@@ -395,6 +493,11 @@ socket.write = assert(driver.send)
 socket.lwrite = assert(driver.lsend)
 socket.header = assert(driver.header)
 
+-- 所有 socket 的流量统计，每个 socket 一个 table:
+-- id type address(所属服务) peer read write(字节) rmsg wmsg(消息数) rcall wcall(系统调用次数)
+-- rtime wtime(最后一次读写，进程启动后的毫秒数) wbuffer wbmax(发送队列当前和最高的字节数) reading
+socket.netstat = assert(driver.info)
+
 function socket.invalid(id)
 	return socket_pool[id] == nil
 end
@@ -456,6 +559,47 @@ function socket.limit(id, limit)
 	s.buffer_limit = limit
 end
 
+-- 暂停/恢复读这个连接 暂停期间对端的数据留在内核缓冲区里，发满了对端的 write 会被挡住
+-- 手动暂停不会自动恢复，暂停时阻塞读会一直等到 socket.resume
+function socket.pause(id)
+	local s = assert(socket_pool[id])
+	pause(s, true)
+end
+
+function socket.resume(id)
+	local s = assert(socket_pool[id])
+	resume(s)
+end
+
+-- 合并写: 之后的 write 先留在发送队列，达到 size 字节、第一个包之后 usec 微秒或者 socket.flush 时一起写出
+-- 适合每个 tick 发很多小包的广播，请求/应答的连接不要打开；usec 为 0 时只按字节数和 flush 写出，两项都为 0 时关闭
+function socket.coalesce(id, usec, size)
+	driver.coalesce(id, usec or 0, size or 0)
+end
+
+socket.flush = assert(driver.flush)
+
+-- 缓冲区里收到了还没有读走的字节数
+function socket.unread(id)
+	local s = assert(socket_pool[id])
+	return driver.size(s.buffer)
+end
+
+-- 自动暂停读: 缓冲区里未读的数据达到 size 字节，或者本服务的消息队列长度达到 mqlen 时暂停
+-- 缓冲区读到 size 的一半以下，或者消息队列降到 mqlen 的一半以下时恢复；阻塞读要等数据时也会先恢复
+-- 两个参数都为 nil 时关闭自动模式
+function socket.autopause(id, size, mqlen)
+	local s = assert(socket_pool[id])
+	if size or mqlen then
+		s.autopause = { size = size, mqlen = mqlen }
+	else
+		s.autopause = nil
+		if s.paused ~= true then
+			resume(s)
+		end
+	end
+end
+
 ---------------------- UDP ----------------------
 --udp 协议不需要阻塞读取。这是因为 udp 是不可靠协议，无法预期下一个读到的数据包是什么（协议允许乱序和丢包）。
 --udp 协议封装采用的是 callback 的方式。
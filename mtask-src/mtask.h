@@ -20,9 +20,11 @@
 #define PTYPE_RESERVED_DEBUG    9  //调试消息
 #define PTYPE_RESERVED_LUA      10 //Lua 消息
 #define PTYPE_RESERVED_SNAX     11
+#define PTYPE_TIMER             12 //合并投递的定时器消息 data 为同一滴答到期的 session 数组(int)
 
 #define PTYPE_TAG_DONTCOPY      0x10000 //给自己发消息 TAG
 #define PTYPE_TAG_ALLOCSESSION  0x20000 //session 保持唯一的值 0 TAG
+#define PTYPE_TAG_SHARED        0x40000 //msg 由 mtask_shared_new 创建 发送一次消耗一个引用 不拷贝
 
 //每一个服务对应的 mtask_ctx 结构 mtask上下文结构
 typedef struct mtask_context_s mtask_context_t;
@@ -66,10 +68,31 @@ int mtask_isremote(mtask_context_t *, uint32_t handle, int * harbor);
 typedef int (*mtask_cb)(mtask_context_t * context, void *ud, int type, int session, uint32_t source , const void * msg, size_t sz);
 
 void mtask_callback(mtask_context_t * context, void *ud, mtask_cb cb);
+// 声明回调只在调用期间读取消息(总是返回0) 共享消息可以直接交给回调 否则会先给回调拷贝一份
+// mtask_callback 会把它重置为 0
+void mtask_callback_borrow(mtask_context_t * context, int enable);
+
+// 引用计数的共享消息体 一份数据发给多个服务 每次以 PTYPE_TAG_SHARED 发送消耗一个引用
+// 最后一个接收者处理完后释放 没有发出去的引用用 mtask_shared_release 释放
+void * mtask_shared_new(const void * msg, size_t sz, int ref);
+
+void mtask_shared_release(void * msg);
+
+// 注册可以取消的定时器 time 单位为 1/100 秒，*session 返回新分配的 session
+// 返回定时器 id，time 为0时消息直接投递，返回0
+uint32_t mtask_timer_new(mtask_context_t * context, int time, int *session);
+// 同 mtask_timer_new，time 单位为毫秒，实际精度取决于 timer_resolution
+uint32_t mtask_timer_newms(mtask_context_t * context, int ms, int *session);
+// 取消定时器，返回被取消定时器的 session，定时器已经到期返回0
+int mtask_timer_cancel(mtask_context_t * context, uint32_t id);
+// 开启后 之后加入的定时器在同一个滴答到期时合并成一条 PTYPE_TIMER 消息投递
+void mtask_timer_batch(mtask_context_t * context, int enable);
 
 uint32_t mtask_current_handle(void);
 
 uint64_t mtask_now(void);
+// 同 mtask_now 单位为毫秒
+uint64_t mtask_now_ms(void);
 
 void mtask_debug_memory(const char *info);	// for debug use, output current service memory to stderr
 
@@ -11,4 +11,12 @@
 #define ATOM_SUB(ptr,n) __sync_sub_and_fetch(ptr, n)
 #define ATOM_AND(ptr,n) __sync_and_and_fetch(ptr, n)
 
+// __sync_* 没有原子交换和单独的 load/store，这里用 __atomic_* 补齐
+#define ATOM_XCHG(ptr, nval) __atomic_exchange_n(ptr, nval, __ATOMIC_SEQ_CST)
+#define ATOM_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define ATOM_STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOM_LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOM_STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define ATOM_SYNC() __sync_synchronize()
+
 #endif
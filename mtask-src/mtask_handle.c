@@ -5,6 +5,8 @@
 #include "mtask.h"
 #include "mtask_server.h"
 #include "mtask_rwlock.h"
+#include "mtask_spinlock.h"
+#include "mtask_atomic.h"
 #include "mtask_handle.h"
 
 
@@ -12,29 +14,214 @@
 
 #define DEFAULT_SLOT_SIZE 4
 #define MAX_SLOT_SIZE 0x40000000
+#define DEFAULT_RECLAIM_SIZE 16
+#define DEFAULT_NAME_SIZE 16
 //服务名字和服务编号的对应结构
+//同时挂在两个哈希表上: 按名字哈希(next) 和 按handle哈希(hnext, 反向索引)
 struct handle_name {
 	char * name;
 	uint32_t handle;
+	uint32_t hash;              //名字的哈希值，扩容时不用重新计算
+	struct handle_name * next;  //名字哈希桶的下一个
+	struct handle_name * hnext; //handle哈希桶的下一个
+};
+// slot 数组，扩容时整体替换，读者通过一次原子读拿到 size 与 ctx 一致的视图
+struct handle_slot {
+	int size;            //slot的个数，size永远不会小于handle_index
+	mtask_context_t * ctx[];
+};
+// 每个线程一个读者记录，mtask_handle_grab 只写自己的记录，不写共享数据
+// epoch 为0表示不在读临界区，否则为进入时看到的全局 epoch
+struct handle_reader {
+	uint64_t epoch;
+	struct handle_reader * next;
+	char padding[64 - sizeof(uint64_t) - sizeof(void *)];
+};
+// 等待回收的内存，所有读者都离开 epoch 之后才能释放
+struct handle_reclaim {
+	void * ptr;
+	uint64_t epoch;
 };
 // 存储handle与mtask_context的对应关系，是一个哈希表
 // 每个服务mtask_context都对应一个不重复的handle
 // 存储name和handle的对应关系
 // 通过handle便可获取mtask_context
+// 写者(register/retire/namehandle)之间仍用读写锁互斥，mtask_handle_grab 不加锁，
+// 被替换的 slot 数组和被销毁的 mtask_context 延迟到读者都离开后再释放(epoch 回收)
 struct handle_storage {
 	rwlock_t lock; //读写锁
 
 	uint32_t harbor;    //服务所属harbor id; harbor用于不同主机间通信
 	uint32_t handle_index;//服务索引
-	int slot_size;       //slot的个数，slot_size永远不会小于handle_index
-	mtask_context_t ** slot;//slot下挂着所有的服务相关的结构体
-    //handle_name容量，初始为2，这里 name_cap 与 slot_size 不一样的原因在于，不是每个 handle 都有name
-	int name_cap;//存储全局名字的空间的总个数，永远大于name_count
+	struct handle_slot * slot;//slot下挂着所有的服务相关的结构体
+    //哈希桶个数，2的幂，这里 name_cap 与 slot 个数不一样的原因在于，不是每个 handle 都有name
+	int name_cap;//name_count 超过 name_cap 时桶数翻倍
 	int name_count;  //当前全局名字的个数
-	struct handle_name *name;//用于管理服务的全局名字
+	struct handle_name **name;//按名字哈希，用于管理服务的全局名字
+	struct handle_name **handle_name;//按handle哈希，retire时找到服务的所有名字
+	uint64_t name_lookup;  //mtask_handle_findname 调用次数
+	uint64_t name_probe;   //查找时比较过的节点总数
+
+	uint64_t epoch;                   //全局 epoch，每次回收一块内存加1
+	struct handle_reader * reader;    //所有读者记录的链表，只增不减
+	spinlock_t reclaim_lock;
+	int reclaim_cap;
+	int reclaim_count;
+	struct handle_reclaim * reclaim;  //等待释放的内存
 };
 
 static struct handle_storage *H = NULL;
+static __thread struct handle_reader * READER = NULL;
+
+static struct handle_slot *
+_new_slot(int size)
+{
+	struct handle_slot * slot = mtask_malloc(sizeof(*slot) + size * sizeof(mtask_context_t *));
+	slot->size = size;
+	memset(slot->ctx, 0, size * sizeof(mtask_context_t *));
+	return slot;
+}
+// 线程第一次调用 mtask_handle_grab 时登记读者记录
+static struct handle_reader *
+_reader(struct handle_storage *s)
+{
+	struct handle_reader * r = READER;
+	if (r == NULL) {
+		r = mtask_malloc(sizeof(*r));
+		memset(r, 0, sizeof(*r));
+		do {
+			r->next = ATOM_LOAD(&s->reader);
+		} while (!ATOM_CAS_POINTER(&s->reader, r->next, r));
+		READER = r;
+	}
+	return r;
+}
+// 释放所有读者都已经看不到的内存，需持有 reclaim_lock
+static void
+_collect(struct handle_storage *s)
+{
+	uint64_t min = UINT64_MAX;
+	struct handle_reader * r;
+	for (r = ATOM_LOAD(&s->reader); r; r = r->next) {
+		uint64_t e = ATOM_LOAD(&r->epoch);
+		if (e != 0 && e < min) {
+			min = e;
+		}
+	}
+	int i,j = 0;
+	for (i=0;i<s->reclaim_count;i++) {
+		struct handle_reclaim * c = &s->reclaim[i];
+		// epoch 不大于 c->epoch 的读者进入时，内存可能还能被读到
+		if (c->epoch < min) {
+			mtask_free(c->ptr);
+		} else {
+			s->reclaim[j++] = *c;
+		}
+	}
+	s->reclaim_count = j;
+}
+/***********************************************
+ * 延迟释放 ptr，调用前 ptr 必须已经不能从 slot 中读到
+ * 推进全局 epoch，之后进入的读者一定看不到 ptr
+ ***********************************************/
+void
+mtask_handle_reclaim(void *ptr)
+{
+	struct handle_storage *s = H;
+	spinlock_lock(&s->reclaim_lock);
+	uint64_t epoch = ATOM_FINC(&s->epoch);
+	if (s->reclaim_count >= s->reclaim_cap) {
+		s->reclaim_cap *= 2;
+		s->reclaim = mtask_realloc(s->reclaim, s->reclaim_cap * sizeof(struct handle_reclaim));
+	}
+	s->reclaim[s->reclaim_count].ptr = ptr;
+	s->reclaim[s->reclaim_count].epoch = epoch;
+	++s->reclaim_count;
+	_collect(s);
+	spinlock_unlock(&s->reclaim_lock);
+}
+static uint32_t
+_name_hash(const char * name)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	const unsigned char * p = (const unsigned char *)name;
+	while (*p) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+// 在名字哈希表中查找，probe 累加比较过的节点数
+static struct handle_name *
+_find_name(struct handle_storage *s, const char * name, uint32_t hash, int *probe)
+{
+	struct handle_name * n = s->name[hash & (s->name_cap-1)];
+	while (n) {
+		++*probe;
+		if (n->hash == hash && strcmp(n->name, name) == 0) {
+			return n;
+		}
+		n = n->next;
+	}
+	return NULL;
+}
+// 把名字节点挂到两个哈希表上
+static void
+_link_name(struct handle_storage *s, struct handle_name *n)
+{
+	struct handle_name ** bucket = &s->name[n->hash & (s->name_cap-1)];
+	n->next = *bucket;
+	*bucket = n;
+	bucket = &s->handle_name[n->handle & (s->name_cap-1)];
+	n->hnext = *bucket;
+	*bucket = n;
+}
+// 两个哈希表的桶数改为 cap，重新挂所有名字
+static void
+_rehash_name(struct handle_storage *s, int cap)
+{
+	struct handle_name ** old = s->name;
+	int old_cap = s->name_cap;
+	s->name_cap = cap;
+	s->name = mtask_malloc(cap * sizeof(struct handle_name *));
+	memset(s->name, 0, cap * sizeof(struct handle_name *));
+	mtask_free(s->handle_name);
+	s->handle_name = mtask_malloc(cap * sizeof(struct handle_name *));
+	memset(s->handle_name, 0, cap * sizeof(struct handle_name *));
+	int i;
+	for (i=0;i<old_cap;i++) {
+		struct handle_name * n = old[i];
+		while (n) {
+			struct handle_name * next = n->next;
+			_link_name(s, n);
+			n = next;
+		}
+	}
+	mtask_free(old);
+}
+// 通过 handle 哈希表找到 handle 的所有名字，从两个哈希表中摘下并释放
+static void
+_remove_name(struct handle_storage *s, uint32_t handle)
+{
+	struct handle_name ** hp = &s->handle_name[handle & (s->name_cap-1)];
+	while (*hp) {
+		struct handle_name * n = *hp;
+		if (n->handle != handle) {
+			hp = &n->hnext;
+			continue;
+		}
+		*hp = n->hnext;
+		struct handle_name ** np = &s->name[n->hash & (s->name_cap-1)];
+		while (*np != n) {
+			np = &(*np)->next;
+		}
+		*np = n->next;
+		mtask_free(n->name);
+		mtask_free(n);
+		--s->name_count;
+	}
+}
 // 注册ctx，将 ctx 存到 handle_storage 哈希表中 的 slot，并得到一个handle
 uint32_t
 mtask_handle_register(mtask_context_t *ctx)
@@ -44,13 +231,14 @@ mtask_handle_register(mtask_context_t *ctx)
 	rwlock_wlock(&s->lock);
 	
 	for (;;) {
+		struct handle_slot * slot = s->slot;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;i<slot->size;i++) {
             uint32_t handle = (i+s->handle_index) & HANDLE_MASK;//将高八位置为0
-            //从1开始增长，到0终止，如果hash为0了，说明slot_size已经用尽了
-            int hash = handle & (s->slot_size-1); // 等价于 handle % s->slot_size
-			if (s->slot[hash] == NULL) {// 找到未使用的  slot 将这个 ctx 放入这个 slot 中
-				s->slot[hash] = ctx;
+            //从1开始增长，到0终止，如果hash为0了，说明slot已经用尽了
+            int hash = handle & (slot->size-1); // 等价于 handle % slot->size
+			if (slot->ctx[hash] == NULL) {// 找到未使用的  slot 将这个 ctx 放入这个 slot 中
+				ATOM_STORE(&slot->ctx[hash], ctx);
 				s->handle_index = handle + 1;// 移动 handle_index 方便下次使用
 
 				rwlock_wunlock(&s->lock);
@@ -60,19 +248,18 @@ mtask_handle_register(mtask_context_t *ctx)
 			}
 		}
         // 确保 扩大2倍空间后 总共handle即 slot的数量不超过 24位的限制
-        assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-        // 哈希表扩大2倍
-		mtask_context_t ** new_slot = mtask_malloc(s->slot_size * 2 * sizeof(mtask_context_t *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(mtask_context_t *));
+        assert((slot->size*2 - 1) <= HANDLE_MASK);
+        // 哈希表扩大2倍，在新数组上填好后再发布，读者不会被阻塞
+		struct handle_slot * new_slot = _new_slot(slot->size * 2);
         // 将原来的数据拷贝到新的空间
-		for (i=0;i<s->slot_size;i++) {
-			int hash = mtask_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
+		for (i=0;i<slot->size;i++) {
+			int hash = mtask_context_handle(slot->ctx[i]) & (new_slot->size - 1);
+			assert(new_slot->ctx[hash] == NULL);
+			new_slot->ctx[hash] = slot->ctx[i];
 		}
-		mtask_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		ATOM_STORE(&s->slot, new_slot);
+		// 老的数组可能还有读者在用，延迟释放
+		mtask_handle_reclaim(slot);
 	}
 }
 /***********************************
@@ -89,24 +276,14 @@ mtask_handle_retire(uint32_t handle)
 
 	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	mtask_context_t * ctx = s->slot[hash];
+	struct handle_slot * slot = s->slot;
+	uint32_t hash = handle & (slot->size-1);
+	mtask_context_t * ctx = slot->ctx[hash];
 
 	if (ctx != NULL && mtask_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;   //释放相应的服务的指向
+		ATOM_STORE(&slot->ctx[hash], NULL);   //释放相应的服务的指向
 		ret = 1;
-		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {// 在 name 表中找到 handle 对应的 name free掉
-				mtask_free(s->name[i].name);
-				continue;
-			} else if (i!=j) { // 说明free了一个name
-				s->name[j] = s->name[i];// 因此需要将后续元素移到前面
-			}
-			++j;
-		}
-		s->name_count = j;
+		_remove_name(s, handle);// 通过反向索引 free 掉 handle 对应的所有 name
 	} else {
 		ctx = NULL;
 	}
@@ -133,9 +310,14 @@ mtask_handle_retireall()
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;;i++) {
 			rwlock_rlock(&s->lock);
-			mtask_context_t * ctx = s->slot[i];
+			struct handle_slot * slot = s->slot;
+			if (i >= slot->size) {
+				rwlock_runlock(&s->lock);
+				break;
+			}
+			mtask_context_t * ctx = slot->ctx[i];
 			uint32_t handle = 0;
 			if (ctx)
 				handle = mtask_context_handle(ctx);
@@ -151,22 +333,29 @@ mtask_handle_retireall()
 	}
 }
 
+/***********************************************
+ * 无锁查找 handle 对应的 ctx 并增加引用计数
+ * 进入时把全局 epoch 写到本线程的读者记录，离开时清0
+ * 期间读到的 slot 数组和 ctx 不会被释放
+ ***********************************************/
 mtask_context_t *
 mtask_handle_grab(uint32_t handle)
 {
 	struct handle_storage *s = H;
+	struct handle_reader * r = _reader(s);
 	mtask_context_t * result = NULL;
 
-	rwlock_rlock(&s->lock);
+	ATOM_STORE(&r->epoch, ATOM_LOAD(&s->epoch));
 
-	uint32_t hash = handle & (s->slot_size-1);
-	mtask_context_t * ctx = s->slot[hash];
-	if (ctx && mtask_context_handle(ctx) == handle) {
+	struct handle_slot * slot = ATOM_LOAD(&s->slot);
+	uint32_t hash = handle & (slot->size-1);
+	mtask_context_t * ctx = ATOM_LOAD(&slot->ctx[hash]);
+	// 引用计数为0说明 ctx 正在销毁，不能再引用
+	if (ctx && mtask_context_handle(ctx) == handle && mtask_context_trygrab(ctx)) {
 		result = ctx;
-		mtask_context_grab(result);
 	}
 
-	rwlock_runlock(&s->lock);
+	ATOM_STORE_RELEASE(&r->epoch, 0);
 
 	return result;
 }
@@ -178,88 +367,53 @@ mtask_handle_findname(const char * name)
 
 	rwlock_rlock(&s->lock);
 
-	uint32_t handle = 0;
-
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;// 这里用的二分查找 (可能会有整形溢出 改成减法避免）
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);// 一直在头部插入 实际上这样插入后 name 会按长度大小排好序 这样就能使用二分查找了
-		if (c==0) {
-			handle = n->handle;
-			break;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
-	}
+	int probe = 0;
+	struct handle_name * n = _find_name(s, name, _name_hash(name), &probe);
+	uint32_t handle = n ? n->handle : 0;
 
 	rwlock_runlock(&s->lock);
 
+	ATOM_INC(&s->name_lookup);
+	ATOM_ADD(&s->name_probe, probe);
+
 	return handle;
 }
-/***********************************************
- * 在某个名字之前将全局名字注册进去，所以全局名字是按顺序保存的，便于折半查找
- ***********************************************/
-static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before)
+// 名字表统计 stat[0]:名字个数 stat[1]:哈希桶个数 stat[2]:查找次数 stat[3]:查找比较的节点总数
+void
+mtask_handle_namestat(uint64_t stat[4])
 {
-    //如果全局名字空间不够用了，就成倍扩充
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = mtask_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];//将before之前的老的复制到新的
-		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];//before的位置留给要插入的name
-		}
-		mtask_free(s->name);//释放老的
-		s->name = n;        //全局名字地址管理指向新分配的
-	} else {
-		int i;
-		for (i=s->name_count;i>before;i--) {
-            //将before之后的全局往后移，腾出空间给要插入的name
-			s->name[i] = s->name[i-1];
-		}
-	}
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	struct handle_storage *s = H;
+	rwlock_rlock(&s->lock);
+	stat[0] = s->name_count;
+	stat[1] = s->name_cap;
+	rwlock_runlock(&s->lock);
+	stat[2] = ATOM_LOAD(&s->name_lookup);
+	stat[3] = ATOM_LOAD(&s->name_probe);
 }
 /***********************************************
- * 按顺序注册全局名字
- * 1.先折半查找出要插入的点
- * 2.再调用_insert_name_before将对应的name插入进去
+ * 注册全局名字，名字已存在返回NULL
+ * 名字个数超过桶数时，两个哈希表的桶数一起翻倍
  ***********************************************/
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle)
 {
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			return NULL;// 名称已存在 这里名称不能重复插入
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	uint32_t hash = _name_hash(name);
+	int probe = 0;
+	if (_find_name(s, name, hash, &probe)) {
+		return NULL;// 名称已存在 这里名称不能重复插入
+	}
+	if (s->name_count >= s->name_cap) {
+		assert(s->name_cap * 2 <= MAX_SLOT_SIZE);
+		_rehash_name(s, s->name_cap * 2);
 	}
-	char * result = mtask_strdup(name);
-    // 一直在头部插入 实际上这样插入后 name 会按长度大小排好序 这样就能使用二分查找了
-	_insert_name_before(s, result, handle, begin);
+	struct handle_name * n = mtask_malloc(sizeof(*n));
+	n->name = mtask_strdup(name);
+	n->handle = handle;
+	n->hash = hash;
+	_link_name(s, n);
+	s->name_count ++;
 
-	return result;
+	return n->name;
 }
 //注册全局名字  name与handle绑定
 const char * 
@@ -279,18 +433,27 @@ mtask_handle_init(int harbor)
 {
 	assert(H==NULL);
 	struct handle_storage * s = mtask_malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = mtask_malloc(s->slot_size * sizeof(mtask_context_t *));
-	memset(s->slot, 0, s->slot_size * sizeof(mtask_context_t *));
+	s->slot = _new_slot(DEFAULT_SLOT_SIZE);
 
 	rwlock_init(&s->lock);
 	// reserve 0 for system
     //将harbor置为高8位的，这样能区分是哪里来的地址
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;// handle句柄从1开始,0保留
-	s->name_cap = 2;    // 名字容量初始为2
+	s->name_cap = DEFAULT_NAME_SIZE;
 	s->name_count = 0;
-	s->name = mtask_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name = mtask_malloc(s->name_cap * sizeof(struct handle_name *));
+	memset(s->name, 0, s->name_cap * sizeof(struct handle_name *));
+	s->handle_name = mtask_malloc(s->name_cap * sizeof(struct handle_name *));
+	memset(s->handle_name, 0, s->name_cap * sizeof(struct handle_name *));
+	s->name_lookup = 0;
+	s->name_probe = 0;
+	s->epoch = 1;       // 0 表示读者不在临界区
+	s->reader = NULL;
+	spinlock_init(&s->reclaim_lock);
+	s->reclaim_cap = DEFAULT_RECLAIM_SIZE;
+	s->reclaim_count = 0;
+	s->reclaim = mtask_malloc(s->reclaim_cap * sizeof(struct handle_reclaim));
 
 	H = s;
 
@@ -12,12 +12,16 @@ uint32_t mtask_handle_register(mtask_context_t *);
 int mtask_handle_retire(uint32_t handle);
 
 mtask_context_t * mtask_handle_grab(uint32_t handle);
+// 延迟释放 mtask_handle_grab 可能还在读的内存
+void mtask_handle_reclaim(void *ptr);
 
 void mtask_handle_retireall();
 
 uint32_t mtask_handle_findname(const char * name);
 
 const char * mtask_handle_namehandle(uint32_t handle, const char *name);
+// stat[0]:名字个数 stat[1]:哈希桶个数 stat[2]:查找次数 stat[3]:查找比较的节点总数
+void mtask_handle_namestat(uint64_t stat[4]);
 
 void mtask_handle_init(int harbor);
 
@@ -5,6 +5,18 @@ struct mtask_config {
 	int thread;//线程数
 	int harbor;//harbor id
     int profile;
+	int mq_lockfree;//服务消息队列使用无锁模式
+	int work_steal;//工作线程使用本地运行队列+工作窃取调度
+	int dispatch_slice;//自适应调度 每个服务每次最多占用的微秒数 0为使用权重
+	int timer_tickless;//定时器线程睡到下一个定时器到期 而不是每2.5ms轮询
+	int timer_resolution;//定时器每个滴答的毫秒数 默认10
+	int socket_thread;//socket 线程数 每个线程一个 epoll 和一部分 socket 默认1
+	int socket_reuseport;//socket 线程数大于1时 listen 在每个线程各开一个 SO_REUSEPORT 的 fd
+	int socket_max;//所有 socket 线程的 socket 数上限 0为每个线程64K
+	const char * socket_backend;//socket 收数据的方式 "epoll" 或 "uring" 默认 "epoll"
+	int dns_cache_ttl;//connect 域名解析结果的缓存秒数 0为不缓存 默认60
+	const char * dns_server;//connect 域名解析使用的 dns 服务器 "ip[:port]" 默认使用系统配置
+	const char * weight;//工作线程权重 逗号分隔 如 "-1,-1,0,0,1,1"
 	const char * daemon; //后台模式启动 "./mtask.pid"
 	const char * module_path;//模块 服务路径 .so文件路径
 	const char * bootstrap; //启动的第一个服务及其参数 默认 "snlua bootstrap"
@@ -168,6 +168,18 @@ main(int argc, char *argv[])
 	config.logger = optstring("logger", NULL);//日志文件
 	config.logservice = optstring("logservice", "logger");//log服务
     config.profile = optboolean("profile", 1);  //性能统计
+	config.mq_lockfree = optboolean("mq_lockfree", 0);  //服务消息队列无锁模式
+	config.work_steal = optboolean("work_steal", 0);    //工作窃取调度
+	config.dispatch_slice = optint("dispatch_slice", 0);//自适应调度时间片(微秒)
+	config.weight = optstring("weight", NULL);          //工作线程权重
+	config.timer_tickless = optboolean("timer_tickless", 0);//定时器线程 tickless 模式
+	config.timer_resolution = optint("timer_resolution", 10);//定时器精度 "1ms" 也可以
+	config.socket_thread = optint("socket_thread", 1);  //socket 线程数
+	config.socket_reuseport = optboolean("socket_reuseport", 0);//listen 使用 SO_REUSEPORT 分散 accept
+	config.socket_max = optint("socket_max", 0);  //socket 数上限
+	config.socket_backend = optstring("socket_backend", "epoll");//socket 后端 epoll/uring
+	config.dns_cache_ttl = optint("dns_cache_ttl", 60);  //域名解析缓存秒数
+	config.dns_server = optstring("dns_server", NULL);  //域名解析 dns 服务器
 
 	lua_close(L);//关闭掉新创建的lua_state
 
@@ -3,12 +3,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 
 #include "mtask.h"
 #include "mtask_mq.h"
 #include "mtask_handle.h"
 #include "mtask_spinlock.h"
+#include "mtask_atomic.h"
 
 #define DEFAULT_QUEUE_SIZE 64       //默认队列大小
 #define MAX_GLOBAL_MQ 0x10000       //最大的全局消息队列的大小 64K
@@ -19,6 +21,13 @@
 #define MQ_IN_GLOBAL 1      //在全局队列中或者正在分发
 #define MQ_OVERLOAD 1024
 
+#define MQ_NODE_CACHE 256           //无锁模式下每个线程缓存的空闲节点上限
+
+//无锁模式(MPSC)的消息节点 生产者原子交换 tail 挂入节点，消费者独占 head
+struct mq_node {
+    struct mq_node *next;
+    mtask_message_t message;
+};
 
 //消息队列结构 sizeof(message_queue_t) = 56
 struct message_queue_s {
@@ -33,6 +42,12 @@ struct message_queue_s {
     int overload_threshold;//过载阀值，超过此值说明过载了
     mtask_message_t *queue; //存放具体消息的连续内存的指针(服务的一条消息对应一个mtask_message_t结构)
     message_queue_t *next;  //下一个服务的消息队列节点指针
+    // 以下字段只在无锁模式下使用 (见 mtask_mq_init)
+    int lockfree;           //是否为无锁模式
+    uint32_t push_count;    //累计压入的消息数 生产者原子累加 无符号 溢出后回绕
+    uint32_t pop_count;     //累计弹出的消息数 只有消费者修改
+    struct mq_node *node_head;  //哨兵节点 只有消费者访问
+    struct mq_node *node_tail;  //最后压入的节点 生产者原子交换
 };
 
 //全局消息队列链表 其中保存了非空的各个服务的消息队列message_queue
@@ -45,27 +60,183 @@ struct global_queue_s {
 typedef struct global_queue_s global_queue_t;
 //全局队列的指针变量
 static global_queue_t *Q = NULL;
-//消息队列挂在全局消息队列(链表)的尾部
-void
-mtask_globalmq_push(message_queue_t * queue)
+
+//工作窃取模式下每个工作线程的本地运行队列 对齐到缓存行 避免相邻工作线程互相干扰
+struct worker_queue_s {
+    message_queue_t *head;
+    message_queue_t *tail;
+    spinlock_t lock;
+    uint64_t local_pop;     //从本地运行队列取到的次数
+    uint64_t global_pop;    //从全局队列取到的次数
+    uint64_t steal;         //从其它工作线程窃取成功的次数
+    uint64_t steal_fail;    //扫描完所有工作线程仍然没有窃取到的次数
+} __attribute__((aligned(64)));
+
+typedef struct worker_queue_s worker_queue_t;
+//工作线程本地运行队列数组 为NULL时不使用工作窃取
+static worker_queue_t *W = NULL;
+static int WORKER = 0;
+//当前线程对应的工作线程编号 非工作线程为-1
+static __thread int worker_id = -1;
+//下一次窃取开始的位置
+static __thread int steal_next = 0;
+//消息队列变为可运行(挂入全局队列或本地运行队列)时的通知 用于唤醒空闲的工作线程
+static mq_notify NOTIFY = NULL;
+static void *NOTIFY_UD = NULL;
+//新建的消息队列是否使用无锁模式
+static int LOCKFREE = 0;
+
+//无锁模式的空闲节点缓存 线程局部 避免每条消息都走 mtask_malloc/mtask_free
+static __thread struct mq_node *node_cache = NULL;
+static __thread int node_cache_size = 0;
+
+static inline struct mq_node *
+_node_new(void)
 {
-	global_queue_t *q = Q;
+	struct mq_node *node = node_cache;
+	if (node) {
+		node_cache = node->next;
+		--node_cache_size;
+		return node;
+	}
+	return mtask_malloc(sizeof(*node));
+}
 
-	SPIN_LOCK(q)
+static inline void
+_node_delete(struct mq_node *node)
+{
+	if (node_cache_size < MQ_NODE_CACHE) {
+		node->next = node_cache;
+		node_cache = node;
+		++node_cache_size;
+	} else {
+		mtask_free(node);
+	}
+}
+static inline void
+_worker_push(worker_queue_t *w, message_queue_t *queue)
+{
+	SPIN_LOCK(w)
 	assert(queue->next == NULL);
-	if(q->tail) {
-		q->tail->next = queue;
-		q->tail = queue;
-	} else { // 如果为空队列
-		q->head = q->tail = queue;
+	if(w->tail) {
+		w->tail->next = queue;
+		w->tail = queue;
+	} else {
+		w->head = w->tail = queue;
 	}
-	SPIN_UNLOCK(q)
+	SPIN_UNLOCK(w)
+}
+
+static inline message_queue_t *
+_worker_pop(worker_queue_t *w)
+{
+	// 无锁预判 空队列不去竞争锁
+	if (ATOM_LOAD(&w->head) == NULL)
+		return NULL;
+	SPIN_LOCK(w)
+	message_queue_t *mq = w->head;
+	if(mq) {
+		w->head = mq->next;
+		if(w->head == NULL) {
+			assert(mq == w->tail);
+			w->tail = NULL;
+		}
+		mq->next = NULL;
+	}
+	SPIN_UNLOCK(w)
+	return mq;
+}
+
+static message_queue_t * _global_pop(global_queue_t *q);
+
+//消息队列挂在全局消息队列(链表)的尾部
+//工作窃取模式下 工作线程压入的队列挂在自己的本地运行队列
+static void
+_globalmq_push(message_queue_t * queue)
+{
+	if (W && worker_id >= 0) {
+		_worker_push(&W[worker_id], queue);
+	} else {
+		global_queue_t *q = Q;
+
+		SPIN_LOCK(q)
+		assert(queue->next == NULL);
+		if(q->tail) {
+			q->tail->next = queue;
+			q->tail = queue;
+		} else { // 如果为空队列
+			q->head = q->tail = queue;
+		}
+		SPIN_UNLOCK(q)
+	}
+}
+//通知有消息队列变为可运行 不能在持有服务消息队列的锁时调用:
+//被唤醒的工作线程可能抢占当前线程 然后在这把自旋锁上空转
+static inline void
+_notify(void)
+{
+	if (NOTIFY) {
+		NOTIFY(NOTIFY_UD);
+	}
+}
+
+void
+mtask_globalmq_push(message_queue_t * queue)
+{
+	_globalmq_push(queue);
+	_notify();
 }
 //取出全局消息队列链表头部的消息队列
+//工作窃取模式下 工作线程先取本地运行队列 再取全局队列(非工作线程压入的)
 message_queue_t *
 mtask_globalmq_pop()
 {
-	global_queue_t *q = Q;
+	if (W && worker_id >= 0) {
+		worker_queue_t *w = &W[worker_id];
+		message_queue_t *mq = _worker_pop(w);
+		if (mq) {
+			++w->local_pop;
+			return mq;
+		}
+		mq = _global_pop(Q);
+		if (mq) {
+			++w->global_pop;
+		}
+		return mq;
+	}
+	return _global_pop(Q);
+}
+//从其它工作线程的本地运行队列窃取一个消息队列 只在工作线程空闲时调用
+message_queue_t *
+mtask_globalmq_steal(void)
+{
+	if (W == NULL || worker_id < 0)
+		return NULL;
+	worker_queue_t *self = &W[worker_id];
+	int i;
+	int start = steal_next;
+	for (i=0;i<WORKER;i++) {
+		int victim = (start + i) % WORKER;
+		if (victim == worker_id)
+			continue;
+		message_queue_t *mq = _worker_pop(&W[victim]);
+		if (mq) {
+			// 下次从同一个工作线程开始 它很可能还有积压
+			steal_next = victim;
+			++self->steal;
+			return mq;
+		}
+	}
+	steal_next = (start + 1) % WORKER;
+	++self->steal_fail;
+	return NULL;
+}
+
+static message_queue_t *
+_global_pop(global_queue_t *q)
+{
+	if (ATOM_LOAD(&q->head) == NULL)
+		return NULL;
 
 	SPIN_LOCK(q)
 	message_queue_t *mq = q->head;
@@ -98,8 +269,19 @@ mtask_mq_create(uint32_t handle)
 	q->release = 0;
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
-	q->queue = mtask_malloc(sizeof(mtask_message_t) * q->cap);//分配连续的cap内存用于存放具体消息
 	q->next = NULL;
+	q->lockfree = LOCKFREE;
+	q->push_count = 0;
+	q->pop_count = 0;
+	if (q->lockfree) {
+		q->queue = NULL;
+		struct mq_node *stub = _node_new();
+		stub->next = NULL;
+		q->node_head = q->node_tail = stub;
+	} else {
+		q->queue = mtask_malloc(sizeof(mtask_message_t) * q->cap);//分配连续的cap内存用于存放具体消息
+		q->node_head = q->node_tail = NULL;
+	}
 
 	return q;
 }
@@ -109,7 +291,16 @@ _release(message_queue_t *q)
 {
 	assert(q->next == NULL);
 	SPIN_DESTROY(q)
-	mtask_free(q->queue);
+	if (q->lockfree) {
+		struct mq_node *node = q->node_head;
+		while (node) {
+			struct mq_node *next = node->next;
+			_node_delete(node);
+			node = next;
+		}
+	} else {
+		mtask_free(q->queue);
+	}
 	mtask_free(q);
 }
 
@@ -118,10 +309,21 @@ mtask_mq_handle(message_queue_t *q)
 {
 	return q->handle;
 }
+//无锁模式的长度 两个计数都会回绕 按无符号相减差值仍然正确
+//push_count 先于节点挂入累加 所以差值只会偏大 不会为负 超过 INT_MAX 说明读到了旧值 当作 0
+static inline int
+_length_lockfree(message_queue_t *q)
+{
+	uint32_t length = ATOM_LOAD(&q->push_count) - q->pop_count;
+	return length > INT_MAX ? 0 : (int)length;
+}
 //消息队列的长度
 int
 mtask_mq_length(message_queue_t *q)
 {
+	if (q->lockfree) {
+		return _length_lockfree(q);
+	}
 	int head, tail,cap;
 
 	SPIN_LOCK(q)
@@ -146,10 +348,55 @@ mtask_mq_overload(message_queue_t *q)
 	} 
 	return 0;
 }
+//无锁模式的弹出 只会被持有该队列的工作线程调用(单消费者)
+static int
+_pop_lockfree(message_queue_t *q, mtask_message_t *message)
+{
+	struct mq_node *head = q->node_head;
+	struct mq_node *next = ATOM_LOAD_ACQUIRE(&head->next);
+	if (next == NULL) {
+		if (ATOM_LOAD(&q->node_tail) == head) {
+			// reset overload_threshold when queue is empty
+			q->overload_threshold = MQ_OVERLOAD;
+			// Clear in_global first, then check tail again. A producer that pushed before
+			// the clear either sees in_global == 0 and pushes q to global mq, or we see its
+			// node here and take in_global back. Only one side wins the CAS.
+			ATOM_STORE(&q->in_global, 0);
+			if (ATOM_LOAD(&q->node_tail) == head || !ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+				return 1;
+			}
+		}
+		// a producer has exchanged tail but not linked the node yet
+		while ((next = ATOM_LOAD_ACQUIRE(&head->next)) == NULL) {}
+	}
+	// next becomes the new stub node
+	q->node_head = next;
+	*message = next->message;
+	_node_delete(head);
+
+	++q->pop_count;
+	return 0;
+}
+//无锁模式弹出之后检查剩下的长度 过载时记下长度并把阀值扩充一倍
+static void
+_check_overload_lockfree(message_queue_t *q)
+{
+	int length = _length_lockfree(q);
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
+}
 //弹出消息队列中的头部消息
 int
 mtask_mq_pop(message_queue_t *q, mtask_message_t *message)
 {
+	if (q->lockfree) {
+		if (_pop_lockfree(q, message))
+			return 1;
+		_check_overload_lockfree(q);
+		return 0;
+	}
 	int ret = 1;
 	SPIN_LOCK(q)
 
@@ -185,6 +432,83 @@ mtask_mq_pop(message_queue_t *q, mtask_message_t *message)
 
 	return ret;
 }
+//无锁模式的批量弹出 取到第一条之后 遇到空队列就停下 不清除 in_global (这批消息还没处理)
+//整批取完再检查过载 和加锁模式一样按弹出后剩下的长度算
+static int
+_pop_batch_lockfree(message_queue_t *q, mtask_message_t *buf, int max)
+{
+	if (_pop_lockfree(q, &buf[0]))
+		return 0;
+	int n = 1;
+	while (n < max) {
+		struct mq_node *head = q->node_head;
+		struct mq_node *next = ATOM_LOAD_ACQUIRE(&head->next);
+		if (next == NULL)
+			break;
+		q->node_head = next;
+		buf[n++] = next->message;
+		_node_delete(head);
+	}
+	q->pop_count += (uint32_t)(n - 1);
+	_check_overload_lockfree(q);
+	return n;
+}
+//一次加锁批量弹出最多 max 条消息到 buf 返回取到的条数 0表示队列已空(同 mtask_mq_pop 返回1)
+//length 不为NULL时返回弹出后队列中剩余的消息数
+int
+mtask_mq_pop_batch(message_queue_t *q, mtask_message_t *buf, int max, int *length)
+{
+	int n;
+	if (q->lockfree) {
+		n = _pop_batch_lockfree(q, buf, max);
+		if (length) {
+			*length = _length_lockfree(q);
+		}
+		return n;
+	}
+	SPIN_LOCK(q)
+
+	int head = q->head;
+	int tail = q->tail;
+	int cap = q->cap;
+	int len = tail - head;
+	if (len < 0) {
+		len += cap;
+	}
+	n = len < max ? len : max;
+	if (n > 0) {
+		//环形队列 最多分两段拷贝
+		int first = cap - head;
+		if (first >= n) {
+			memcpy(buf, q->queue + head, n * sizeof(mtask_message_t));
+		} else {
+			memcpy(buf, q->queue + head, first * sizeof(mtask_message_t));
+			memcpy(buf + first, q->queue, (n - first) * sizeof(mtask_message_t));
+		}
+		head += n;
+		if (head >= cap) {
+			head -= cap;
+		}
+		q->head = head;
+		len -= n;
+        //如果过载，将目前消息队列的长度复制，并将过载阀值扩充一倍
+		while (len > q->overload_threshold) {
+			q->overload = len;
+			q->overload_threshold *= 2;
+		}
+	} else {
+		// reset overload_threshold when queue is empty
+		q->overload_threshold = MQ_OVERLOAD;
+		q->in_global = 0;
+	}
+
+	SPIN_UNLOCK(q)
+
+	if (length) {
+		*length = len;
+	}
+	return n;
+}
 //扩展消息队列message_queue 中的存放消息的内存空间
 static void
 expand_queue(message_queue_t *q)
@@ -201,12 +525,31 @@ expand_queue(message_queue_t *q)
 	mtask_free(q->queue);
 	q->queue = new_queue;
 }
+//无锁模式的压入 生产者之间互不阻塞
+static void
+_push_lockfree(message_queue_t *q, mtask_message_t *message)
+{
+	struct mq_node *node = _node_new();
+	node->next = NULL;
+	node->message = *message;
+	ATOM_INC(&q->push_count);
+	struct mq_node *prev = ATOM_XCHG(&q->node_tail, node);
+	ATOM_STORE_RELEASE(&prev->next, node);
+
+	if (ATOM_LOAD(&q->in_global) == 0 && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		mtask_globalmq_push(q);
+	}
+}
 //将服务的某条消息压入服务的消息队列尾
 //如果标识为在全局中 则将消息队列挂在到全局消息队列的尾部
 void
 mtask_mq_push(message_queue_t *q, mtask_message_t *message)
 {
 	assert(message);
+	if (q->lockfree) {
+		_push_lockfree(q, message);
+		return;
+	}
 	SPIN_LOCK(q)
 
 	q->queue[q->tail] = *message;//将消息压入消息队列的尾
@@ -218,33 +561,107 @@ mtask_mq_push(message_queue_t *q, mtask_message_t *message)
 		expand_queue(q);
 	}
 
+	int runnable = 0;
 	if (q->in_global == 0) { //如果在全局标志等于0  设置标志为在全局 压入全局消息队列
 		q->in_global = MQ_IN_GLOBAL;
-		mtask_globalmq_push(q);
+		_globalmq_push(q);
+		runnable = 1;
 	}
 	
 	SPIN_UNLOCK(q)
+	if (runnable) {
+		_notify();
+	}
 }
 //初始化全局消息队列 分配和初始struct global_queue内存结构
 void
-mtask_mq_init()
+mtask_mq_init(int lockfree)
 {
 	global_queue_t *q = mtask_malloc(sizeof(*q));
 	memset(q,0,sizeof(*q));
 	SPIN_INIT(q);
 	Q = q;
+	LOCKFREE = lockfree;
+}
+//设置消息队列变为可运行时的通知函数
+void
+mtask_globalmq_notify(mq_notify func, void *ud)
+{
+	NOTIFY_UD = ud;
+	NOTIFY = func;
+}
+//是否有可运行的消息队列 工作线程进入睡眠前用来再检查一次
+int
+mtask_globalmq_runnable(void)
+{
+	if (ATOM_LOAD(&Q->head))
+		return 1;
+	if (W) {
+		int i;
+		for (i=0;i<WORKER;i++) {
+			if (ATOM_LOAD(&W[i].head))
+				return 1;
+		}
+	}
+	return 0;
+}
+//开启工作窃取 为每个工作线程分配本地运行队列 必须在工作线程启动前调用
+void
+mtask_mq_worker_init(int worker)
+{
+	worker_queue_t *w = mtask_malloc(sizeof(*w) * worker);
+	memset(w, 0, sizeof(*w) * worker);
+	int i;
+	for (i=0;i<worker;i++) {
+		SPIN_INIT(&w[i]);
+	}
+	WORKER = worker;
+	W = w;
+}
+//绑定当前线程为第 id 个工作线程
+void
+mtask_mq_worker_bind(int id)
+{
+	worker_id = id;
+	steal_next = (id + 1) % (WORKER ? WORKER : 1);
+}
+//工作线程的调度计数 未开启工作窃取时返回0
+int
+mtask_mq_worker_stat(int id, uint64_t stat[4])
+{
+	if (W == NULL || id < 0 || id >= WORKER)
+		return 0;
+	worker_queue_t *w = &W[id];
+	stat[0] = w->local_pop;
+	stat[1] = w->global_pop;
+	stat[2] = w->steal;
+	stat[3] = w->steal_fail;
+	return 1;
 }
 //标记消息队列release = 1 并且将消息队列放入全局消息队列链表
 void
 mtask_mq_mark_release(message_queue_t *q)
 {
+	if (q->lockfree) {
+		assert(q->release == 0);
+		ATOM_STORE(&q->release, 1);
+		if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+			mtask_globalmq_push(q);
+		}
+		return;
+	}
+	int runnable = 0;
 	SPIN_LOCK(q)
 	assert(q->release == 0);
 	q->release = 1;
 	if (q->in_global != MQ_IN_GLOBAL) {
-		mtask_globalmq_push(q);
+		_globalmq_push(q);
+		runnable = 1;
 	}
 	SPIN_UNLOCK(q)
+	if (runnable) {
+		_notify();
+	}
 }
 //消息弹出消息队列 删除消息队列中的消息内存块数据
 static void
@@ -260,13 +677,22 @@ _drop_queue(message_queue_t *q, message_drop drop_func, void *ud)
 void
 mtask_mq_release(message_queue_t *q, message_drop drop_func, void *ud)
 {
+	if (q->lockfree) {
+		if (ATOM_LOAD(&q->release)) {
+			_drop_queue(q, drop_func, ud);
+		} else {
+			mtask_globalmq_push(q);
+		}
+		return;
+	}
 	SPIN_LOCK(q)
 	
 	if (q->release) {
 		SPIN_UNLOCK(q)
 		_drop_queue(q, drop_func, ud);
 	} else {
-		mtask_globalmq_push(q);
+		_globalmq_push(q);
 		SPIN_UNLOCK(q)
+		_notify();
 	}
 }
@@ -15,6 +15,8 @@ struct mtask_message_s {
 typedef struct mtask_message_s mtask_message_t;
 
 // type is encoding in mtask_message.sz high 8bit
+// 本节点的消息队列里 类型之下的两位还用作小消息(MESSAGE_SMALL)和共享消息(MESSAGE_SHARED)的标记 见 mtask_server.c
+// 所以消息长度最多用到 sz 的低 (sizeof(size_t)*8 - 10) 位 32位下不能达到 4M 超过的消息在 mtask_send 里被拒绝
 #define MESSAGE_TYPE_MASK (SIZE_MAX >> 8)
 #define MESSAGE_TYPE_SHIFT ((sizeof(size_t)-1) * 8) //56
 
@@ -23,6 +25,14 @@ typedef struct message_queue_s message_queue_t;//消息队列
 void mtask_globalmq_push(message_queue_t * queue);
 //弹出全局队列
 message_queue_t * mtask_globalmq_pop(void);
+//工作窃取模式下从其它工作线程窃取
+message_queue_t * mtask_globalmq_steal(void);
+//全局队列或工作线程本地运行队列中是否有待处理的消息队列
+int mtask_globalmq_runnable(void);
+
+typedef void (*mq_notify)(void *ud);
+//消息队列变为可运行时回调 func (在压入者线程中调用)
+void mtask_globalmq_notify(mq_notify func, void *ud);
 //创建消息队列
 message_queue_t * mtask_mq_create(uint32_t handle);
 //标记释放消息队列
@@ -37,6 +47,10 @@ uint32_t mtask_mq_handle(message_queue_t *);
 // 0 for success
 //消息出队列
 int mtask_mq_pop(message_queue_t *q, mtask_message_t *message);
+// return the number of messages popped (at most max), 0 means empty (like mtask_mq_pop returns 1)
+// *length (if not NULL) is the length of queue after pop
+//一次加锁批量出队列
+int mtask_mq_pop_batch(message_queue_t *q, mtask_message_t *buf, int max, int *length);
 //消息入队列
 void mtask_mq_push(message_queue_t *q, mtask_message_t *message);
 
@@ -45,7 +59,12 @@ void mtask_mq_push(message_queue_t *q, mtask_message_t *message);
 int mtask_mq_length(message_queue_t *q);
 
 int mtask_mq_overload(message_queue_t *q);
-//全局消息队列的初始化
-void mtask_mq_init();
+//全局消息队列的初始化 lockfree 非0时新建的服务消息队列使用无锁(多生产者/单消费者)模式
+void mtask_mq_init(int lockfree);
+//工作窃取调度 每个工作线程一个本地运行队列
+void mtask_mq_worker_init(int worker);
+void mtask_mq_worker_bind(int id);
+// stat: local pop, global pop, steal, failed steal ; return 0 if work stealing is off
+int mtask_mq_worker_stat(int id, uint64_t stat[4]);
 
 #endif
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
 
@@ -13,6 +14,7 @@
 #include "mtask_handle.h"
 #include "mtask_mq.h"
 #include "mtask_timer.h"
+#include "mtask_socket.h"
 #include "mtask_harbor.h"
 #include "mtask_env.h"
 #include "mtask_imp.h"
@@ -41,6 +43,104 @@
 #define CHECKCALLING_DECL
 
 #endif
+
+#define ADAPTIVE_PROBE 16   //自适应调度时 还没有耗时统计的服务一次处理的消息数
+#define DISPATCH_BATCH 32   //工作线程一次从服务消息队列中批量取出的最大消息数
+
+// 小消息: 拷贝的消息体(含结尾的'\0')不超过 SMALL_MESSAGE_SIZE 时使用线程局部缓存的定长内存块
+// 内存块本身仍然是 mtask_malloc 分配的 被回调保留(返回1)后照常用 mtask_free 释放
+#define SMALL_MESSAGE_SIZE 128
+#define SMALL_MESSAGE_CACHE 1024    //每个线程最多缓存的小消息内存块数
+// 标记在 mtask_message_t.sz 中 类型(高8位)之下的一位 只在本节点的消息队列中出现
+#define MESSAGE_SMALL ((size_t)1 << (MESSAGE_TYPE_SHIFT - 1))
+// 共享消息(PTYPE_TAG_SHARED) 同样只在本节点的消息队列中出现 再占一位 32位下消息长度不能达到 4M
+#define MESSAGE_SHARED ((size_t)1 << (MESSAGE_TYPE_SHIFT - 2))
+#define MESSAGE_FLAGS (MESSAGE_SMALL | MESSAGE_SHARED)
+// 标记占掉了 sz 中类型之下的位 消息长度只能用 MESSAGE_SIZE_MASK 里的位 见 mtask_mq.h
+#define MESSAGE_SIZE_MASK (MESSAGE_TYPE_MASK & ~MESSAGE_FLAGS)
+
+struct small_message {
+	struct small_message *next;
+};
+
+static __thread struct small_message *small_cache = NULL;
+static __thread int small_cache_size = 0;
+
+static inline void *
+small_message_alloc(void)
+{
+	struct small_message *m = small_cache;
+	if (m) {
+		small_cache = m->next;
+		--small_cache_size;
+		return m;
+	}
+	return mtask_malloc(SMALL_MESSAGE_SIZE);
+}
+
+static inline void
+small_message_free(void *ptr)
+{
+	if (small_cache_size < SMALL_MESSAGE_CACHE) {
+		struct small_message *m = ptr;
+		m->next = small_cache;
+		small_cache = m;
+		++small_cache_size;
+	} else {
+		mtask_free(ptr);
+	}
+}
+
+//共享消息体的头部 数据紧跟在后面
+struct shared_message {
+	int ref;
+	size_t sz;
+};
+
+void *
+mtask_shared_new(const void * msg, size_t sz, int ref)
+{
+	assert(ref > 0);
+	struct shared_message *s = mtask_malloc(sizeof(*s) + sz + 1);
+	s->ref = ref;
+	s->sz = sz;
+	char * data = (char *)(s + 1);
+	if (sz > 0) {
+		memcpy(data, msg, sz);
+	}
+	data[sz] = '\0';
+	return data;
+}
+
+void
+mtask_shared_release(void * msg)
+{
+	struct shared_message *s = (struct shared_message *)msg - 1;
+	if (ATOM_DEC(&s->ref) == 0) {
+		mtask_free(s);
+	}
+}
+//共享消息换成一份私有拷贝 (发往远程节点 或者交给可能保留消息的回调)
+static void *
+shared_unshare(void * msg)
+{
+	struct shared_message *s = (struct shared_message *)msg - 1;
+	size_t sz = s->sz;
+	char * data = mtask_malloc(sz + 1);
+	memcpy(data, msg, sz + 1);
+	mtask_shared_release(msg);
+	return data;
+}
+//释放还没有交给回调的消息
+static inline void
+message_free(void * data, size_t sz)
+{
+	if (sz & MESSAGE_SHARED) {
+		mtask_shared_release(data);
+	} else {
+		mtask_free(data);
+	}
+}
 // mtask 主要功能 加载服务和通知服务
 /*
  * 一个模块(.so)加载到mtask框架中，创建出来的一个实例就是一个服务，
@@ -62,9 +162,12 @@ struct mtask_context_s {
 	int session_id;     //会话id
 	int ref;            //ref引用计数
     int message_count;  //消息数量
+    uint32_t msg_cost;  //自适应调度: 平均每条消息的处理耗时(纳秒) 0表示还没有统计
+    bool borrow;        //回调不会保留消息 共享消息不必拷贝
 	bool init;          //是否实例化
 	bool endless;       //是否进入无尽循环
     bool profile;
+    bool timer_batch;   //同一滴答到期的定时器合并成一条 PTYPE_TIMER 消息
 
 	CHECKCALLING_DECL
 };
@@ -75,6 +178,7 @@ struct mtask_node {
 	uint32_t monitor_exit;
 	pthread_key_t handle_key;//线程局部存储数据 所有线程都可以使用它，而它的值在每一个线程中又是单独存储的
     bool profile;	// default is off
+    uint32_t dispatch_slice;	// in nanosec, 0 means use weight
 
 };
 
@@ -130,7 +234,7 @@ static void
 drop_message(mtask_message_t *msg, void *ud)
 {
 	struct drop_t *d = ud;
-	mtask_free(msg->data);
+	message_free(msg->data, msg->sz);
 	uint32_t source = d->handle;
 	assert(source);
 	// report error to the message source
@@ -175,6 +279,9 @@ mtask_context_new(const char * name, const char *param)
     ctx->cpu_cost = 0;
     ctx->cpu_start = 0;
     ctx->message_count = 0;
+    ctx->msg_cost = 0;
+    ctx->borrow = false;
+    ctx->timer_batch = false;
     ctx->profile = G_NODE.profile;
 	// Should set to 0 first to avoid mtask_handle_retireall get an uninitialized handle
 	ctx->handle = 0;
@@ -227,6 +334,19 @@ mtask_context_grab(mtask_context_t *ctx)
 {
 	ATOM_INC(&ctx->ref);
 }
+//引用计数不为0时才增加引用计数，为0说明正在销毁，返回0
+int
+mtask_context_trygrab(mtask_context_t *ctx)
+{
+	int ref = ctx->ref;
+	while (ref > 0) {
+		if (ATOM_CAS(&ctx->ref, ref, ref+1)) {
+			return 1;
+		}
+		ref = ctx->ref;
+	}
+	return 0;
+}
 //回收 mtask_context
 void
 mtask_context_reserve(mtask_context_t *ctx)
@@ -246,7 +366,7 @@ delete_context(mtask_context_t *ctx)
 	mtask_module_instance_release(ctx->mod, ctx->instance); //xxx_release
 	mtask_mq_mark_release(ctx->queue);//标记消息队列删除
 	CHECKCALLING_DESTROY(ctx)
-	mtask_free(ctx);//释放ctx
+	mtask_handle_reclaim(ctx);//mtask_handle_grab 可能还在读ctx，延迟释放
 	context_dec();//减少服务数量
 }
 
@@ -303,7 +423,12 @@ dispatch_message(mtask_context_t *ctx, mtask_message_t *msg)
     // 取出消息类型, 这里的 type 是最上层的 type
 	int type = msg->sz >> MESSAGE_TYPE_SHIFT;
     // 取出消息大小，就是 msg->data 的大小
-	size_t sz = msg->sz & MESSAGE_TYPE_MASK;
+	size_t sz = msg->sz & MESSAGE_SIZE_MASK;
+	if ((msg->sz & MESSAGE_SHARED) && !ctx->borrow) {
+		// 回调可能保留(返回1)消息 之后用 mtask_free 释放 给它一份私有拷贝
+		msg->data = shared_unshare(msg->data);
+		msg->sz &= ~MESSAGE_SHARED;
+	}
 	if (ctx->logfile) {
 		mtask_log_output(ctx->logfile, msg->source, type, msg->session, msg->data, sz);
 	}
@@ -318,8 +443,17 @@ dispatch_message(mtask_context_t *ctx, mtask_message_t *msg)
     } else {
         reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
     }
-    if (!reserve_msg) {
-        mtask_free(msg->data); //释放数据
+    if (msg->sz & MESSAGE_SHARED) {
+        if (reserve_msg) {
+            mtask_error(ctx, "Shared message from %x can't be reserved", msg->source);
+        }
+        mtask_shared_release(msg->data);//释放一个引用 最后一个接收者释放数据
+    } else if (!reserve_msg) {
+        if (msg->sz & MESSAGE_SMALL) {
+            small_message_free(msg->data);//小消息的内存块放回当前线程的缓存
+        } else {
+            mtask_free(msg->data); //释放数据
+        }
     }
 	CHECKCALLING_END(ctx)
 }
@@ -335,13 +469,48 @@ mtask_context_dispatchall(mtask_context_t * ctx)
 	}
 }
 //消息调度
+// 自适应调度 : 队列短的服务一次处理完 不必每条消息都重新排队
+// 积压很多的服务每次最多处理一个时间片 不会饿死其它服务
+static inline int
+adaptive_batch(mtask_context_t *ctx, int length, uint32_t slice)
+{
+	if (ctx->msg_cost == 0) {
+		// 还不知道消息处理的耗时 先处理少量消息来估算
+		return length < ADAPTIVE_PROBE ? length : ADAPTIVE_PROBE;
+	}
+	uint32_t n = slice / ctx->msg_cost;
+	if (n == 0)
+		return 1;
+	return (uint32_t)length < n ? length : (int)n;
+}
+//统计本次处理的平均耗时 做指数平滑 (旧值占 3/4)
+static inline void
+adaptive_cost(mtask_context_t *ctx, uint64_t start, int n)
+{
+	if (start == 0 || n == 0)
+		return;
+	uint64_t cost = (mtask_time_monotonic() - start) / n;
+	if (cost == 0)
+		cost = 1;
+	else if (cost > UINT32_MAX)
+		cost = UINT32_MAX;
+	if (ctx->msg_cost == 0) {
+		ctx->msg_cost = (uint32_t)cost;
+	} else {
+		ctx->msg_cost = (uint32_t)(((uint64_t)ctx->msg_cost * 3 + cost) / 4);
+	}
+}
+
 message_queue_t * 
 mtask_context_message_dispatch(mtask_monitor_t *sm, message_queue_t *q, int weight)
 {
 	if (q == NULL) {
 		q = mtask_globalmq_pop();//全局消息列表队列中弹出一个消息队列
-		if (q==NULL)
-			return NULL;
+		if (q==NULL) {
+			q = mtask_globalmq_steal();//空闲时从其它工作线程窃取
+			if (q==NULL)
+				return NULL;
+		}
 	}
     //由全局的消息队列得到服务的地址
 	uint32_t handle = mtask_mq_handle(q);
@@ -354,17 +523,35 @@ mtask_context_message_dispatch(mtask_monitor_t *sm, message_queue_t *q, int weig
 	}
 
 	int i,n=1;
-	mtask_message_t msg;
+	//一次加锁从服务的消息队列中批量取出的消息 index 为下一条要处理的位置
+	mtask_message_t batch[DISPATCH_BATCH];
+	int index = 0, count = 0;
+	uint32_t slice = G_NODE.dispatch_slice;
+	uint64_t start = slice ? mtask_time_monotonic() : 0;
 
 	for (i=0;i<n;i++) {
-		if (mtask_mq_pop(q,&msg)) { //从服务的消息队列中弹出一条服务消息
-			mtask_context_release(ctx);//返回1说明消息队列中已经没有消息 释放 Context 结构
-			return mtask_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-            //从服务的消息队列中取出消息成功 权重为-1为只处理一条消息 权重为0就将此服务的所有消息处理完 权重大于1就处理服务的部分消息
-			n = mtask_mq_length(q);//获取消息的长度
-			n >>= weight;
+		if (index == count) {
+			//第一次只取一条 拿到队列长度后再决定这次一共处理多少条
+			int length;
+			int max = n - i < DISPATCH_BATCH ? n - i : DISPATCH_BATCH;
+			count = mtask_mq_pop_batch(q, batch, max, &length);
+			index = 0;
+			if (count == 0) {
+				adaptive_cost(ctx, start, i);
+				mtask_context_release(ctx);//返回0说明消息队列中已经没有消息 释放 Context 结构
+				return mtask_globalmq_pop();
+			} else if (i==0) {
+				if (slice) {
+					//自适应: 按队列长度和平均每条消息耗时 决定这次处理多少条
+					n = adaptive_batch(ctx, length + 1, slice);
+				} else if (weight >= 0) {
+		            //从服务的消息队列中取出消息成功 权重为-1为只处理一条消息 权重为0就将此服务的所有消息处理完 权重大于1就处理服务的部分消息
+					n = length;//剩余消息的长度
+					n >>= weight;
+				}
+			}
 		}
+		mtask_message_t msg = batch[index++];
         //消息长度超过过载阀值了
 		int overload = mtask_mq_overload(q);
 		if (overload) {
@@ -374,7 +561,7 @@ mtask_context_message_dispatch(mtask_monitor_t *sm, message_queue_t *q, int weig
 		mtask_monitor_trigger(sm, msg.source , handle);
 
 		if (ctx->cb == NULL) {
-			mtask_free(msg.data);
+			message_free(msg.data, msg.sz);
 		} else {
 			dispatch_message(ctx, &msg);//调度消息
 		}
@@ -382,6 +569,7 @@ mtask_context_message_dispatch(mtask_monitor_t *sm, message_queue_t *q, int weig
 		mtask_monitor_trigger(sm, 0,0);
 	}
 
+	adaptive_cost(ctx, start, i);
 	assert(q == ctx->queue);
 	message_queue_t *nq = mtask_globalmq_pop();
 	if (nq) {
@@ -448,10 +636,36 @@ cmd_timeout(mtask_context_t * context, const char * param)
 	char * session_ptr = NULL;
 	int ti = (int)strtol(param, &session_ptr, 10);
 	int session = mtask_context_newsession(context);
-	mtask_timeout(context->handle, ti, session);
+	mtask_timeout(context->handle, ti, session, context->timer_batch);
 	sprintf(context->result, "%d", session);
 	return context->result;
 }
+//注册可取消的定时器 返回定时器 id
+uint32_t
+mtask_timer_new(mtask_context_t * context, int time, int *session)
+{
+	*session = mtask_context_newsession(context);
+	return mtask_timeout_add(context->handle, (int64_t)time * 10, *session, context->timer_batch);
+}
+//注册可取消的定时器 单位为毫秒
+uint32_t
+mtask_timer_newms(mtask_context_t * context, int ms, int *session)
+{
+	*session = mtask_context_newsession(context);
+	return mtask_timeout_add(context->handle, ms, *session, context->timer_batch);
+}
+//取消定时器 返回定时器的 session
+int
+mtask_timer_cancel(mtask_context_t * context, uint32_t id)
+{
+	return mtask_timeout_cancel(context->handle, id);
+}
+//定时器合并投递 只影响之后加入的定时器
+void
+mtask_timer_batch(mtask_context_t * context, int enable)
+{
+	context->timer_batch = (bool)enable;
+}
 //C API 注册一个别名
 static const char *
 cmd_reg(mtask_context_t * context, const char * param)
@@ -641,6 +855,29 @@ cmd_stat(mtask_context_t * context, const char * param)
         }
     } else if (strcmp(param, "message") == 0) {
         sprintf(context->result, "%d", context->message_count);
+    } else if (strncmp(param, "name", 4) == 0) {
+        // 全局名字表: namecount 名字个数 nameslot 哈希桶个数 namelookup 查找次数 nameprobe 查找比较的节点总数
+        static const char * what[4] = { "namecount", "nameslot", "namelookup", "nameprobe" };
+        uint64_t stat[4];
+        int i;
+        context->result[0] = '\0';
+        for (i=0;i<4;i++) {
+            if (strcmp(param, what[i]) == 0) {
+                mtask_handle_namestat(stat);
+                sprintf(context->result, "%" PRIu64, stat[i]);
+                break;
+            }
+        }
+    } else if (strcmp(param, "timeradd") == 0 || strcmp(param, "timercontend") == 0) {
+        // 定时器: timeradd 加入的定时器个数 timercontend 定时器分片锁冲突次数
+        uint64_t stat[2];
+        mtask_timer_stat(stat);
+        sprintf(context->result, "%" PRIu64, stat[param[5] == 'c']);
+    } else if (strcmp(param, "socketwrite") == 0 || strcmp(param, "socketwbytes") == 0) {
+        // socket: socketwrite tcp 写的系统调用次数 socketwbytes tcp 写出的字节数
+        uint64_t stat[2];
+        mtask_socket_stat(stat);
+        sprintf(context->result, "%" PRIu64, stat[param[7] == 'b']);
     } else {
         context->result[0] = '\0';
     }
@@ -712,6 +949,69 @@ cmd_signal(mtask_context_t * context, const char * param)
 	return NULL;
 }
 
+//工作窃取调度计数 param 为 "工作线程编号 local|global|steal|fail" 未开启工作窃取或编号越界返回NULL
+static const char *
+cmd_sched(mtask_context_t * context, const char * param)
+{
+	if (param == NULL)
+		return NULL;
+	char * endptr = NULL;
+	int id = (int)strtol(param, &endptr, 10);
+	uint64_t stat[4];
+	if (endptr == param || !mtask_mq_worker_stat(id, stat))
+		return NULL;
+	while (*endptr == ' ')
+		++endptr;
+	int index;
+	if (strcmp(endptr, "local") == 0) {
+		index = 0;
+	} else if (strcmp(endptr, "global") == 0) {
+		index = 1;
+	} else if (strcmp(endptr, "steal") == 0) {
+		index = 2;
+	} else if (strcmp(endptr, "fail") == 0) {
+		index = 3;
+	} else {
+		return NULL;
+	}
+	sprintf(context->result, "%" PRIu64, stat[index]);
+	return context->result;
+}
+
+//服务的网络流量 param 为 "服务地址 socket|read|write|rmsg|wmsg|rcall|wcall|wbuffer" 汇总这个服务所有 socket 的计数
+static const char *
+cmd_netstat(mtask_context_t * context, const char * param)
+{
+    static const char * what[MTASK_SOCKET_NETSTAT_N] = { "read", "write", "rmsg", "wmsg", "rcall", "wcall", "wbuffer" };
+    if (param == NULL)
+        return NULL;
+    const char * field = strchr(param, ' ');
+    if (field == NULL)
+        return NULL;
+    char address[field - param + 1];
+    memcpy(address, param, field - param);
+    address[field - param] = '\0';
+    uint32_t handle = tohandle(context, address);
+    if (handle == 0)
+        return NULL;
+    while (*field == ' ')
+        ++field;
+    uint64_t stat[MTASK_SOCKET_NETSTAT_N];
+    int n = mtask_socket_netstat(handle, stat);
+    if (strcmp(field, "socket") == 0) {
+        sprintf(context->result, "%d", n);
+        return context->result;
+    }
+    int i;
+    for (i=0;i<MTASK_SOCKET_NETSTAT_N;i++) {
+        if (strcmp(field, what[i]) == 0) {
+            sprintf(context->result, "%" PRIu64, stat[i]);
+            return context->result;
+        }
+    }
+    return NULL;
+}
+
 static struct command_func cmd_funcs[] = {
     { "TIMEOUT", cmd_timeout },
     { "REG", cmd_reg },
@@ -729,6 +1029,8 @@ static struct command_func cmd_funcs[] = {
     { "LOGON", cmd_logon },
     { "LOGOFF", cmd_logoff },
     { "SIGNAL", cmd_signal },
+    { "SCHED", cmd_sched },
+    { "NETSTAT", cmd_netstat },
 	{ NULL, NULL },
 };
 // 使用了简单的文本协议 来 cmd 操作 mtask的服务
@@ -755,10 +1057,13 @@ mtask_command(mtask_context_t * context, const char * cmd , const char * param)
 static void
 _filter_args(mtask_context_t * context, int type, int *session, void ** data, size_t * sz)
 {
-	int needcopy = !(type & PTYPE_TAG_DONTCOPY);
+	int shared = type & PTYPE_TAG_SHARED;
+	int needcopy = !(type & (PTYPE_TAG_DONTCOPY | PTYPE_TAG_SHARED));
     // type中含有 PTYPE_TAG_ALLOCSESSION ，则session必须是0
 	int allocsession = type & PTYPE_TAG_ALLOCSESSION;
 	type &= 0xff;
+	// 长度的高位会被当成标记和类型 调用前要先检查过长度
+	assert((*sz & MESSAGE_SIZE_MASK) == *sz);
 
 	if (allocsession) {
 		assert(*session == 0);
@@ -767,10 +1072,21 @@ _filter_args(mtask_context_t * context, int type, int *session, void ** data, si
 	}
 
 	if (needcopy && *data) {
-		char * msg = mtask_malloc(*sz+1);
-		memcpy(msg, *data, *sz);
-		msg[*sz] = '\0';
-		*data = msg;
+		char * msg;
+		if (*sz < SMALL_MESSAGE_SIZE) {
+			msg = small_message_alloc();
+			memcpy(msg, *data, *sz);
+			msg[*sz] = '\0';
+			*data = msg;
+			*sz |= MESSAGE_SMALL;
+		} else {
+			msg = mtask_malloc(*sz+1);
+			memcpy(msg, *data, *sz);
+			msg[*sz] = '\0';
+			*data = msg;
+		}
+	} else if (shared) {
+		*sz |= MESSAGE_SHARED;
 	}
 
 	*sz |= (size_t)type << MESSAGE_TYPE_SHIFT;
@@ -783,9 +1099,13 @@ _filter_args(mtask_context_t * context, int type, int *session, void ** data, si
 int
 mtask_send(mtask_context_t * context, uint32_t source, uint32_t destination , int type, int session, void * data, size_t sz)
 {
-	if ((sz & MESSAGE_TYPE_MASK) != sz) {
+	if ((sz & MESSAGE_SIZE_MASK) != sz) {
 		mtask_error(context, "The message to %x is too large", destination);
-		mtask_free(data);
+		if (type & PTYPE_TAG_SHARED) {
+			mtask_shared_release(data);
+		} else {
+			mtask_free(data);
+		}
 		return -1;
 	}
     // 会将类型封装在真正消息中的 sz 的高八位中，并且分配 session
@@ -796,14 +1116,20 @@ mtask_send(mtask_context_t * context, uint32_t source, uint32_t destination , in
 	}
 
 	if (destination == 0) {
+		if (sz & MESSAGE_SHARED) {
+			mtask_shared_release(data);
+		}
 		return session;
 	}
     //destination是否远程消息
 	if (mtask_harbor_message_isremote(destination)) {
+		if (sz & MESSAGE_SHARED) {
+			data = shared_unshare(data);//harbor 服务用 mtask_free 释放
+		}
 		struct remote_message * rmsg = mtask_malloc(sizeof(*rmsg));
 		rmsg->destination.handle = destination;
 		rmsg->message = data;
-		rmsg->sz = sz;
+		rmsg->sz = sz & ~MESSAGE_FLAGS;//远程消息由 harbor 服务用 mtask_free 释放
 		mtask_harbor_send(rmsg, source, session);//将消息发送到其他远程节点
 	} else { //如果目的地址是本地节点的
 		mtask_message_t smsg;//本机消息直接压入对应的消息队列
@@ -813,7 +1139,7 @@ mtask_send(mtask_context_t * context, uint32_t source, uint32_t destination , in
 		smsg.sz = sz;
         //将消息压入到目的地址服务的消息队列中供work线程取出
 		if (mtask_context_push(destination, &smsg)) {
-			mtask_free(data);
+			message_free(data, sz);
 			return -1;
 		}
 	}
@@ -837,18 +1163,32 @@ mtask_sendname(mtask_context_t * context, uint32_t source, const char * addr , i
             //不需要copy的消息类型
 			if (type & PTYPE_TAG_DONTCOPY) {
 				mtask_free(data);
+			} else if (type & PTYPE_TAG_SHARED) {
+				mtask_shared_release(data);
 			}
 			return -1;
 		}
 	} else {
         // 其他的目的地址 即远程的地址
+		if ((sz & MESSAGE_SIZE_MASK) != sz) {
+			mtask_error(context, "The message to %s is too large", addr);
+			if (type & PTYPE_TAG_DONTCOPY) {
+				mtask_free(data);
+			} else if (type & PTYPE_TAG_SHARED) {
+				mtask_shared_release(data);
+			}
+			return -1;
+		}
 		_filter_args(context, type, &session, (void **)&data, &sz);
+		if (sz & MESSAGE_SHARED) {
+			data = shared_unshare(data);
+		}
         //生成远程消息
 		struct remote_message * rmsg = mtask_malloc(sizeof(*rmsg));
 		copy_name(rmsg->destination.name, addr);
 		rmsg->destination.handle = 0;
 		rmsg->message = data;
-		rmsg->sz = sz;
+		rmsg->sz = sz & ~MESSAGE_FLAGS;
         //将消息放入harbor服务的消息队列
 		mtask_harbor_send(rmsg, source, session);
 		return session;
@@ -867,8 +1207,15 @@ void
 mtask_callback(mtask_context_t * context, void *ud, mtask_cb cb)
 {
 	context->cb = cb;       //服务的消息处理函数
+	context->borrow = false;
 	context->cb_ud = ud;    //服务结构
 }
+
+void
+mtask_callback_borrow(mtask_context_t * context, int enable)
+{
+	context->borrow = (bool)enable;
+}
 //向本地ctx服务发送一条消息
 void
 mtask_context_send(mtask_context_t * ctx, void * msg, size_t sz, uint32_t source, int type, int session)
@@ -914,3 +1261,9 @@ mtask_profile_enable(int enable)
 {
     G_NODE.profile = (bool)enable;
 }
+//自适应调度 每次处理一个服务的消息最多占用 usec 微秒 0为关闭(使用工作线程的权重)
+void
+mtask_dispatch_slice(int usec)
+{
+    G_NODE.dispatch_slice = usec > 0 ? (uint32_t)usec * 1000 : 0;
+}
@@ -11,6 +11,7 @@
 mtask_context_t * mtask_context_new(const char * name, const char * parm);
 //获取mtask_context 添加引用计数
 void mtask_context_grab(mtask_context_t *);
+int mtask_context_trygrab(mtask_context_t *);
 
 void mtask_context_reserve(mtask_context_t *ctx);
 
@@ -39,5 +40,7 @@ void mtask_global_exit(void);
 void mtask_thread_init(int m);
 
 void mtask_profile_enable(int enable);
+// adaptive dispatch: time slice per service queue in micro second, 0 to use worker weight
+void mtask_dispatch_slice(int usec);
 
 #endif
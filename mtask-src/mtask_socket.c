@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -11,12 +12,18 @@
 #include "socket_server.h"
 #include "mtask_socket.h"
 
+#if MTASK_SOCKET_NETSTAT_N != SOCKET_NETSTAT_N || MTASK_SOCKET_NETSTAT_WBUFFER != SOCKET_NETSTAT_WBUFFER
+#error "MTASK_SOCKET_NETSTAT_* must match SOCKET_NETSTAT_*"
+#endif
+
 static socket_server_t * SOCKET_SERVER = NULL;
 
-void 
-mtask_socket_init()
+// thread 个 socket 线程 每个线程轮询一个分片 max 为 socket 数上限 失败返回 -1
+int 
+mtask_socket_init(int thread, int reuseport, int max)
 {
-	SOCKET_SERVER = socket_server_create();
+	SOCKET_SERVER = socket_server_create_shard(thread, reuseport, max);
+	return SOCKET_SERVER ? 0 : -1;
 }
 
 void
@@ -32,6 +39,63 @@ mtask_socket_free()
 	SOCKET_SERVER = NULL;
 }
 
+int
+mtask_socket_uring()
+{
+	return socket_server_uring(SOCKET_SERVER);
+}
+
+void
+mtask_socket_resolver(int ttl, const char *server)
+{
+	if (socket_server_resolver(SOCKET_SERVER, ttl, server)) {
+		fprintf(stderr, "Invalid dns_server %s\n", server);
+	}
+}
+
+void
+mtask_socket_stat(uint64_t stat[2])
+{
+	socket_server_stat(SOCKET_SERVER, stat);
+}
+
+struct socket_info *
+mtask_socket_info()
+{
+	return socket_server_info(SOCKET_SERVER);
+}
+
+void
+mtask_socket_info_release(struct socket_info *si)
+{
+	socket_server_info_release(si);
+}
+
+int
+mtask_socket_netstat(uint32_t handle, uint64_t stat[MTASK_SOCKET_NETSTAT_N])
+{
+	return socket_server_netstat(SOCKET_SERVER, handle, stat);
+}
+
+// MTASK_SOCKET_TYPE_DATA 的数据块用完后还给 socket 线程的池 sz 为消息中的数据长度
+void
+mtask_socket_recycle(void *buffer, int sz)
+{
+	if (SOCKET_SERVER) {
+		socket_server_recycle(SOCKET_SERVER, buffer, sz);
+	} else {
+		mtask_free(buffer);
+	}
+}
+
+void
+mtask_socket_recycle_flush()
+{
+	if (SOCKET_SERVER) {
+		socket_server_recycle_flush(SOCKET_SERVER);
+	}
+}
+
 // mainloop thread 将数据压入相应服务的消息队列
 static void
 forward_message(int type, bool padding, socket_message_t * result)
@@ -73,12 +137,12 @@ forward_message(int type, bool padding, socket_message_t * result)
         mtask_free(sm);
     }
 }
-//检查socket事件 并且做转发
+//检查socket事件 并且做转发 shard 为 socket 线程的编号
 int 
-mtask_socket_poll()
+mtask_socket_poll(int shard)
 {
-	socket_server_t *ss = SOCKET_SERVER;
-	assert(ss);
+	assert(SOCKET_SERVER);
+	socket_server_t *ss = socket_server_shard(SOCKET_SERVER, shard);
 	socket_message_t result;
 	int more = 1;
     //检测socket事件
@@ -110,6 +174,9 @@ mtask_socket_poll()
         case SOCKET_WARNING:
             forward_message(MTASK_SOCKET_TYPE_WARNING, false, &result);
             break;
+        case SOCKET_UDP_BATCH:
+            forward_message(MTASK_SOCKET_TYPE_UDP_BATCH, false, &result);
+            break;
         default:
             mtask_error(NULL, "Unknown socket message type %d.",type);
             return -1;
@@ -182,6 +249,30 @@ mtask_socket_nodelay(mtask_context_t *ctx, int id)
 	socket_server_nodelay(SOCKET_SERVER, id);
 }
 
+void
+mtask_socket_pause(mtask_context_t *ctx, int id)
+{
+	socket_server_pause(SOCKET_SERVER, id);
+}
+
+void
+mtask_socket_resume(mtask_context_t *ctx, int id)
+{
+	socket_server_resume(SOCKET_SERVER, id);
+}
+
+void
+mtask_socket_coalesce(mtask_context_t *ctx, int id, int usec, int size)
+{
+	socket_server_coalesce(SOCKET_SERVER, id, usec, size);
+}
+
+void
+mtask_socket_flush(mtask_context_t *ctx, int id)
+{
+	socket_server_flush(SOCKET_SERVER, id);
+}
+
 int 
 mtask_socket_udp(mtask_context_t *ctx, const char * addr, int port)
 {
@@ -214,3 +305,9 @@ mtask_socket_udp_address(mtask_socket_message_t *msg, int *addrsz)
 	sm.data = msg->buffer;
 	return (const char *)socket_server_udp_address(SOCKET_SERVER, &sm, addrsz);
 }
+
+const char *
+mtask_socket_udp_batch(const char *buffer, int index, int *sz, const char **address, int *addrsz)
+{
+	return socket_server_udp_batch(SOCKET_SERVER, buffer, index, sz, address, addrsz);
+}
@@ -10,6 +10,7 @@
 #define MTASK_SOCKET_TYPE_ERROR     5
 #define MTASK_SOCKET_TYPE_UDP       6
 #define MTASK_SOCKET_TYPE_WARNING   7
+#define MTASK_SOCKET_TYPE_UDP_BATCH 8
 
 struct mtask_socket_message_s {
     int type; //消息类型
@@ -19,14 +20,40 @@ struct mtask_socket_message_s {
 };
 
 typedef struct mtask_socket_message_s mtask_socket_message_t;
-//初始化socket
-void mtask_socket_init();
+//初始化socket thread 为 socket 线程数 reuseport 为监听时每个线程 listen 一个 SO_REUSEPORT 的 fd
+//max 为 socket 数上限 0 为每个 socket 线程 64K
+int mtask_socket_init(int thread, int reuseport, int max);
 //退出
 void mtask_socket_exit();
 //释放
 void mtask_socket_free();
-//事件循环
-int mtask_socket_poll();
+//事件循环 每个 socket 线程轮询自己的分片
+int mtask_socket_poll(int shard);
+//使用 io_uring 收数据 不支持时仍然使用 epoll 返回 -1
+int mtask_socket_uring();
+//域名解析 ttl 为缓存的秒数 server 为 "ip[:port]" NULL 时使用系统配置
+void mtask_socket_resolver(int ttl, const char *server);
+//统计 stat[0] tcp 写的系统调用次数 stat[1] tcp 写出的字节数
+void mtask_socket_stat(uint64_t stat[2]);
+//所有 socket 的流量统计 链表 用 mtask_socket_info_release 释放 结构见 socket_server.h
+struct socket_info;
+struct socket_info * mtask_socket_info();
+void mtask_socket_info_release(struct socket_info *si);
+//按服务汇总流量统计的下标 与 socket_server.h 的 SOCKET_NETSTAT_* 一致
+#define MTASK_SOCKET_NETSTAT_READ       0
+#define MTASK_SOCKET_NETSTAT_WRITE      1
+#define MTASK_SOCKET_NETSTAT_RMSG       2
+#define MTASK_SOCKET_NETSTAT_WMSG       3
+#define MTASK_SOCKET_NETSTAT_RCALL      4
+#define MTASK_SOCKET_NETSTAT_WCALL      5
+#define MTASK_SOCKET_NETSTAT_WBUFFER    6
+#define MTASK_SOCKET_NETSTAT_N          7
+//按服务汇总流量统计 stat 有 MTASK_SOCKET_NETSTAT_N 项 返回这个服务的 socket 数
+int mtask_socket_netstat(uint32_t handle, uint64_t stat[MTASK_SOCKET_NETSTAT_N]);
+//MTASK_SOCKET_TYPE_DATA 的数据块用完后调用 还给 socket 线程的池而不是 mtask_free sz 为消息中的数据长度
+void mtask_socket_recycle(void *buffer, int sz);
+//把本线程攒着的数据块马上还回去 工作线程停靠和退出前调用
+void mtask_socket_recycle_flush();
 
 int mtask_socket_send(mtask_context_t *ctx, int id, void *buffer, int sz);
 
@@ -45,6 +72,14 @@ void mtask_socket_shutdown(mtask_context_t *ctx, int id);
 void mtask_socket_start(mtask_context_t *ctx, int id);
 
 void mtask_socket_nodelay(mtask_context_t *ctx, int id);
+// 暂停/恢复读 暂停期间数据留在内核缓冲区 由 tcp 流控挡住对端
+void mtask_socket_pause(mtask_context_t *ctx, int id);
+
+void mtask_socket_resume(mtask_context_t *ctx, int id);
+// 合并写 发送先留在发送队列 达到 size 字节、第一个包之后 usec 微秒或者 flush 时一起写出 两项都为 0 时关闭
+void mtask_socket_coalesce(mtask_context_t *ctx, int id, int usec, int size);
+
+void mtask_socket_flush(mtask_context_t *ctx, int id);
 
 int mtask_socket_udp(mtask_context_t *ctx, const char * addr, int port);
 
@@ -53,5 +88,7 @@ int mtask_socket_udp_connect(mtask_context_t *ctx, int id, const char * addr, in
 int mtask_socket_udp_send(mtask_context_t *ctx, int id, const char * address, const void *buffer, int sz);
 
 const char * mtask_socket_udp_address(mtask_socket_message_t *, int *addrsz);
+//MTASK_SOCKET_TYPE_UDP_BATCH 的数据块中第 index 个包和它的地址 没有了返回 NULL 数据块整个用完后 mtask_socket_recycle
+const char * mtask_socket_udp_batch(const char *buffer, int index, int *sz, const char **address, int *addrsz);
 
 #endif
@@ -17,15 +17,35 @@
 #include "mtask_socket.h"
 #include "mtask_daemon.h"
 #include "mtask_harbor.h"
+#include "mtask_atomic.h"
 
+#define WORKER_SPIN_MIN 16          //工作线程空闲时自旋检查的最少次数
+#define WORKER_SPIN_MAX 4096        //自旋次数上限 自旋等到了工作就加倍 否则减半
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __asm__ __volatile__("pause")
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX()
+#endif
+
+//工作线程的停靠点 每个工作线程一个 唤醒时只通知指定的线程
+struct worker_park {
+	pthread_cond_t cond;
+	pthread_mutex_t mutex;
+	int parked;                 //1 表示已停靠 等待唤醒 由唤醒者或自己 CAS 清零
+	int wakeup;                 //唤醒标志 防止虚假唤醒
+} __attribute__((aligned(64)));
 
 //监控结构
 struct monitor {
 	int count;                  //工作线程数量
 	mtask_monitor_t ** m;  //monitor 工作线程监控列表
-	pthread_cond_t cond;        //条件变量
-	pthread_mutex_t mutex;      //互斥锁
-	int sleep;                  //睡眠中工作线程数量
+	struct worker_park *park;   //工作线程停靠点
+	int sleep;                  //停靠中工作线程数量
+	int spinning;               //自旋中(空闲但还没有停靠)还没有被唤醒抵掉的工作线程数量
+	int next;                   //下一次唤醒开始查找的位置
 	int quit;
 };
 //工作线程参数
@@ -54,32 +74,112 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg)
 		exit(1);
 	}
 }
-//当睡眠线程的数量 >一定数量才唤醒一个线程
 static void
-wakeup(struct monitor *m, int busy)
+unpark(struct worker_park *p)
+{
+	pthread_mutex_lock(&p->mutex);
+	p->wakeup = 1;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+}
+//有消息队列变为可运行时调用 只唤醒一个停靠中的工作线程 没有停靠的线程就什么都不做
+static void
+wakeup(void *ud)
+{
+	struct monitor *m = ud;
+	// pair with ATOM_INC(&m->sleep) in park(): either we see the sleeper, or it sees the queue
+	ATOM_SYNC();
+	if (ATOM_LOAD(&m->sleep) == 0)
+		return;
+	// 自旋中的工作线程会取走这个队列 不必再唤醒 但它只取一个 所以每个自旋的线程只抵掉一次唤醒
+	int spinning = ATOM_LOAD(&m->spinning);
+	while (spinning > 0) {
+		if (ATOM_CAS(&m->spinning, spinning, spinning - 1))
+			return;
+		spinning = ATOM_LOAD(&m->spinning);
+	}
+	int i;
+	int n = m->count;
+	int start = m->next;
+	for (i=0;i<n;i++) {
+		int id = (start + i) % n;
+		struct worker_park *p = &m->park[id];
+		if (ATOM_LOAD(&p->parked) && ATOM_CAS(&p->parked, 1, 0)) {
+			ATOM_DEC(&m->sleep);
+			m->next = (id + 1) % n;
+			unpark(p);
+			return;
+		}
+	}
+}
+//工作线程无事可做时停靠 直到被 wakeup 指定唤醒
+static void
+park(struct monitor *m, int id)
+{
+	struct worker_park *p = &m->park[id];
+	// 停靠可能很久 攒着的数据块先还给 socket 线程
+	mtask_socket_recycle_flush();
+	pthread_mutex_lock(&p->mutex);
+	p->wakeup = 0;
+	ATOM_STORE(&p->parked, 1);
+	ATOM_INC(&m->sleep);
+	// 停靠前再检查一次 避免错过停靠过程中压入的消息队列
+	if ((mtask_globalmq_runnable() || m->quit) && ATOM_CAS(&p->parked, 1, 0)) {
+		ATOM_DEC(&m->sleep);
+	} else {
+		// "spurious wakeup" is harmless,
+		// because mtask_context_message_dispatch() can be call at any time.
+		while (!p->wakeup && !m->quit) {
+			pthread_cond_wait(&p->cond, &p->mutex);
+		}
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
+//结束自旋 计数已经被 wakeup 抵掉时不再减 之后停靠前还会再检查一次队列
+static void
+spin_leave(struct monitor *m)
+{
+	int spinning = ATOM_LOAD(&m->spinning);
+	while (spinning > 0 && !ATOM_CAS(&m->spinning, spinning, spinning - 1)) {
+		spinning = ATOM_LOAD(&m->spinning);
+	}
+}
+//自旋等待可运行的消息队列 返回1表示等到了
+static int
+spin(struct monitor *m, int *budget)
 {
-	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
+	int i;
+	ATOM_INC(&m->spinning);
+	for (i=0;i<*budget;i++) {
+		if (mtask_globalmq_runnable() || m->quit) {
+			spin_leave(m);
+			if (*budget > 0 && *budget < WORKER_SPIN_MAX)
+				*budget *= 2;
+			return 1;
+		}
+		CPU_RELAX();
 	}
+	spin_leave(m);
+	if (*budget > WORKER_SPIN_MIN)
+		*budget /= 2;
+	return 0;
 }
-//socket线程
+//socket线程 参数为线程编号 每个线程轮询一个分片
 static void *
 thread_socket(void *p)
 {
+	int shard = *(int *)p;
     pthread_setname_np("thread_socket");
-	struct monitor * m = p; //接入monitor结构
 	mtask_thread_init(THREAD_SOCKET);//设置线程局部存储 G_NODE.handle_key 为 THREAD_SOCKET
     //检测网络事件（epoll管理的网络事件）并且将事件放入消息队列 mtask_socket_poll--->mtask_context_push
 	for (;;) {
-		int r = mtask_socket_poll();
+		int r = mtask_socket_poll(shard);
 		if (r==0)
 			break;
 		if (r<0) {
 			CHECK_ABORT
 			continue;
 		}
-		wakeup(m,0);
 	}
 	return NULL;
 }
@@ -92,8 +192,11 @@ free_monitor(struct monitor *m)
 	for (i=0;i<n;i++) {
 		mtask_monitor_delete(m->m[i]);//删除mtask_monitor结构
 	}
-	pthread_mutex_destroy(&m->mutex);//删除互斥锁
-	pthread_cond_destroy(&m->cond); //删除条件变量
+	for (i=0;i<n;i++) {
+		pthread_mutex_destroy(&m->park[i].mutex);//删除互斥锁
+		pthread_cond_destroy(&m->park[i].cond); //删除条件变量
+	}
+	mtask_free(m->park);
 	mtask_free(m->m);//释放监视中的mtask_monitor数组指针
 	mtask_free(m);   //释放监视结构
 }
@@ -143,10 +246,9 @@ thread_timer(void *p)
 	struct monitor * m = p;
 	mtask_thread_init(THREAD_TIMER);
 	for (;;) {
-		mtask_time_update();//更新 定时器 的时间
+		mtask_time_update();//更新 定时器 的时间 到期的定时器压入消息时会唤醒工作线程
 		CHECK_ABORT
-		wakeup(m,m->count-1);//只要有一个线程睡眠就唤醒 让工作线程动起来
-		usleep(2500);//睡眠2500微妙（1秒=1000000微秒）0.025秒
+		mtask_time_sleep();//睡眠2500微秒 tickless 模式下睡到下一个定时器到期
         if (SIG) {
             signal_hup();
             SIG = 0;
@@ -155,10 +257,11 @@ thread_timer(void *p)
 	// wakeup socket thread
 	mtask_socket_exit();
 	// wakeup all worker thread
-	pthread_mutex_lock(&m->mutex);
-	m->quit = 1;    //设置退出标志
-	pthread_cond_broadcast(&m->cond);//唤醒所有等待条件变量的线程
-	pthread_mutex_unlock(&m->mutex);
+	ATOM_STORE(&m->quit, 1);    //设置退出标志
+	int i;
+	for (i=0;i<m->count;i++) {
+		unpark(&m->park[i]);//唤醒所有停靠的工作线程
+	}
 	return NULL;
 }
 // 工作线程的作用是从全局的消息队列中取出单个服务的消息队列，再从服务的消息队列中取出消息，
@@ -173,33 +276,71 @@ thread_worker(void *p)
 	struct monitor *m = wp->m;
 	mtask_monitor_t *sm = m->m[id];//通过线程id拿到监视器结构（mtask_monitor）
 	mtask_thread_init(THREAD_WORKER);
+	mtask_mq_worker_bind(id);//工作窃取模式下绑定本地运行队列
 	message_queue_t * q = NULL;
+	//单核机器上自旋只会占着CPU让生产者跑不了 直接停靠
+	int budget = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WORKER_SPIN_MIN : 0;
 	while (!m->quit) {
         //消息调度执行（取出消息 执行服务中的回调函数）每个服务都有一个权重
 		q = mtask_context_message_dispatch(sm, q, weight);
 		if (q == NULL) {
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;//进入睡眠
-				// "spurious wakeup" is harmless,
-				// because mtask_context_message_dispatch() can be call at any time.
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);//没有消息则进入睡眠等待唤醒
-				-- m->sleep;//唤醒后减少睡眠线程数量
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
+			//没有消息 先自旋一会 仍然没有就停靠等待唤醒
+			if (!spin(m, &budget)) {
+				park(m, id);
 			}
 		}
 	}
+	mtask_socket_recycle_flush();
 	return NULL;
 }
 
+//解析配置中的权重 "-1,-1,0,0,1" 没有配置的工作线程使用默认权重表
 static void
-start(int thread)
+parse_weight(const char *str, int *weight, int thread)
 {
-    // 线程数+3 3个线程分别用于 monitor|timer|socket 监控 定时器 socket IO
-    pthread_t pid[thread+3];
+    //每个服务都有一个权重
+    //权重为-1为只处理一条消息
+    //权重为0就将此服务的所有消息处理完
+    //权重大于1就处理服务的部分消息
+	static int default_weight[] = {
+		-1, -1, -1, -1, 0, 0, 0, 0,
+		1, 1, 1, 1, 1, 1, 1, 1, 
+		2, 2, 2, 2, 2, 2, 2, 2, 
+		3, 3, 3, 3, 3, 3, 3, 3, };
+	int i;
+	for (i=0;i<thread;i++) {
+		if (i < sizeof(default_weight)/sizeof(default_weight[0])) {
+			weight[i] = default_weight[i];
+		} else {
+			weight[i] = 0;
+		}
+	}
+	if (str == NULL)
+		return;
+	int n = 0;
+	while (*str && n < thread) {
+		char *endptr;
+		long w = strtol(str, &endptr, 10);
+		if (endptr == str) {
+			fprintf(stderr, "Invalid weight : %s\n", str);
+			exit(1);
+		}
+		weight[n++] = (int)w;
+		str = endptr;
+		while (*str == ',' || *str == ' ' || *str == '\t')
+			++str;
+	}
+	//配置的个数少于工作线程数时 剩下的使用最后一个配置的权重
+	for (i=n;n>0 && i<thread;i++) {
+		weight[i] = weight[n-1];
+	}
+}
+
+static void
+start(int thread, int socket_thread, const char *weight_config)
+{
+    // 线程数+2+socket线程数 分别用于 monitor|timer|socket 监控 定时器 socket IO
+    pthread_t pid[thread+2+socket_thread];
     
 	struct monitor *m = mtask_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
@@ -211,44 +352,43 @@ start(int thread)
 	for (i=0;i<thread;i++) {
 		m->m[i] = mtask_monitor_new();//创建mtask_monitor结构放在监视列表 为每个线程新建一个监视
 	}
-	if (pthread_mutex_init(&m->mutex, NULL)) {
-		fprintf(stderr, "Init mutex error");
-		exit(1);
-	}
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
+	m->park = mtask_malloc(thread * sizeof(struct worker_park));
+	memset(m->park, 0, thread * sizeof(struct worker_park));
+	for (i=0;i<thread;i++) {
+		if (pthread_mutex_init(&m->park[i].mutex, NULL)) {
+			fprintf(stderr, "Init mutex error");
+			exit(1);
+		}
+		if (pthread_cond_init(&m->park[i].cond, NULL)) {
+			fprintf(stderr, "Init cond error");
+			exit(1);
+		}
 	}
+	mtask_globalmq_notify(wakeup, m);//消息队列变为可运行时唤醒一个停靠的工作线程
      //启动线程
 	create_thread(&pid[0], thread_monitor, m);
 	create_thread(&pid[1], thread_timer, m);
-	create_thread(&pid[2], thread_socket, m);
-    
-    //每个服务都有一个权重
-    //权重为-1为只处理一条消息
-    //权重为0就将此服务的所有消息处理完
-    //权重大于1就处理服务的部分消息
-	static int weight[] = {
-		-1, -1, -1, -1, 0, 0, 0, 0,
-		1, 1, 1, 1, 1, 1, 1, 1, 
-		2, 2, 2, 2, 2, 2, 2, 2, 
-		3, 3, 3, 3, 3, 3, 3, 3, };
+	int shard[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		shard[i] = i;
+		create_thread(&pid[2+i], thread_socket, &shard[i]);
+	}
+
+	int weight[thread];
+	parse_weight(weight_config, weight, thread);
 	struct worker_parm wp[thread];
 	for (i=0;i<thread;i++) {
 		wp[i].m = m;
 		wp[i].id = i;
-		if (i < sizeof(weight)/sizeof(weight[0])) {
-			wp[i].weight= weight[i];
-		} else {
-			wp[i].weight = 0;
-		}
+		wp[i].weight = weight[i];
         //启动多个线程: thread_worker
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
+		create_thread(&pid[i+2+socket_thread], thread_worker, &wp[i]);
 	}
 
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+2+socket_thread;i++) {
 		pthread_join(pid[i], NULL); 
 	}
+	mtask_globalmq_notify(NULL, NULL);
 
 	free_monitor(m);
 }
@@ -288,11 +428,32 @@ mtask_start(struct mtask_config * config)
 	}
 	mtask_harbor_init(config->harbor);//初始化节点编号,用来后续判断是否为非本节点的服务地址
 	mtask_handle_init(config->harbor);//初始化句柄编号和mtask_context 初始化一个 handle 就是初始化 handle_storage H
-	mtask_mq_init();                       //初始化全局队列 Q
+	mtask_mq_init(config->mq_lockfree);    //初始化全局队列 Q
+	if (config->work_steal) {
+		mtask_mq_worker_init(config->thread);//每个工作线程一个本地运行队列
+	}
 	mtask_module_init(config->module_path);//初始化模块管理，module_path 为C服务的路径
-	mtask_timer_init();                    //初始化定时器
-	mtask_socket_init();                   //初始化SOCKET_SERVER
+	if (config->timer_resolution < 1 || config->timer_resolution > 1000) {
+		fprintf(stderr, "Invalid timer_resolution %d (1-1000 ms)\n", config->timer_resolution);
+		exit(1);
+	}
+	mtask_timer_init(config->timer_tickless, config->timer_resolution);//初始化定时器
+	if (config->socket_thread < 1 || config->socket_thread > 16) {
+		fprintf(stderr, "Invalid socket_thread %d (1-16)\n", config->socket_thread);
+		exit(1);
+	}
+	if (mtask_socket_init(config->socket_thread, config->socket_reuseport, config->socket_max)) {//初始化SOCKET_SERVER
+		exit(1);
+	}
+	if (strcmp(config->socket_backend, "uring") == 0) {
+		mtask_socket_uring();//不支持 io_uring 时仍然使用 epoll
+	} else if (strcmp(config->socket_backend, "epoll") != 0) {
+		fprintf(stderr, "Invalid socket_backend %s (epoll or uring)\n", config->socket_backend);
+		exit(1);
+	}
+	mtask_socket_resolver(config->dns_cache_ttl, config->dns_server);//connect 的域名解析
     mtask_profile_enable(config->profile);
+	mtask_dispatch_slice(config->dispatch_slice);//自适应调度 为0时使用工作线程的权重
     //创建第一个服务（C 服务:logger(由于错误消息都是从logger服务写到相应的文件，所以需要先启动logger服务)
 	mtask_context_t *ctx = mtask_context_new(config->logservice, config->logger);
 	if (ctx == NULL) {
@@ -302,7 +463,7 @@ mtask_start(struct mtask_config * config)
     // 加载 snlua 模块(第二个C 服务)，并启动（snlua 服务启动） bootstrap 服务（第一个 Lua 服务）
 	bootstrap(ctx, config->bootstrap);
     //初始化工作基本完成，开启各种线程
-	start(config->thread);
+	start(config->thread, config->socket_thread, config->weight);
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	mtask_harbor_exit();        //节点管理服务退出
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #if defined(__APPLE__)
 #include <AvailabilityMacros.h>
@@ -18,8 +19,10 @@
 #include "mtask_server.h"
 #include "mtask_handle.h"
 #include "mtask_spinlock.h"
+#include "mtask_atomic.h"
 
-// mtask 定时器的实现为linux内核的标准做法  精度为 0.01s 对游戏一般来说够了 高精度的定时器很费CPU
+// mtask 定时器的实现为linux内核的标准做法  默认精度为 0.01s 对游戏一般来说够了 高精度的定时器很费CPU
+// 滴答的长度可以通过 timer_resolution 配置(毫秒)，时间轮按滴答计数，接口仍然兼容 1/100 秒的单位
 
 // 对于内核最关心的、interval值在［0，255］
 // 内核在处理是否有到期定时器时，它就只从定时器向量数组tv1.vec［256］中的某个定时器向量内进行扫描。
@@ -39,40 +42,113 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_LEVEL (1 << TIME_LEVEL_SHIFT)  //2^6=64
 #define TIME_NEAR_MASK (TIME_NEAR-1)        //255
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)      //63
+#define TIME_POLL 250           //轮询模式下定时器线程每次睡眠 1/4 个滴答 单位 微秒/毫秒精度
+#define TIME_SLEEP_MAX 1000     //tickless 模式下最多睡眠的毫秒数 定时器线程还要检查退出和 SIGHUP
+#define TIME_SLOT_SIZE 64       //可取消定时器 id 表的初始大小
+#define TIME_SHARD_BITS 4
+#define TIME_SHARD (1 << TIME_SHARD_BITS)   //定时器插入分片数 每个线程固定使用其中一个
+#define TIME_SHARD_MASK (TIME_SHARD-1)
+#define TIME_POOL_MAX 4096      //每个分片缓存的空闲 timer_node 个数上限
+
+#define TIMER_PENDING 0         //在分片的插入缓冲中 还没有合并到时间轮
+#define TIMER_WHEEL 1           //在时间轮上
+#define TIMER_FIRING 2          //已经从时间轮上取下 正在分发
 
 struct timer_event {
 	uint32_t handle;
 	int session;
+	int batch;          //和同一服务同一滴答到期的定时器合并投递
 };
 //定时器节点结构
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev;
 	uint32_t expire;    //超时滴答计数 即超时间隔
+	uint32_t id;        //可取消定时器的 id，0 表示不可取消 低 TIME_SHARD_BITS 位是分片号
+	uint16_t shard;     //分配节点的分片 节点回收到这个分片
+	uint16_t state;
+	struct timer_event event;
 };
-//定时器容器
+//定时器容器 以 head 为哨兵的双向循环链表，取消定时器时 O(1) 摘除
 struct link_list {
 	struct timer_node head;
-	struct timer_node *tail;
+};
+// 定时器插入分片: 加入定时器只锁线程自己的分片，定时器线程每个滴答把缓冲合并到时间轮
+// 可取消定时器的 id 表和空闲节点缓存也放在分片里，加入/取消/回收都不碰时间轮的锁
+struct timer_shard {
+	spinlock_t lock;
+	int dirty;                         //pending 不为空
+	struct link_list pending;          //等待合并到时间轮的定时器
+	struct timer_node * pool;          //空闲节点 用 next 串起来
+	int pool_count;
+	// 可取消定时器 id -> timer_node 的哈希表，和 handle_storage 的 slot 一样 hash = 序号 & (slot_size-1)
+	struct timer_node ** slot;
+	int slot_size;
+	int slot_count;
+	uint32_t id_index;
+	uint64_t add;                      //加入的定时器个数
+	uint64_t contend;                  //加锁时锁已被占用的次数
+} __attribute__((aligned(64)));
+// 合并投递时 一个服务在当前滴答到期的 session 列表
+struct timer_batch {
+	uint32_t handle;    //0 表示空位
+	int n;
+	int cap;
+	int * session;
 };
 
 struct timer {
     struct link_list near[TIME_NEAR];  //定时器容器数组存放不同的定时器容器 256个
     struct link_list t[4][TIME_LEVEL]; //四级梯队 四级不同的定时器
-    spinlock_t lock;              //自旋锁
+    spinlock_t lock;              //自旋锁 只有定时器线程和取消时间轮上的定时器会用到
     uint32_t time;                     //当前已经流过的滴答计数
     uint32_t starttime;                //开机启动时间绝对时间
-    uint64_t current;                  //相对时间 相对开机时间
-    uint64_t current_point;
+    uint64_t current;                  //相对时间 相对开机时间 单位为滴答
+    uint64_t current_point;            //单调时钟 单位为滴答
+    uint64_t base;                     //current_point - time 用单调时钟换算出当前滴答
+    int resolution;                    //每个滴答的毫秒数
+    uint64_t offset;                   //current - current_point tickless 模式下 mtask_now 用它换算
+    // tickless 模式: 定时器线程睡到下一个定时器到期，新加入的定时器更早到期时提前唤醒
+    int tickless;
+    int sleeping;                      //定时器线程正在睡眠
+    uint32_t wake;                     //睡眠到的滴答 加入更早的定时器时用 CAS 改小
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int shard_index;                   //下一个线程使用的分片
+    struct timer_shard shard[TIME_SHARD];
+    // handle -> timer_batch 的开放寻址哈希表 只有定时器线程使用
+    struct timer_batch * batch;
+    int batch_size;
+    int batch_count;
 };
 //定时器结构TI
 static struct timer * TI = NULL;
-// 清除链表，返回原链表第一个节点指针
+static __thread struct timer_shard * SHARD = NULL;
+
+static uint64_t gettime();
+static inline void
+link_init(struct link_list *list)
+{
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+}
+
+static inline int
+link_empty(struct link_list *list)
+{
+	return list->head.next == &list->head;
+}
+// 清除链表，返回原链表第一个节点指针 返回的链表以 NULL 结尾
 static inline struct timer_node *
 link_clear(struct link_list *list)
 {
 	struct timer_node * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	if (ret == &list->head) {
+		ret = NULL;
+	} else {
+		list->head.prev->next = NULL;
+	}
+	link_init(list);
 
 	return ret;
 }
@@ -80,9 +156,110 @@ link_clear(struct link_list *list)
 static inline void
 link(struct link_list *list,struct timer_node *node)
 {
-	list->tail->next = node;
-	list->tail = node;
-	node->next = 0;
+	struct timer_node * tail = list->head.prev;
+	tail->next = node;
+	node->prev = tail;
+	node->next = &list->head;
+	list->head.prev = node;
+}
+// 从所在的链表中摘除node
+static inline void
+unlink_node(struct timer_node *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+// 当前线程使用的分片 第一次调用时轮流分配
+static inline struct timer_shard *
+shard_get(struct timer *T)
+{
+	struct timer_shard * sh = SHARD;
+	if (sh == NULL) {
+		sh = &T->shard[ATOM_FINC(&T->shard_index) & TIME_SHARD_MASK];
+		SHARD = sh;
+	}
+	return sh;
+}
+
+static inline void
+shard_lock(struct timer_shard *sh)
+{
+	if (!spinlock_trylock(&sh->lock)) {
+		spinlock_lock(&sh->lock);
+		++sh->contend;
+	}
+}
+// 从分片的缓存中取一个节点 需持有分片的锁
+static inline struct timer_node *
+shard_alloc(struct timer *T, struct timer_shard *sh)
+{
+	struct timer_node * node = sh->pool;
+	if (node) {
+		sh->pool = node->next;
+		--sh->pool_count;
+	} else {
+		node = (struct timer_node *)mtask_malloc(sizeof(*node));
+		node->shard = (uint16_t)(sh - T->shard);
+	}
+	return node;
+}
+// 节点放回分片的缓存 需持有分片的锁
+static inline void
+shard_free(struct timer_shard *sh, struct timer_node *node)
+{
+	if (sh->pool_count < TIME_POOL_MAX) {
+		node->next = sh->pool;
+		sh->pool = node;
+		++sh->pool_count;
+	} else {
+		mtask_free(node);
+	}
+}
+// 为可取消的定时器分配 id 并记录到分片的 slot 中，需持有分片的锁
+static uint32_t
+shard_newid(struct timer *T, struct timer_shard *sh, struct timer_node *node)
+{
+	// 装载率不超过一半，查找空位的次数期望是常数
+	if (sh->slot_count * 2 >= sh->slot_size) {
+		int size = sh->slot_size * 2;
+		struct timer_node ** slot = mtask_malloc(size * sizeof(struct timer_node *));
+		memset(slot, 0, size * sizeof(struct timer_node *));
+		int i;
+		for (i=0;i<sh->slot_size;i++) {
+			struct timer_node * n = sh->slot[i];
+			if (n) {
+				slot[(n->id >> TIME_SHARD_BITS) & (size-1)] = n;
+			}
+		}
+		mtask_free(sh->slot);
+		sh->slot = slot;
+		sh->slot_size = size;
+	}
+	for (;;) {
+		uint32_t seq = sh->id_index++ & (UINT32_MAX >> TIME_SHARD_BITS);
+		struct timer_node ** n = &sh->slot[seq & (sh->slot_size-1)];
+		if (seq != 0 && *n == NULL) {
+			*n = node;
+			node->id = seq << TIME_SHARD_BITS | (uint32_t)(sh - T->shard);
+			++sh->slot_count;
+			return node->id;
+		}
+	}
+}
+
+static inline struct timer_node *
+shard_find(struct timer_shard *sh, uint32_t id)
+{
+	struct timer_node * n = sh->slot[(id >> TIME_SHARD_BITS) & (sh->slot_size-1)];
+	return (n && n->id == id) ? n : NULL;
+}
+// 定时器到期或被取消后不能再通过 id 找到，需持有分片的锁
+static inline void
+shard_delid(struct timer_shard *sh, struct timer_node *node)
+{
+	sh->slot[(node->id >> TIME_SHARD_BITS) & (sh->slot_size-1)] = NULL;
+	--sh->slot_count;
+	node->id = 0;
 }
 //添加时间节点
 static void
@@ -106,19 +283,111 @@ add_node(struct timer *T,struct timer_node *node)
 		link(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
 	}
 }
-//添加一个定时器
+// 把所有分片插入缓冲中的定时器合并到时间轮，需持有 lock
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time)
+timer_merge(struct timer *T)
 {
-	struct timer_node *node = (struct timer_node *)mtask_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
+	int i;
+	for (i=0;i<TIME_SHARD;i++) {
+		struct timer_shard * sh = &T->shard[i];
+		if (!ATOM_LOAD(&sh->dirty)) {
+			continue;
+		}
+		shard_lock(sh);
+		ATOM_STORE(&sh->dirty, 0);
+		struct timer_node * n = link_clear(&sh->pending);
+		while (n) {
+			struct timer_node * next = n->next;
+			n->state = TIMER_WHEEL;
+			// 加入时定时器线程已经处理到更晚的滴答了
+			if ((int32_t)(n->expire - T->time) < 0) {
+				n->expire = T->time;
+			}
+			add_node(T, n);
+			n = next;
+		}
+		spinlock_unlock(&sh->lock);
+	}
+}
+//添加一个定时器 cancelable 为真时分配 id 并返回
+static uint32_t
+timer_add(struct timer *T,struct timer_event *event,int time,int cancelable)
+{
+	struct timer_shard * sh = shard_get(T);
+	// 以时钟换算出的当前滴答为起点，定时器线程还没处理到(比如 tickless 模式下在睡眠)也不会提前到期
+	uint32_t now = (uint32_t)(gettime() / T->resolution - ATOM_LOAD(&T->base));
+	uint32_t expire = time + now;//在当前流过的时间基础是加上定时器时间
+
+	shard_lock(sh);
+
+	struct timer_node * node = shard_alloc(T, sh);
+	node->expire = expire;
+	node->id = 0;
+	node->state = TIMER_PENDING;
+	node->event = *event;
+	link(&sh->pending, node);
+	uint32_t id = cancelable ? shard_newid(T, sh, node) : 0;
+	++sh->add;
+	ATOM_STORE(&sh->dirty, 1);
+
+	spinlock_unlock(&sh->lock);
+
+	// 比定时器线程计划醒来的时间更早到期，需要提前唤醒它
+	// 定时器线程先标记 sleeping 再合并缓冲，这里先写缓冲再读 sleeping，两边至少有一边能看到对方
+	if (ATOM_LOAD(&T->sleeping)) {
+		uint32_t wake = ATOM_LOAD(&T->wake);
+		while ((int32_t)(expire - wake) < 0) {
+			if (ATOM_CAS(&T->wake, wake, expire)) {
+				pthread_mutex_lock(&T->mutex);
+				pthread_cond_signal(&T->cond);
+				pthread_mutex_unlock(&T->mutex);
+				break;
+			}
+			wake = ATOM_LOAD(&T->wake);
+		}
+	}
+	return id;
+}
+// 取消 handle 的定时器 id，返回定时器的 session，已经到期返回0
+static int
+timer_cancel(struct timer *T, uint32_t handle, uint32_t id)
+{
+	if (id == 0) {
+		return 0;
+	}
+	struct timer_shard * sh = &T->shard[id & TIME_SHARD_MASK];
+	int session = 0;
+
+	shard_lock(sh);
+	struct timer_node * n = shard_find(sh, id);
+	if (n && n->event.handle == handle && n->state == TIMER_PENDING) {
+		// 还在插入缓冲中 只需要分片的锁
+		unlink_node(n);
+		shard_delid(sh, n);
+		session = n->event.session;
+		shard_free(sh, n);
+		spinlock_unlock(&sh->lock);
+		return session;
+	}
+	spinlock_unlock(&sh->lock);
+	if (n == NULL) {
+		return 0;
+	}
 
+	// 已经在时间轮上 按 lock -> 分片锁 的顺序重新查找
 	SPIN_LOCK(T);
-
-    node->expire = time + T->time;//在当前流过的时间基础是加上定时器时间
-    add_node(T,node);
-
+	shard_lock(sh);
+	n = shard_find(sh, id);
+	if (n && n->event.handle == handle && n->state != TIMER_FIRING) {
+		unlink_node(n);
+		shard_delid(sh, n);
+		session = n->event.session;
+		shard_free(sh, n);
+	}
+	spinlock_unlock(&sh->lock);
 	SPIN_UNLOCK(T);
+
+	return session;
 }
 
 static void
@@ -156,23 +425,104 @@ timer_shift(struct timer *T)
 	}
 }
 
+// 记录一个合并投递的定时器
+static void
+batch_add(struct timer *T, struct timer_event *event)
+{
+	// 装载率不超过一半
+	if (T->batch_count * 2 >= T->batch_size) {
+		int size = T->batch_size * 2;
+		struct timer_batch * batch = mtask_malloc(size * sizeof(*batch));
+		memset(batch, 0, size * sizeof(*batch));
+		int i;
+		for (i=0;i<T->batch_size;i++) {
+			struct timer_batch * b = &T->batch[i];
+			if (b->handle) {
+				int h = b->handle & (size-1);
+				while (batch[h].handle) {
+					h = (h+1) & (size-1);
+				}
+				batch[h] = *b;
+			}
+		}
+		mtask_free(T->batch);
+		T->batch = batch;
+		T->batch_size = size;
+	}
+	int h = event->handle & (T->batch_size-1);
+	struct timer_batch * b;
+	for (;;) {
+		b = &T->batch[h];
+		if (b->handle == event->handle) {
+			break;
+		}
+		if (b->handle == 0) {
+			b->handle = event->handle;
+			++T->batch_count;
+			break;
+		}
+		h = (h+1) & (T->batch_size-1);
+	}
+	if (b->n >= b->cap) {
+		b->cap = b->cap ? b->cap * 2 : 16;
+		b->session = mtask_realloc(b->session, b->cap * sizeof(int));
+	}
+	b->session[b->n++] = event->session;
+}
+// 每个服务一条 PTYPE_TIMER 消息，session 数组交给消息
+static void
+batch_flush(struct timer *T)
+{
+	int i;
+	for (i=0;i<T->batch_size && T->batch_count > 0;i++) {
+		struct timer_batch * b = &T->batch[i];
+		if (b->handle == 0) {
+			continue;
+		}
+		mtask_message_t message;
+		message.source = 0;
+		message.session = 0;
+		message.data = b->session;
+		message.sz = (size_t)b->n * sizeof(int) | (size_t)PTYPE_TIMER << MESSAGE_TYPE_SHIFT;
+		if (mtask_context_push(b->handle, &message)) {
+			mtask_free(b->session);
+		}
+		memset(b, 0, sizeof(*b));
+		--T->batch_count;
+	}
+}
+
 static inline void
-dispatch_list(struct timer_node *current)
+dispatch_list(struct timer *T, struct timer_node *current)
 {
 	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
+		struct timer_node * temp = current;
+		current=current->next;
+		struct timer_event event = temp->event;
+		// 从 id 表中删除，节点回收到分配它的分片
+		struct timer_shard * sh = &T->shard[temp->shard];
+		shard_lock(sh);
+		if (temp->id) {
+			shard_delid(sh, temp);
+		}
+		shard_free(sh, temp);
+		spinlock_unlock(&sh->lock);
+
+		if (event.batch) {
+			batch_add(T, &event);
+			continue;
+		}
 		mtask_message_t message;
 		message.source = 0;
-		message.session = event->session;
+		message.session = event.session;
 		message.data = NULL;
 		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
 // 将消息发送到对应的 handle 的服务区处理 添加到handle对应的mtask_context里面的消息列表
-		mtask_context_push(event->handle, &message);
-		
-		struct timer_node * temp = current;
-		current=current->next;
-		mtask_free(temp);	
+		mtask_context_push(event.handle, &message);
 	} while (current);
+	if (T->batch_count) {
+		batch_flush(T);
+	}
 }
 // 从超时列表中取到时的消息来分发
 static inline void
@@ -180,11 +530,16 @@ timer_execute(struct timer *T)
 {
 	int idx = T->time & TIME_NEAR_MASK;
 	
-	while (T->near[idx].head.next) {
+	while (!link_empty(&T->near[idx])) {
 		struct timer_node *current = link_clear(&T->near[idx]);
+		// 离开锁之后就不能再取消了
+		struct timer_node *n;
+		for (n = current; n; n = n->next) {
+			n->state = TIMER_FIRING;
+		}
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
-		dispatch_list(current);
+		dispatch_list(T, current);
 		SPIN_LOCK(T);
 	}
 }
@@ -194,6 +549,9 @@ timer_update(struct timer *T)
 {
 	SPIN_LOCK(T);
 
+	// 先把各线程新加入的定时器合并到时间轮
+	timer_merge(T);
+
 	// try to dispatch timeout 0 (rare condition)
 	timer_execute(T);
 
@@ -204,6 +562,30 @@ timer_update(struct timer *T)
 
 	SPIN_UNLOCK(T);
 }
+// 距离下一个定时器到期的滴答数，最多返回 max，需持有 lock
+static int
+timer_next(struct timer *T, int max)
+{
+	uint32_t ct = T->time;
+	int idx = ct & TIME_NEAR_MASK;
+	int i,j;
+	// near 中保存的是当前 256 个滴答内到期的定时器 刚合并进来的定时器可能就在当前滴答
+	for (i=0;i+idx<TIME_NEAR && i<max;i++) {
+		if (!link_empty(&T->near[i+idx])) {
+			return i;
+		}
+	}
+	// 其它定时器最早也要到下一个 256 滴答的边界才会移到 near 中
+	for (i=0;i<4;i++) {
+		for (j=0;j<TIME_LEVEL;j++) {
+			if (!link_empty(&T->t[i][j])) {
+				int d = TIME_NEAR - idx;
+				return d < max ? d : max;
+			}
+		}
+	}
+	return max;
+}
 //创建定时器结构timer
 static struct timer *
 timer_create_timer()
@@ -214,63 +596,132 @@ timer_create_timer()
 	int i,j;
 
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->near[i]);
+		link_init(&r->near[i]);
 	}
 
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_clear(&r->t[i][j]);
+			link_init(&r->t[i][j]);
 		}
 	}
 
 	SPIN_INIT(r)
 
 	r->current = 0;
+	for (i=0;i<TIME_SHARD;i++) {
+		struct timer_shard * sh = &r->shard[i];
+		spinlock_init(&sh->lock);
+		link_init(&sh->pending);
+		sh->slot_size = TIME_SLOT_SIZE;
+		sh->id_index = 1;
+		sh->slot = mtask_malloc(sh->slot_size * sizeof(struct timer_node *));
+		memset(sh->slot, 0, sh->slot_size * sizeof(struct timer_node *));
+	}
+	r->batch_size = TIME_SLOT_SIZE;
+	r->batch = mtask_malloc(r->batch_size * sizeof(struct timer_batch));
+	memset(r->batch, 0, r->batch_size * sizeof(struct timer_batch));
+	pthread_mutex_init(&r->mutex, NULL);
+#if !defined(__APPLE__)
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&r->cond, &attr);
+	pthread_condattr_destroy(&attr);
+#else
+	pthread_cond_init(&r->cond, NULL);
+#endif
 
 	return r;
 }
+static int
+timeout_push(uint32_t handle, int session)
+{
+	mtask_message_t message;
+	message.source = 0;
+	message.session = session;
+	message.data = NULL;
+	message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+	return mtask_context_push(handle, &message);
+}
+// 毫秒换算成滴答 向上取整
+static int
+timeout_tick(int64_t ms)
+{
+	int64_t tick = (ms + TI->resolution - 1) / TI->resolution;
+	return tick > INT32_MAX ? INT32_MAX : (int)tick;
+}
 // 插入定时器，time的单位是0.01秒，如time=300，表示3秒
 int
-mtask_timeout(uint32_t handle, int time, int session)
+mtask_timeout(uint32_t handle, int time, int session, int batch)
 {
-	if (time == 0) { //time<0 加入消息队列
-		mtask_message_t message;
-		message.source = 0;
-		message.session = session;
-		message.data = NULL;
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+	if (time <= 0) { //time<0 加入消息队列
         // 如果time为0,把超时事件压到服务的消息队列，等待调度处理
-		if (mtask_context_push(handle, &message)) {
+		if (timeout_push(handle, session)) {
 			return -1;
 		}
 	} else {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
+		event.batch = batch;
         // time不为0，超时事件挂到时间轮上，等待超时处理
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, timeout_tick((int64_t)time * 10), 0);
 	}
 
 	return session;
 }
+// 插入可取消的定时器，单位为毫秒，返回定时器id time为0时直接投递消息，返回0
+uint32_t
+mtask_timeout_add(uint32_t handle, int64_t ms, int session, int batch)
+{
+	if (ms <= 0) {
+		timeout_push(handle, session);
+		return 0;
+	}
+	struct timer_event event;
+	event.handle = handle;
+	event.session = session;
+	event.batch = batch;
+	return timer_add(TI, &event, timeout_tick(ms), 1);
+}
+// 取消定时器 返回定时器的 session，定时器已经到期(消息已投递)返回0
+int
+mtask_timeout_cancel(uint32_t handle, uint32_t id)
+{
+	return timer_cancel(TI, handle, id);
+}
+// stat[0] 加入的定时器个数 stat[1] 加入/取消/回收时分片锁冲突的次数
+void
+mtask_timer_stat(uint64_t stat[2])
+{
+	int i;
+	stat[0] = stat[1] = 0;
+	for (i=0;i<TIME_SHARD;i++) {
+		struct timer_shard * sh = &TI->shard[i];
+		shard_lock(sh);
+		stat[0] += sh->add;
+		stat[1] += sh->contend;
+		spinlock_unlock(&sh->lock);
+	}
+}
 
-// centisecond: 1/100 second
+// millisecond: 1/1000 second
 static void
-systime(uint32_t *sec, uint32_t *cs)
+systime(uint32_t *sec, uint32_t *ms)
 {
 #if !defined(__APPLE__) || defined(AVAILABLE_MAC_OS_X_VERSION_10_12_AND_LATER)
 	struct timespec ti;
 	clock_gettime(CLOCK_REALTIME, &ti);
 	*sec = (uint32_t)ti.tv_sec;
-	*cs = (uint32_t)(ti.tv_nsec / 10000000);
+	*ms = (uint32_t)(ti.tv_nsec / 1000000);
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	*sec = (uint32_t)tv.tv_sec; //秒数
-	*cs = tv.tv_usec / 10000; //微秒数 单位是0.01
+	*ms = tv.tv_usec / 1000; //微秒数换成毫秒
 #endif
 }
-// 返回系统开机到现在的时间，单位是百分之一秒 0.01s
+// 返回系统开机到现在的时间，单位是毫秒
 static uint64_t
 gettime()
 {
@@ -278,24 +729,25 @@ gettime()
 #if !defined(__APPLE__) || defined(AVAILABLE_MAC_OS_X_VERSION_10_12_AND_LATER)
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	t = (uint64_t)ti.tv_sec * 1000;
+	t += ti.tv_nsec / 1000000;
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);//得到当前时间  tv_sec:自Unix 纪元起的秒数 tv_usec:微秒数
-	t = (uint64_t)tv.tv_sec * 100;
-	t += tv.tv_usec / 10000;
+	t = (uint64_t)tv.tv_sec * 1000;
+	t += tv.tv_usec / 1000;
 #endif
 	return t;
 }
-//mtask 定时器更新 在定时器线程中每隔2500微妙调用一次
+//mtask 定时器更新 在定时器线程中每 1/4 个滴答调用一次(tickless 模式下在定时器到期时调用)
 void
 mtask_time_update(void)
 {
-    uint64_t cp = gettime(); //获取当前时间
+    uint64_t cp = gettime() / TI->resolution; //获取当前时间 单位为滴答
     if(cp < TI->current_point) {
         mtask_error(NULL, "time diff error: change from %lld to %lld", cp, TI->current_point);
         TI->current_point = cp; //
+        ATOM_STORE(&TI->base, cp - TI->time);
     } else if (cp != TI->current_point) {
         uint32_t diff = (uint32_t)(cp - TI->current_point);// 得到时间间隔
         TI->current_point = cp; //当前时间点
@@ -305,6 +757,7 @@ mtask_time_update(void)
             timer_update(TI); //调度定时器分发消息
         }
     }
+    ATOM_STORE(&TI->offset, TI->current - TI->current_point);
 }
 //开机时间
 uint32_t
@@ -312,21 +765,74 @@ mtask_time_start(void)
 {
     return TI->starttime;
 }
- //当前时间
+ //当前时间 单位毫秒
+uint64_t
+mtask_now_ms(void)
+{
+    if (TI->tickless) {
+        // 定时器线程可能在睡眠，current 不会每个滴答都更新，直接读时钟
+        return gettime() + ATOM_LOAD(&TI->offset) * TI->resolution;
+    }
+    return TI->current * TI->resolution; //进程启动时长
+}
+ //当前时间 单位 1/100 秒
 uint64_t
 mtask_now(void)
 {
-    return TI->current; //进程启动时长
+    return mtask_now_ms() / 10;
 }
-
+/***********************************************
+ * 定时器线程每次更新后调用
+ * 轮询模式睡眠 1/4 个滴答(默认 2500 微秒)
+ * tickless 模式睡到下一个定时器到期(最多 TIME_SLEEP_MAX 毫秒)，timer_add 会提前唤醒
+ ***********************************************/
 void
-mtask_timer_init(void)
+mtask_time_sleep(void)
+{
+    struct timer *T = TI;
+    if (!T->tickless) {
+        long usec = (long)T->resolution * TIME_POLL;
+        struct timespec ti = { usec / 1000000, (usec % 1000000) * 1000 };
+        nanosleep(&ti, NULL);
+        return;
+    }
+    // 先拿 mutex 再标记 sleeping，timer_add 的唤醒一定在 cond_timedwait 之后
+    pthread_mutex_lock(&T->mutex);
+    SPIN_LOCK(T);
+    // 算出醒来的时间之前，这期间加入的定时器都要唤醒
+    ATOM_STORE(&T->wake, T->time + INT32_MAX);
+    ATOM_STORE(&T->sleeping, 1);
+    timer_merge(T);
+    int max = TIME_SLEEP_MAX / T->resolution;
+    int d = timer_next(T, max > 0 ? max : 1);
+    ATOM_STORE(&T->wake, T->time + d);
+    SPIN_UNLOCK(T);
+    // current_point 对应滴答 T->time，在对应的单调时钟时刻醒来
+    uint64_t ms = (T->current_point + d) * T->resolution;
+    struct timespec ti;
+    ti.tv_sec = ms / 1000;
+    ti.tv_nsec = (ms % 1000) * 1000000;
+    pthread_cond_timedwait(&T->cond, &T->mutex, &ti);
+    ATOM_STORE(&T->sleeping, 0);
+    pthread_mutex_unlock(&T->mutex);
+}
+// resolution 为每个滴答的毫秒数
+void
+mtask_timer_init(int tickless, int resolution)
 {
     TI = timer_create_timer();
+    TI->resolution = resolution > 0 ? resolution : 10;
     uint32_t current = 0;
     systime(&TI->starttime, &current);
-    TI->current = current;
-    TI->current_point = gettime();
+    TI->current = current / TI->resolution;
+    TI->current_point = gettime() / TI->resolution;
+    TI->offset = TI->current - TI->current_point;
+    TI->base = TI->current_point;
+#if defined(__APPLE__)
+    // 没有 CLOCK_MONOTONIC 的条件变量，使用轮询模式
+    tickless = 0;
+#endif
+    TI->tickless = tickless;
 }
 
 // for profile
@@ -352,3 +858,17 @@ mtask_time_thread(void)
     return (uint64_t)(aTaskInfo.user_time.seconds) + (uint64_t)aTaskInfo.user_time.microseconds;
 #endif
 }
+//单调时钟 单位纳秒 用于统计消息处理耗时
+uint64_t
+mtask_time_monotonic(void)
+{
+#if !defined(__APPLE__) || defined(AVAILABLE_MAC_OS_X_VERSION_10_12_AND_LATER)
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * NANOSEC + (uint64_t)ti.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * NANOSEC + (uint64_t)tv.tv_usec * (NANOSEC / MICROSEC);
+#endif
+}
@@ -1,17 +1,29 @@
 #ifndef mtask_TIMER_H
 #define mtask_TIMER_H
 
-//mtask 的内部时钟精度为 1/100 秒
+//mtask 的内部时钟精度默认为 1/100 秒 可以用 timer_resolution 配置为毫秒
 #include <stdint.h>
 
-int mtask_timeout(uint32_t handle, int time, int session);
+// batch: timers of the same handle expiring on the same tick are delivered as one PTYPE_TIMER message
+int mtask_timeout(uint32_t handle, int time, int session, int batch);
+// cancelable timer in millisecond, returns timer id (0 if ms is 0 and the message is pushed at once)
+uint32_t mtask_timeout_add(uint32_t handle, int64_t ms, int session, int batch);
+// returns the session of the removed timer, 0 if it has already expired
+int mtask_timeout_cancel(uint32_t handle, uint32_t id);
+// stat[0]: timers added, stat[1]: contended shard lock acquisitions
+void mtask_timer_stat(uint64_t stat[2]);
 
 void mtask_time_update(void);
+// timer thread sleeps until the next expiry (tickless) or a quarter tick (poll)
+void mtask_time_sleep(void);
 
 uint32_t mtask_time_start(void);
 // for profile, in micro second
 uint64_t mtask_time_thread(void);
+// monotonic clock, in nano second
+uint64_t mtask_time_monotonic(void);
 
-void mtask_timer_init(void);
+// resolution: millisecond per tick
+void mtask_timer_init(int tickless, int resolution);
 
 #endif
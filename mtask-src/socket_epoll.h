@@ -50,13 +50,17 @@ sp_del(int efd, int sock)
 	epoll_ctl(efd, EPOLL_CTL_DEL, sock , NULL);
 }
 //EPOLLIN:表示对应的文件描述符上有可读数据 EPOLLOUT:表示对应的文件描述符上可以写数据
-static void 
-sp_write(int efd, int sock, void *ud, bool enable)
+//关掉可读事件后内核缓冲区满了就会停止接收 对端被 tcp 流控挡住
+static int
+sp_enable(int efd, int sock, void *ud, bool read_enable, bool write_enable)
 {
 	struct epoll_event ev;
-	ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+	ev.events = (read_enable ? EPOLLIN : 0) | (write_enable ? EPOLLOUT : 0);
 	ev.data.ptr = ud;
-	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);//修改已经注册的fd的监听事件
+	if (epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev) == -1) {//修改已经注册的fd的监听事件
+		return 1;
+	}
+	return 0;
 }
 //epoll_event:用于回传待处理事件的数组；
 //maxevents: 每次能处理的事件数；
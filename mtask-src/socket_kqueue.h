@@ -4,6 +4,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/event.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -65,14 +66,25 @@ sp_add(int kfd, int sock, void *ud)
 }
 //EVFILT_READ:表示对应的文件描述符上有可读数据
 //EVFILT_WRITE:表示对应的文件描述符上可以写数据
-static void 
-sp_write(int kfd, int sock, void *ud, bool enable)
+//读写两个改动放在一次 kevent 里提交 EV_RECEIPT 让每个改动都回传结果 data 不为 0 是出错的 errno
+static int
+sp_enable(int kfd, int sock, void *ud, bool read_enable, bool write_enable)
 {
-	struct kevent ke;
-	EV_SET(&ke, sock, EVFILT_WRITE, enable ? EV_ENABLE : EV_DISABLE, 0, 0, ud);
-if (kevent(kfd, &ke, 1, NULL, 0, NULL) == -1 || ke.flags & EV_ERROR) {
-		// todo: check error
+	struct kevent ke[2];
+	EV_SET(&ke[0], sock, EVFILT_READ, (read_enable ? EV_ENABLE : EV_DISABLE) | EV_RECEIPT, 0, 0, ud);
+	EV_SET(&ke[1], sock, EVFILT_WRITE, (write_enable ? EV_ENABLE : EV_DISABLE) | EV_RECEIPT, 0, 0, ud);
+	int n = kevent(kfd, ke, 2, ke, 2, NULL);
+	if (n < 0) {
+		return 1;
 	}
+	int i;
+	for (i=0;i<n;i++) {
+		if ((ke[i].flags & EV_ERROR) && ke[i].data != 0) {
+			errno = (int)ke[i].data;
+			return 1;
+		}
+	}
+	return 0;
 }
 //kevent ev:用于回传待处理事件的数组；
 static int 
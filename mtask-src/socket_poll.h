@@ -24,7 +24,7 @@ static int sp_add(poll_fd fd, int sock, void *ud);
 
 static void sp_del(poll_fd fd, int sock);
 
-static void sp_write(poll_fd, int sock, void *ud, bool enable);
+static int sp_enable(poll_fd, int sock, void *ud, bool read_enable, bool write_enable);
 
 static int sp_wait(poll_fd, event_t *e, int max);
 
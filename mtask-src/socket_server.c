@@ -1,6 +1,12 @@
+// linux 的 recvmmsg/sendmmsg 需要 _GNU_SOURCE
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -9,18 +15,44 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "mtask.h"
 
 #include "socket_server.h"
 #include "socket_poll.h"
+#include "socket_uring.h"
 #include "mtask_atomic.h"
 #include "mtask_spinlock.h"
 
+// linux 下控制命令走无锁队列 用 eventfd 唤醒 socket 线程，其它平台仍然使用管道
+#if defined(__linux__)
+#define SOCKET_CTRL_QUEUE
+#include <sys/eventfd.h>
+#endif
+
+// linux 下 udp 用 recvmmsg 一次收多个包 用 sendmmsg 一次发出发送队列里的多个包
+#if defined(__linux__)
+#define SOCKET_MMSG
+#endif
+
+// linux 下合并写的时间窗口用 timerfd 没有定时器时有时间窗口的 socket 在 socket 线程睡眠之前写出
+#if defined(__linux__)
+#define SOCKET_COALESCE_TIMER
+#include <sys/timerfd.h>
+#endif
+
+// glibc 的解析线程可以用 _res 指定 getaddrinfo 使用的 dns 服务器
+#if defined(__GLIBC__)
+#define SOCKET_DNS_SERVER
+#include <resolv.h>
+#endif
+
 
 
 #define MAX_INFO 128
-// MAX_SOCKET will be 2^MAX_SOCKET_P
+// 默认每个分片最多 2^MAX_SOCKET_P 个 socket 可以由 socket_server_create_shard 的 max 指定
 #define MAX_SOCKET_P            16
 #define MAX_EVENT               64// 用于epoll_wait的第三个参数 每次返回事件的多少
 #define MIN_READ_BUFFER         64// 最小分配的读缓冲大小 为了减少read的调用 尽可能分配大的读缓冲区
@@ -35,11 +67,26 @@
 #define SOCKET_TYPE_BIND        8// 其他类型的fd 如 stdin stdout等
 
 #define MAX_SOCKET (1<<MAX_SOCKET_P)    // 1 << 16 -> 64K = 65536
+// 槽位表分两级 每页 2^SLOT_PAGE_P 个 struct socket 用到时才分配 分配后直到释放 socket_server 都不回收
+#define SLOT_PAGE_P             10
+#define SLOT_PAGE (1<<SLOT_PAGE_P)
+// 连续探测 SLOT_PROBE 个槽位都被占用时 在用的槽位数翻倍
+#define SLOT_PROBE              16
+// socket id 至少留 SLOT_GEN_P 位给槽位的复用代数 同一个槽位复用 2^SLOT_GEN_P 次以上才会得到相同的 id
+#define SLOT_GEN_P              8
+// 最多 2^MAX_SHARD_P 个 socket 线程 每个线程一个分片 socket id 的低位是分片号
+#define MAX_SHARD_P             4
+#define MAX_SHARD (1<<MAX_SHARD_P)
 
 #define PRIORITY_HIGH           0
 #define PRIORITY_LOW            1
 
-#define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)
+// io_uring 请求的 user_data 为 socket id 和操作类型 操作类型为 0 的完成事件忽略
+#define URING_OP_ACCEPT         1
+#define URING_OP_RECV           2
+#define URING_DATA(id, op)      (((uint64_t)(unsigned)(id) << 8) | (op))
+
+#define HASH_ID(ss, id) ((((unsigned)id) >> (ss)->shard_bits) & ((ss)->slot_max - 1))
 
 #define PROTOCOL_TCP            0
 #define PROTOCOL_UDP            1
@@ -48,6 +95,33 @@
 #define UDP_ADDRESS_SIZE        19	// ipv6 128bit + port 16bit + 1 byte type
 
 #define MAX_UDP_PACKAGE         65535
+// recvmmsg/sendmmsg 一次最多收发的 udp 包数
+#define UDP_BATCH               32
+
+// tcp 收数据的块按大小分类 第 i 类的块大小为 2^(RECV_CLASS_P+i) 字节 最多读块大小减 RECV_TAG_SIZE 个字节
+// 数据后面的 4 个字节是标记 低 8 位是块的类别 其余是 RECV_TAG_MAGIC 用数据长度就能找到 超过最大类别的块记 RECV_TAG_NONE
+// 还回来的块标记对不上就不是池里的块 直接 FREE 块本身是 MALLOC 分配的 不还回池里时照常用 FREE 释放
+#define RECV_CLASS_P            6       // 最小 64 字节 与 MIN_READ_BUFFER 一致
+#define RECV_CLASS              11      // 最大 64K
+#define RECV_TAG_NONE           0xff
+#define RECV_TAG_SIZE           4
+#define RECV_TAG_MAGIC          0x6d736b00u     // "msk"
+#define RECV_POOL_SIZE          (1024 * 1024)   // 每个分片每类最多留在池里的字节数
+#define RECV_RECYCLE_N          32      // 各个线程攒够这么多块或者 RECV_RECYCLE_SIZE 字节后整批还给分片
+#define RECV_RECYCLE_SIZE       (256 * 1024)
+
+#define RESOLVER_THREAD         2       // 域名解析线程数
+#define DNS_CACHE_SLOT          256     // 域名缓存哈希桶个数
+#define DNS_CACHE_MAX           4096    // 域名缓存条数上限 超过时清空
+#define DNS_CACHE_TTL           60      // 域名缓存默认的有效时间 秒
+#define DNS_ADDR_MAX            192     // 解析结果的数字地址列表 空格分开 要能放进 'O' 请求
+
+// 发送 tcp 队列时一次 writev 最多收集的缓冲个数
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define MAX_IOV                 IOV_MAX
+#else
+#define MAX_IOV                 1024
+#endif
 
 // EAGAIN and EWOULDBLOCK may be not the same value.
 #if (EAGAIN != EWOULDBLOCK)
@@ -74,6 +148,24 @@ struct wb_list {
 	struct write_buffer * tail;
 };
 
+// socket 的流量统计 socket 线程和直接写的工作线程各用各的计数 都不用原子操作
+struct socket_stat {
+	uint64_t read;        // 收到的字节数
+	uint64_t write;       // socket 线程写出的字节数
+	uint64_t rmsg;        // 上报的数据消息数
+	uint64_t wmsg;        // 进入发送队列的消息数
+	uint64_t rcall;       // 读的系统调用次数 io_uring 收数据时不计
+	uint64_t wcall;       // socket 线程写的系统调用次数
+	uint64_t rtime;       // 最后一次收到数据的时间 进程启动后的毫秒数
+	uint64_t wtime;       // socket 线程最后一次写出数据的时间 进程启动后的毫秒数
+	// 工作线程直接写的计数 只在持有 socket 锁时更新 和 socket 线程各写各的 读的时候相加
+	uint64_t dwrite;      // 直接写出的字节数
+	uint64_t dwmsg;       // 直接写出的消息数
+	uint64_t dwcall;      // 直接写的系统调用次数
+	uint64_t dwtime;      // 最后一次直接写出数据的时间
+	int64_t wb_max;       // 发送队列的最高水位
+};
+
 // 应用层的socket
 struct socket {
     uintptr_t opaque;     // 在mtask中用于保存服务的handle
@@ -85,6 +177,14 @@ struct socket {
     uint8_t protocol;
     uint8_t type;         // socket类型或者状态
     uint16_t udpconnecting;
+    uint8_t uring;        // 在 io_uring 上挂着的 multishot 请求 URING_OP_ACCEPT/URING_OP_RECV 0 表示用 epoll 读
+    bool reading;         // false 表示暂停读 不再关注可读事件
+    bool uring_idle;      // 暂停读以后 multishot recv 已经结束 恢复读时要重新挂上
+    bool coalesce_pending;    // 发送队列里的数据在等合并窗口结束 这时不关注可写
+    bool coalesce_listed;     // id 在 coalesce_id 里 每个 socket 最多记一次
+    int coalesce_usec;        // 合并写的时间窗口(微秒) 0 表示只按字节数和 flush 写出
+    int coalesce_size;        // 发送队列达到这个字节数时立刻写出 两项都为 0 表示不合并
+    uint64_t coalesce_deadline;   // 窗口结束的时间 CLOCK_MONOTONIC 微秒 0 表示没有窗口 没有定时器时为 1
 	int64_t warn_size;
     union {
         int size;         // 下一次read操作要分配的缓冲区大小
@@ -94,21 +194,73 @@ struct socket {
     int dw_offset;
     const void *dw_buffer;
     size_t dw_size;
+    int group_id;         // SO_REUSEPORT 监听组中第一个 socket 的 id 上报 accept 时使用 不在组中时为自身 id
+    int group_next;       // 监听组中下一个 socket 的 id start/close 时依次转发 -1 表示没有
+    struct socket_stat stat;
+};
+
+// 放进控制命令队列的请求 buffer 为 request_package.u 中的内容
+struct dns_resolver;
+struct udp_batch;
+
+// 池里的块和还回来的块 覆盖在块的开头
+struct recv_block {
+	struct recv_block * next;
+	int cls;
+};
+
+struct request_node {
+	struct request_node * next;
+	int type;
+	int len;
+	uint64_t buffer[];
 };
 
 struct socket_server_s {
-    int recvctrl_fd;     // 管道读端
-    int sendctrl_fd;     // 管道写端
+    int recvctrl_fd;     // 管道读端 使用命令队列时为 eventfd
+    int sendctrl_fd;     // 管道写端 使用命令队列时和 recvctrl_fd 相同
     int checkctrl;       // 释放检测命令
+    struct request_node * ctrl_head;   // 各线程压入的请求 后压入的在前面
+    struct request_node * ctrl_list;   // socket 线程取出来还没处理的请求 按压入的顺序
     poll_fd event_fd;    // epoll fd
-    int alloc_id;        // 应用层分配id 用的
+    int alloc_id;        // 分配 id 时下一个探测的槽位
+    int slot_max;        // 槽位数上限 2 的幂
+    int slot_n;          // 在用的槽位数 从一页开始翻倍增长到 slot_max
+    struct socket ** slot;   // slot_max / SLOT_PAGE 个页指针 页只增不减 其它线程可以无锁访问
+    int shard;           // 分片号
+    int shard_n;         // 分片数
+    int shard_bits;      // socket id 中分片号占的位数
+    int shard_next;      // 新的 socket 轮流分配到各个分片 只使用 group[0] 的
+    int reuseport;       // 监听时每个分片各 listen 一个 SO_REUSEPORT 的 fd
+    socket_server_t ** group;   // 所有的分片 group[0] 为对外的 socket_server
+    struct dns_resolver * resolver;   // 所有分片共用的域名解析线程和缓存
+#ifdef SOCKET_URING
+    struct uring * uring;       // io_uring 后端 NULL 时只用 epoll
+    int uring_check;            // ring fd 可读 需要收割完成事件
+#endif
     int event_n;         // epoll_wait 返回的事件数
     int event_index;     // 当前处理的事件序号
     struct socket_object_interface soi;
     event_t ev[MAX_EVENT];      // 与描述符对应的事件(包括socket、read、write)
-    struct socket slot[MAX_SOCKET];  // 与描述符对应的数据，用于标识自定义的数据
     char buffer[MAX_INFO];           // 临时数据的保存 比如保存对等方的地址信息等
+#ifdef SOCKET_MMSG
+    struct udp_batch * udp_batch;    // 第一次收发 udp 时分配
+#else
     uint8_t udpbuffer[MAX_UDP_PACKAGE];
+#endif
+    struct iovec iov[MAX_IOV];       // 发送队列 writev 用
+    uint64_t closed_wcall;           // 已经关闭的 tcp socket 写的系统调用次数 关闭时在 socket 线程累加
+    uint64_t closed_write;           // 已经关闭的 tcp socket 写出的字节数
+    uint64_t time;                   // 每次 sp_wait 返回时的时间(毫秒) socket 线程记录读写时间用
+    int coalesce_fd;                 // 合并写窗口的 timerfd 第一次设置时间窗口时创建 -1 表示没有
+    uint64_t coalesce_next;          // timerfd 设定的最早的窗口结束时间 0 表示没有设定 没有定时器时 1 表示睡眠前要写出
+    int * coalesce_id;               // 在等合并的 socket id 已经写出或者关闭的在检查或者数组满时去掉
+    int coalesce_n;
+    int coalesce_cap;
+    struct recv_block * recv_free[RECV_CLASS];   // 收数据的块 socket 线程自己用
+    int recv_free_n[RECV_CLASS];
+    struct recv_block * recv_return; // 其它线程整批还回来的块 无锁栈 socket 线程取空池时整个拿走
+    int recv_return_next;            // 还块时轮流选分片 只使用 group[0] 的
     fd_set rfds;                     // 给select使用,主要用来检查是否有本地cmd从管道过来
 };
 
@@ -117,6 +269,8 @@ struct request_open {
 	int id;
 	int port;
 	uintptr_t opaque;
+	int resolved;       // 0 未解析 1 解析线程发回的数字地址 -1 解析失败
+	int status;         // 解析失败时 getaddrinfo 的返回值
 	char host[1];
 };
 
@@ -146,6 +300,8 @@ struct request_listen {
 	int id;
 	int fd;
 	uintptr_t opaque;
+	int group;          // 监听组中第一个 socket 的 id
+	int next;           // 监听组中下一个 socket 的 id -1 表示没有
 	char host[1];
 };
 
@@ -173,6 +329,16 @@ struct request_udp {
 	uintptr_t opaque;
 };
 
+struct request_pause {
+	int id;
+};
+
+struct request_coalesce {
+	int id;
+	int usec;
+	int size;
+};
+
 /*
 	The first byte is TYPE
 
@@ -188,6 +354,10 @@ struct request_udp {
 	T Set opt
 	U Create UDP socket
 	C set udp address
+	Q Pause reading
+	R Resume reading
+	W Set write coalescing
+	F Flush coalesced writes
  */
 // 控制命令请求包
 struct request_package {
@@ -204,6 +374,8 @@ struct request_package {
 		struct request_setopt setopt;
 		struct request_udp udp;
 		struct request_setudp set_udp;
+		struct request_pause pause;
+		struct request_coalesce coalesce;
 	} u;
 	uint8_t dummy[256];
 };
@@ -214,6 +386,24 @@ union sockaddr_all {
 	struct sockaddr_in6 v6;
 };
 
+#ifdef SOCKET_MMSG
+// recvmmsg 收到的一批包 每次 poll 把能放进一个收数据块的包作为一条 SOCKET_UDP_BATCH 交出 交完之前只属于 id 这个 socket
+// 每个包的缓冲都是 MAX_UDP_PACKAGE 只有收到的数据会用到实际的内存页
+struct udp_batch {
+	int id;             // 这批包所属的 socket -1 表示没有
+	int n;              // 收到的包数
+	int index;          // 下一个交出的包
+	int drained;        // 收到的包不满一批 socket 里已经没有数据了 交完后不用再读
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all addr[UDP_BATCH];
+	struct mmsghdr send[UDP_BATCH];         // sendmmsg 用 发送队列前面的多个包
+	struct iovec send_iov[UDP_BATCH];
+	union sockaddr_all send_addr[UDP_BATCH];
+	uint8_t buffer[UDP_BATCH][MAX_UDP_PACKAGE];
+};
+#endif
+
 struct send_object {
 	void * buffer;
 	int sz;
@@ -300,18 +490,85 @@ _socket_keepalive(int fd)
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));  
 }
 
+// id 所在的槽位 页还没有分配时返回 NULL 只有应用层传入无效的 id 才会出现
+static inline struct socket *
+_get_socket(socket_server_t *ss, int id)
+{
+	unsigned h = HASH_ID(ss, id);
+	struct socket *page = ss->slot[h >> SLOT_PAGE_P];
+	if (page == NULL) {
+		return NULL;
+	}
+	return &page[h & (SLOT_PAGE - 1)];
+}
+
+static inline void
+_clear_wb_list(struct wb_list *list)
+{
+	list->head = NULL;
+	list->tail = NULL;
+}
+// 分配第 index 页 多个线程同时分配时只保留一个
+static void
+_alloc_slot_page(socket_server_t *ss, int index)
+{
+	if (ss->slot[index]) {
+		return;
+	}
+	struct socket *page = MALLOC(SLOT_PAGE * sizeof(struct socket));
+	int i;
+	for (i=0;i<SLOT_PAGE;i++) {
+		struct socket *s = &page[i];
+		s->type = SOCKET_TYPE_INVALID;
+		// 第 0 代的 id 复用时在它的基础上增加代数
+		s->id = (int)(((unsigned)(index * SLOT_PAGE + i) << ss->shard_bits) | ss->shard);
+		_clear_wb_list(&s->high);
+		_clear_wb_list(&s->low);
+	}
+	if (!ATOM_CAS_POINTER(&ss->slot[index], NULL, page)) {
+		FREE(page);
+	}
+}
+// 在用的槽位从 n 翻倍 先分配好新的页再发布 slot_n
+static void
+_grow_slot(socket_server_t *ss, int n)
+{
+	int i;
+	for (i=n/SLOT_PAGE;i<n*2/SLOT_PAGE;i++) {
+		_alloc_slot_page(ss, i);
+	}
+	if (ATOM_CAS(&ss->slot_n, n, n*2)) {
+		// 新增的一半都是空闲的 从这里开始分配
+		// 别的线程可能同时在 _reserve_id 里 ATOM_FINC 这里也要原子写 覆盖掉它们的递增只是换个探测起点
+		ATOM_STORE(&ss->alloc_id, n);
+	}
+}
+// 槽位的复用代数放在 id 的高位 槽位每复用一次 id 加 slot_max << shard_bits
+// 旧的 id 要等同一个槽位复用 2^(31-shard_bits-slot_max 的位数) 次后才会再出现 避免 ABA
 static int
 _reserve_id(socket_server_t *ss)
 {
-	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
-		int id = ATOM_INC(&(ss->alloc_id));
-		if (id < 0) {
-			id = ATOM_AND(&(ss->alloc_id), 0x7fffffff);
+	int probe = 0;
+	for (;;) {
+		int n = ss->slot_n;
+		if (probe >= SLOT_PROBE && n < ss->slot_max) {
+			_grow_slot(ss, n);
+			probe = 0;
+			continue;
+		}
+		if (probe >= n) {
+			return -1;
 		}
-		struct socket *s = &ss->slot[HASH_ID(id)];
+		++probe;
+		int seq = ATOM_FINC(&(ss->alloc_id));
+		if (seq < 0) {
+			seq = ATOM_AND(&(ss->alloc_id), 0x7fffffff);
+		}
+		unsigned h = (unsigned)seq & (n - 1);
+		struct socket *s = &ss->slot[h >> SLOT_PAGE_P][h & (SLOT_PAGE - 1)];
 		if (s->type == SOCKET_TYPE_INVALID) {
 			if (ATOM_CAS(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
+				int id = (int)(((unsigned)s->id + ((unsigned)ss->slot_max << ss->shard_bits)) & 0x7fffffff);
 				s->id = id;
                 // socket_server_udp_connect may inc s->udpconncting directly (from other thread, before new_fd),
                 // so reset it to 0 here rather than in new_fd.
@@ -320,29 +577,36 @@ _reserve_id(socket_server_t *ss)
 				return id;
 			} else {
 				// retry
-				--i;
+				--probe;
 			}
 		}
 	}
-	return -1;
 }
 
-static inline void
-_clear_wb_list(struct wb_list *list)
+// id 所在的分片
+static inline socket_server_t *
+_shard(socket_server_t *ss, int id)
 {
-	list->head = NULL;
-	list->tail = NULL;
+	return ss->group[(unsigned)id & ((1u << ss->shard_bits) - 1)];
+}
+// 新的 socket 放到哪个分片
+static inline socket_server_t *
+_alloc_shard(socket_server_t *ss)
+{
+	if (ss->shard_n == 1) {
+		return ss;
+	}
+	return ss->group[(unsigned)ATOM_FINC(&ss->group[0]->shard_next) % ss->shard_n];
 }
 
 /**
  创建一个管道，管道的读端给epoll管理；
- 分配一个socket_server_t统领全局(其中有65535个struct socket结构体，
- 每个此结构体都对应一个socket描述符，并将所有的 type 设置为SOCKET_TYPE_INVALID.
+ 分配一个socket_server_t统领全局(最多 slot_max 个struct socket结构体，
+ 每个此结构体都对应一个socket描述符，按页分配，新的页所有的 type 都是SOCKET_TYPE_INVALID.
  */
-socket_server_t * 
-socket_server_create()
+static socket_server_t *
+_create_shard(int slot_max)
 {
-	int i;
 	int fd[2];
     //生成epoll专用的描述符
 	poll_fd efd = sp_create();
@@ -350,18 +614,30 @@ socket_server_create()
 		fprintf(stderr, "socket-server: create event pool failed.\n");
 		return NULL;
 	}
+#ifdef SOCKET_CTRL_QUEUE
+    //请求放进队列 eventfd 只用来唤醒 socket 线程
+	fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd[0] < 0) {
+		sp_release(efd);
+		fprintf(stderr, "socket-server: create eventfd failed.\n");
+		return NULL;
+	}
+#else
     //创建一个管道，fd[1]为写入端，fd[0]为读取端
 	if (pipe(fd)) {
 		sp_release(efd);
 		fprintf(stderr, "socket-server: create socket pair failed.\n");
 		return NULL;
 	}
+#endif
     //将管道的读取端给epoll管理，mtask本地需要监听、绑定某个端口时都会从上层往管道的写端发送cmd
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
 		close(fd[0]);
-		close(fd[1]);
+		if (fd[1] != fd[0]) {
+			close(fd[1]);
+		}
 		sp_release(efd);
 		return NULL;
 	}
@@ -371,139 +647,854 @@ socket_server_create()
 	ss->recvctrl_fd = fd[0];
 	ss->sendctrl_fd = fd[1];
 	ss->checkctrl = 1; //default 1
-
-	for (i=0;i<MAX_SOCKET;i++) {
-        //ss->slot[i]为一个struct socket
-		struct socket *s = &ss->slot[i];
-		s->type = SOCKET_TYPE_INVALID;
-		_clear_wb_list(&s->high);
-		_clear_wb_list(&s->low);
-	}
+	ss->ctrl_head = NULL;
+	ss->ctrl_list = NULL;
+
+	// 槽位的页在设置好分片号后再分配
+	ss->slot_max = slot_max;
+	ss->slot_n = SLOT_PAGE;
+	ss->slot = MALLOC(slot_max / SLOT_PAGE * sizeof(struct socket *));
+	memset(ss->slot, 0, slot_max / SLOT_PAGE * sizeof(struct socket *));
 	ss->alloc_id = 0;
 	ss->event_n = 0;
 	ss->event_index = 0;
+	ss->closed_wcall = 0;
+	ss->closed_write = 0;
+	ss->time = 0;
+	ss->coalesce_fd = -1;
+	ss->coalesce_next = 0;
+	ss->coalesce_id = NULL;
+	ss->coalesce_n = 0;
+	ss->coalesce_cap = 0;
+	memset(ss->recv_free, 0, sizeof(ss->recv_free));
+	memset(ss->recv_free_n, 0, sizeof(ss->recv_free_n));
+	ss->recv_return = NULL;
+	ss->recv_return_next = 0;
+#ifdef SOCKET_MMSG
+	ss->udp_batch = NULL;
+#endif
+#ifdef SOCKET_URING
+	ss->uring = NULL;
+	ss->uring_check = 0;
+#endif
 	memset(&ss->soi, 0, sizeof(ss->soi));
+#ifndef SOCKET_CTRL_QUEUE
 	FD_ZERO(&ss->rfds);
 	assert(ss->recvctrl_fd < FD_SETSIZE);
+#endif
 
 	return ss;
 }
 
-static void
-_free_wb_list(socket_server_t *ss, struct wb_list *list)
+static void _release_shard(socket_server_t *ss);
+static void _recv_pool_release(socket_server_t *ss);
+static struct dns_resolver * _dns_create();
+static void _dns_release(struct dns_resolver *r);
+
+socket_server_t *
+socket_server_create()
 {
-	struct write_buffer *wb = list->head;
-	while (wb) {
-		struct write_buffer *tmp = wb;
-		wb = wb->next;
-		_write_buffer_free(ss, tmp);
+	return socket_server_create_shard(1, 0, 0);
+}
+// n 个分片 每个分片由一个线程调用 socket_server_poll
+// max 为所有分片的 socket 总数上限 平分到各个分片后取 2 的幂 0 表示每个分片 MAX_SOCKET 个
+socket_server_t *
+socket_server_create_shard(int n, int reuseport, int max)
+{
+	if (n < 1 || n > MAX_SHARD) {
+		fprintf(stderr, "socket-server: invalid shard number %d (1-%d).\n", n, MAX_SHARD);
+		return NULL;
 	}
-	list->head = NULL;
-	list->tail = NULL;
+	int bits = 0;
+	while ((1 << bits) < n) {
+		++bits;
+	}
+	int slot_p = MAX_SOCKET_P;
+	if (max > 0) {
+		int per = (max + n - 1) / n;
+		slot_p = SLOT_PAGE_P;
+		while (slot_p < 31 && (1 << slot_p) < per) {
+			++slot_p;
+		}
+	}
+	if (slot_p > 31 - bits - SLOT_GEN_P) {
+		fprintf(stderr, "socket-server: socket max %d too large for %d shards (at most %d).\n",
+			max, n, n << (31 - bits - SLOT_GEN_P));
+		return NULL;
+	}
+	// 分片号取 id 的低 bits 位 分片数不是 2 的幂时多出来的位置指向已有的分片
+	// 这样随便一个 id 都能找到分片 再由 s->id != id 判断无效
+	socket_server_t ** group = MALLOC((1 << bits) * sizeof(socket_server_t *));
+	struct dns_resolver * resolver = _dns_create();
+	int i;
+	for (i=0;i<n;i++) {
+		socket_server_t *ss = _create_shard(1 << slot_p);
+		if (ss == NULL) {
+			while (--i >= 0) {
+				_release_shard(group[i]);
+			}
+			_dns_release(resolver);
+			FREE(group);
+			return NULL;
+		}
+		ss->shard = i;
+		ss->shard_n = n;
+		ss->shard_bits = bits;
+		ss->shard_next = 0;
+		ss->reuseport = reuseport;
+		ss->group = group;
+		ss->resolver = resolver;
+		_alloc_slot_page(ss, 0);
+		group[i] = ss;
+	}
+	for (i=n;i<(1 << bits);i++) {
+		group[i] = group[i % n];
+	}
+	return group[0];
 }
 
-static void
-_free_buffer(socket_server_t *ss, const void *buffer, int sz)
+int
+socket_server_shard_n(socket_server_t *ss)
 {
-    struct send_object so;
-    _send_object_init(ss, &so, (void *)buffer, sz);
-    so.free_func((void*)buffer);
+	return ss->shard_n;
+}
+
+socket_server_t *
+socket_server_shard(socket_server_t *ss, int shard)
+{
+	return ss->group[shard];
+}
+// 所有分片改用 io_uring 收数据 在创建任何 socket 之前调用 内核不支持时保持 epoll 返回 -1
+int
+socket_server_uring(socket_server_t *ss)
+{
+#ifdef SOCKET_URING
+	socket_server_t ** group = ss->group;
+	int i;
+	for (i=0;i<ss->shard_n;i++) {
+		struct uring * u = MALLOC(sizeof(*u));
+		if (su_init(u) || sp_add(group[i]->event_fd, u->fd, u)) {
+			fprintf(stderr, "socket-server: io_uring unavailable (%s), fall back to epoll.\n", strerror(errno));
+			if (u->fd >= 0) {
+				su_release(u);
+			}
+			FREE(u);
+			while (--i >= 0) {
+				sp_del(group[i]->event_fd, group[i]->uring->fd);
+				su_release(group[i]->uring);
+				FREE(group[i]->uring);
+				group[i]->uring = NULL;
+			}
+			return -1;
+		}
+		group[i]->uring = u;
+	}
+	return 0;
+#else
+	fprintf(stderr, "socket-server: built without io_uring, use epoll.\n");
+	return -1;
+#endif
+}
+
+// stat[0] tcp 写的系统调用次数 stat[1] tcp 写出的字节数 所有分片之和
+// 写的时候只改 socket 自己的统计 读的时候把活着的 tcp socket 和已经关闭的加起来 不加锁 读到的是近似值
+void
+socket_server_stat(socket_server_t *ss, uint64_t stat[2])
+{
+	int g, i;
+	stat[0] = stat[1] = 0;
+	for (g=0;g<ss->shard_n;g++) {
+		socket_server_t *shard = ss->group[g];
+		stat[0] += shard->closed_wcall;
+		stat[1] += shard->closed_write;
+		for (i=0;i<shard->slot_max;i++) {
+			struct socket *page = shard->slot[i >> SLOT_PAGE_P];
+			if (page == NULL) {
+				i += SLOT_PAGE - 1;
+				continue;
+			}
+			struct socket *s = &page[i & (SLOT_PAGE - 1)];
+			int type = ATOM_LOAD(&s->type);
+			if (type == SOCKET_TYPE_INVALID || type == SOCKET_TYPE_RESERVE || s->protocol != PROTOCOL_TCP)
+				continue;
+			stat[0] += s->stat.wcall + s->stat.dwcall;
+			stat[1] += s->stat.write + s->stat.dwrite;
+		}
+	}
+}
+
+// 从其它线程读 socket 的统计 不加锁 读到的是近似值 socket 正在关闭时返回 0
+static int
+_socket_info(struct socket *s, struct socket_info *si)
+{
+	uint8_t type = s->type;
+	switch (type) {
+	case SOCKET_TYPE_INVALID:
+	case SOCKET_TYPE_RESERVE:
+		return 0;
+	case SOCKET_TYPE_PLISTEN:
+	case SOCKET_TYPE_LISTEN:
+		si->type = SOCKET_INFO_LISTEN;
+		break;
+	case SOCKET_TYPE_HALFCLOSE:
+		si->type = SOCKET_INFO_CLOSING;
+		break;
+	case SOCKET_TYPE_BIND:
+		si->type = SOCKET_INFO_BIND;
+		break;
+	default:
+		si->type = (s->protocol == PROTOCOL_TCP) ? SOCKET_INFO_TCP : SOCKET_INFO_UDP;
+		break;
+	}
+	si->id = s->id;
+	si->opaque = s->opaque;
+	si->reading = s->reading;
+	si->read = s->stat.read;
+	si->write = s->stat.write + s->stat.dwrite;
+	si->rmsg = s->stat.rmsg;
+	si->wmsg = s->stat.wmsg + s->stat.dwmsg;
+	si->rcall = s->stat.rcall;
+	si->wcall = s->stat.wcall + s->stat.dwcall;
+	si->rtime = s->stat.rtime;
+	si->wtime = s->stat.wtime > s->stat.dwtime ? s->stat.wtime : s->stat.dwtime;
+	si->wbuffer = s->wb_size;
+	si->wb_max = s->stat.wb_max;
+	si->name[0] = '\0';
+	return 1;
 }
 
+// 对端地址 监听 socket 为本地地址
+// fd 在 socket 锁里关闭 拿着锁确认还是同一个 socket 才读地址 否则可能读到复用这个 fd 的另一个连接
 static void
-_force_close(socket_server_t *ss, struct socket *s, struct socket_lock *l ,socket_message_t *result)
+_socket_info_name(struct socket *s, struct socket_info *si)
 {
-	result->id = s->id;
-	result->ud = 0;
-	result->data = NULL;
-	result->opaque = s->opaque;
-	if (s->type == SOCKET_TYPE_INVALID) {
+	union sockaddr_all u;
+	socklen_t slen = sizeof(u);
+	int r;
+	if (si->type != SOCKET_INFO_LISTEN && si->type != SOCKET_INFO_TCP && si->type != SOCKET_INFO_CLOSING)
+		return;
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	if (s->id != si->id || s->type == SOCKET_TYPE_INVALID || s->type == SOCKET_TYPE_RESERVE) {
+		socket_unlock(&l);
 		return;
 	}
-	assert(s->type != SOCKET_TYPE_RESERVE);
-	_free_wb_list(ss,&s->high);
-	_free_wb_list(ss,&s->low);
-	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
-		sp_del(ss->event_fd, s->fd);
+	if (si->type == SOCKET_INFO_LISTEN) {
+		r = getsockname(s->fd, &u.s, &slen);
+	} else {
+		r = getpeername(s->fd, &u.s, &slen);
 	}
-    socket_lock(l);
-	if (s->type != SOCKET_TYPE_BIND) {
-		if (close(s->fd) < 0) {
-			perror("close socket:");
-		}
+	socket_unlock(&l);
+	if (r != 0 || (u.s.sa_family != AF_INET && u.s.sa_family != AF_INET6))
+		return;
+	char tmp[INET6_ADDRSTRLEN];
+	void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
+	int port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
+	if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
+		snprintf(si->name, sizeof(si->name), "%s:%d", tmp, port);
 	}
-	s->type = SOCKET_TYPE_INVALID;
-    if (s->dw_buffer) {
-        _free_buffer(ss, s->dw_buffer, s->dw_size);
-        s->dw_buffer = NULL;
-    }
-    socket_unlock(l);
 }
 
-void 
-socket_server_release(socket_server_t *ss)
+// 遍历所有分片所有已分配的页 opaque 为 0 时取全部 socket
+static struct socket_info *
+_socket_info_list(socket_server_t *ss, uintptr_t opaque)
 {
-	int i;
-	socket_message_t dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-        struct socket_lock l;
-        socket_lock_init(s, &l);
-		if (s->type != SOCKET_TYPE_RESERVE) {
-			_force_close(ss, s, &l, &dummy);
+	struct socket_info * list = NULL;
+	int g, i;
+	for (g=0;g<ss->shard_n;g++) {
+		socket_server_t *shard = ss->group[g];
+		for (i=0;i<shard->slot_max;i++) {
+			struct socket *page = shard->slot[i >> SLOT_PAGE_P];
+			if (page == NULL) {
+				i += SLOT_PAGE - 1;
+				continue;
+			}
+			struct socket *s = &page[i & (SLOT_PAGE - 1)];
+			struct socket_info tmp;
+			if (!_socket_info(s, &tmp) || (opaque != 0 && tmp.opaque != opaque))
+				continue;
+			struct socket_info *si = MALLOC(sizeof(*si));
+			*si = tmp;
+			_socket_info_name(s, si);
+			si->next = list;
+			list = si;
 		}
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
-	sp_release(ss->event_fd);
-	FREE(ss);
+	return list;
 }
 
-static inline void
-_check_wb_list(struct wb_list *s)
+struct socket_info *
+socket_server_info(socket_server_t *ss)
 {
-	assert(s->head == NULL);
-	assert(s->tail == NULL);
+	return _socket_info_list(ss, 0);
 }
-//当有新的描述符需要加入时调用此函数
-static struct socket *
-_new_fd(socket_server_t *ss, int id, int fd, int protocol, uintptr_t opaque, bool add)
+
+void
+socket_server_info_release(struct socket_info *si)
 {
-	struct socket * s = &ss->slot[HASH_ID(id)];
-	assert(s->type == SOCKET_TYPE_RESERVE);
+	while (si) {
+		struct socket_info *next = si->next;
+		FREE(si);
+		si = next;
+	}
+}
 
-	if (add) {
-		if (sp_add(ss->event_fd, fd, s)) {
-			s->type = SOCKET_TYPE_INVALID;
-			return NULL;
+// 按服务汇总 不分配内存 返回这个服务的 socket 数
+int
+socket_server_netstat(socket_server_t *ss, uintptr_t opaque, uint64_t stat[SOCKET_NETSTAT_N])
+{
+	int n = 0;
+	int g, i;
+	memset(stat, 0, SOCKET_NETSTAT_N * sizeof(uint64_t));
+	for (g=0;g<ss->shard_n;g++) {
+		socket_server_t *shard = ss->group[g];
+		for (i=0;i<shard->slot_max;i++) {
+			struct socket *page = shard->slot[i >> SLOT_PAGE_P];
+			if (page == NULL) {
+				i += SLOT_PAGE - 1;
+				continue;
+			}
+			struct socket_info si;
+			if (!_socket_info(&page[i & (SLOT_PAGE - 1)], &si) || si.opaque != opaque)
+				continue;
+			++n;
+			stat[SOCKET_NETSTAT_READ] += si.read;
+			stat[SOCKET_NETSTAT_WRITE] += si.write;
+			stat[SOCKET_NETSTAT_RMSG] += si.rmsg;
+			stat[SOCKET_NETSTAT_WMSG] += si.wmsg;
+			stat[SOCKET_NETSTAT_RCALL] += si.rcall;
+			stat[SOCKET_NETSTAT_WCALL] += si.wcall;
+			stat[SOCKET_NETSTAT_WBUFFER] += si.wbuffer;
 		}
 	}
+	return n;
+}
 
-	s->id = id;
-	s->fd = fd;
-	s->protocol = protocol;
-	s->p.size = MIN_READ_BUFFER;
-	s->opaque = opaque; // 调用监听动作的服务的地址
-	s->wb_size = 0;
-	s->warn_size = 0;
-	_check_wb_list(&s->high);
-	_check_wb_list(&s->low);
-    spinlock_init(&s->dw_lock);
-    s->dw_buffer = NULL;
-    s->dw_size = 0;
-	return s;
+static void _send_request(socket_server_t *ss, struct request_package *request, char type, int len);
+
+/*
+	域名解析: getaddrinfo 可能阻塞很久 (dns 服务器慢或者不可达)，不能在 socket 线程里调用。
+	connect 的地址不是数字地址时先查缓存，没有命中就交给解析线程，
+	解析完成后把数字地址放回 'O' 请求重新发给 socket 所在的分片，socket 一直保持 RESERVE 状态。
+	getaddrinfo 拿不到记录的 TTL ，缓存使用统一的有效时间 (dns_cache_ttl)。
+	解析结果的所有地址用空格分开一起缓存和发回 connect 时依次尝试 (比如没有 ipv6 路由时第一个 AAAA 地址连不上)。
+ */
+struct dns_query {
+	struct dns_query * next;
+	socket_server_t * ss;       // socket 所在的分片
+	struct request_open open;   // 必须放在最后 后面跟着 host
+};
+
+struct dns_cache {
+	struct dns_cache * next;
+	uint64_t expire;            // 过期时间 秒
+	char addr[DNS_ADDR_MAX];
+	char host[1];
+};
+
+struct dns_resolver {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct dns_query * head;
+	struct dns_query * tail;
+	int quit;
+	int thread_n;               // 已经启动的解析线程数 第一次解析时才启动
+	pthread_t thread[RESOLVER_THREAD];
+	int ttl;                    // 缓存的有效时间 秒 0 表示不缓存
+	int cache_n;
+	struct dns_cache * cache[DNS_CACHE_SLOT];
+	int has_server;
+	struct sockaddr_in server;  // 配置了 dns_server 时解析线程使用的 dns 服务器
+};
+
+static uint64_t
+_dns_now()
+{
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec;
 }
 
-// return -1 when connecting
-static int
-_open_socket(socket_server_t *ss, struct request_open * request, socket_message_t *result)
+static unsigned
+_dns_hash(const char *host)
 {
-	int id = request->id;
-	result->opaque = request->opaque;
-	result->id = id;
-	result->ud = 0;
-	result->data = NULL;
-	struct socket *ns;
+	unsigned h = 5381;
+	while (*host) {
+		h = h * 33 + (uint8_t)*host++;
+	}
+	return h % DNS_CACHE_SLOT;
+}
+
+static struct dns_resolver *
+_dns_create()
+{
+	struct dns_resolver * r = MALLOC(sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->ttl = DNS_CACHE_TTL;
+	return r;
+}
+
+static void
+_dns_cache_clear(struct dns_resolver *r)
+{
+	int i;
+	for (i=0;i<DNS_CACHE_SLOT;i++) {
+		struct dns_cache * c = r->cache[i];
+		while (c) {
+			struct dns_cache * next = c->next;
+			FREE(c);
+			c = next;
+		}
+		r->cache[i] = NULL;
+	}
+	r->cache_n = 0;
+}
+
+static void
+_dns_release(struct dns_resolver *r)
+{
+	int i;
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	for (i=0;i<r->thread_n;i++) {
+		pthread_join(r->thread[i], NULL);
+	}
+	struct dns_query * q = r->head;
+	while (q) {
+		struct dns_query * next = q->next;
+		FREE(q);
+		q = next;
+	}
+	_dns_cache_clear(r);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	FREE(r);
+}
+
+// 命中时把数字地址写入 addr 返回 1 ，顺便回收桶里过期的缓存
+static int
+_dns_cache_lookup(struct dns_resolver *r, const char *host, char addr[DNS_ADDR_MAX])
+{
+	int found = 0;
+	uint64_t now = _dns_now();
+	pthread_mutex_lock(&r->lock);
+	struct dns_cache ** prev = &r->cache[_dns_hash(host)];
+	struct dns_cache * c;
+	while ((c = *prev)) {
+		if (c->expire <= now) {
+			*prev = c->next;
+			FREE(c);
+			--r->cache_n;
+			continue;
+		}
+		if (strcmp(c->host, host) == 0) {
+			memcpy(addr, c->addr, DNS_ADDR_MAX);
+			found = 1;
+			break;
+		}
+		prev = &c->next;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return found;
+}
+
+static void
+_dns_cache_insert(struct dns_resolver *r, const char *host, const char *addr)
+{
+	pthread_mutex_lock(&r->lock);
+	if (r->ttl > 0) {
+		uint64_t expire = _dns_now() + r->ttl;
+		struct dns_cache ** slot = &r->cache[_dns_hash(host)];
+		struct dns_cache * c;
+		for (c = *slot; c; c = c->next) {
+			if (strcmp(c->host, host) == 0)
+				break;
+		}
+		if (c == NULL) {
+			if (r->cache_n >= DNS_CACHE_MAX) {
+				_dns_cache_clear(r);
+			}
+			c = MALLOC(sizeof(*c) + strlen(host));
+			strcpy(c->host, host);
+			c->next = *slot;
+			*slot = c;
+			++r->cache_n;
+		}
+		c->expire = expire;
+		strcpy(c->addr, addr);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+// 解析完成 把结果放回 'O' 请求发给 socket 所在的分片
+static void
+_dns_resolve(struct dns_resolver *r, struct dns_query *q)
+{
+	struct request_package request;
+	struct request_open * open = &request.u.open;
+	struct addrinfo ai_hints;
+	struct addrinfo *ai_list = NULL;
+	memset(&ai_hints, 0, sizeof(ai_hints));
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_protocol = IPPROTO_TCP;
+
+	*open = q->open;
+	int status = getaddrinfo(q->open.host, NULL, &ai_hints, &ai_list);
+	const char * host = q->open.host;
+	char addr[DNS_ADDR_MAX];
+	if (status == 0) {
+		// 按 getaddrinfo 的顺序收集所有地址 放不下的丢掉
+		struct addrinfo *ai_ptr;
+		size_t n = 0;
+		for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next) {
+			char one[INET6_ADDRSTRLEN];
+			struct sockaddr * sa = ai_ptr->ai_addr;
+			void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)sa)->sin_addr : (void*)&((struct sockaddr_in6 *)sa)->sin6_addr;
+			if (!inet_ntop(ai_ptr->ai_family, sin_addr, one, sizeof(one)))
+				continue;
+			size_t len = strlen(one);
+			if (n + (n > 0) + len >= sizeof(addr))
+				break;
+			if (n > 0)
+				addr[n++] = ' ';
+			memcpy(addr + n, one, len + 1);
+			n += len;
+		}
+		if (n > 0) {
+			_dns_cache_insert(r, q->open.host, addr);
+			host = addr;
+			open->resolved = 1;
+		} else {
+			status = EAI_FAIL;
+		}
+		freeaddrinfo(ai_list);
+	}
+	if (status != 0) {
+		open->resolved = -1;
+		open->status = status;
+	}
+	int len = (int)strlen(host);
+	memcpy(open->host, host, len + 1);
+	_send_request(q->ss, &request, 'O', sizeof(request.u.open) + len);
+}
+
+static void *
+_dns_thread(void *ud)
+{
+	struct dns_resolver * r = ud;
+#ifdef SOCKET_DNS_SERVER
+	if (r->has_server) {
+		// _res 是线程私有的 只影响本线程的 getaddrinfo
+		res_init();
+		_res.nscount = 1;
+		_res.nsaddr_list[0] = r->server;
+	}
+#endif
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		while (r->head == NULL && !r->quit) {
+			pthread_cond_wait(&r->cond, &r->lock);
+		}
+		if (r->quit) {
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		struct dns_query * q = r->head;
+		r->head = q->next;
+		if (r->head == NULL) {
+			r->tail = NULL;
+		}
+		pthread_mutex_unlock(&r->lock);
+		_dns_resolve(r, q);
+		FREE(q);
+	}
+	return NULL;
+}
+
+static void
+_dns_query(socket_server_t *ss, struct request_open *request)
+{
+	struct dns_resolver * r = ss->resolver;
+	int len = (int)strlen(request->host);
+	struct dns_query * q = MALLOC(sizeof(*q) + len);
+	q->next = NULL;
+	q->ss = ss;
+	memcpy(&q->open, request, sizeof(*request) + len);
+	pthread_mutex_lock(&r->lock);
+	while (r->thread_n < RESOLVER_THREAD) {
+		if (pthread_create(&r->thread[r->thread_n], NULL, _dns_thread, r)) {
+			fprintf(stderr, "socket-server: create resolver thread failed.\n");
+			break;
+		}
+		++r->thread_n;
+	}
+	if (r->thread_n == 0) {
+		// 没有解析线程 只能在 socket 线程里解析
+		pthread_mutex_unlock(&r->lock);
+		_dns_resolve(r, q);
+		FREE(q);
+		return;
+	}
+	if (r->tail) {
+		r->tail->next = q;
+	} else {
+		r->head = q;
+	}
+	r->tail = q;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// ttl 缓存的有效时间(秒) server 为 "ip" 或 "ip:port" NULL 表示使用系统配置 在第一次 connect 之前调用
+int
+socket_server_resolver(socket_server_t *ss, int ttl, const char *server)
+{
+	struct dns_resolver * r = ss->resolver;
+	r->ttl = ttl;
+	if (server == NULL || server[0] == '\0')
+		return 0;
+#ifdef SOCKET_DNS_SERVER
+	char ip[INET_ADDRSTRLEN];
+	int port = 53;
+	const char * sep = strchr(server, ':');
+	size_t len = sep ? (size_t)(sep - server) : strlen(server);
+	if (len >= sizeof(ip)) {
+		return -1;
+	}
+	memcpy(ip, server, len);
+	ip[len] = '\0';
+	if (sep) {
+		port = atoi(sep + 1);
+	}
+	memset(&r->server, 0, sizeof(r->server));
+	r->server.sin_family = AF_INET;
+	r->server.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip, &r->server.sin_addr) != 1 || port <= 0 || port > 65535) {
+		return -1;
+	}
+	r->has_server = 1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void
+_free_wb_list(socket_server_t *ss, struct wb_list *list)
+{
+	struct write_buffer *wb = list->head;
+	while (wb) {
+		struct write_buffer *tmp = wb;
+		wb = wb->next;
+		_write_buffer_free(ss, tmp);
+	}
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+static void
+_free_buffer(socket_server_t *ss, const void *buffer, int sz)
+{
+    struct send_object so;
+    _send_object_init(ss, &so, (void *)buffer, sz);
+    so.free_func((void*)buffer);
+}
+
+static void
+_force_close(socket_server_t *ss, struct socket *s, struct socket_lock *l ,socket_message_t *result)
+{
+	result->id = s->id;
+	result->ud = 0;
+	result->data = NULL;
+	result->opaque = s->opaque;
+	if (s->type == SOCKET_TYPE_INVALID) {
+		return;
+	}
+	assert(s->type != SOCKET_TYPE_RESERVE);
+#ifdef SOCKET_URING
+	if (s->uring) {
+		// 关闭 fd 不会结束 multishot 请求 要先取消 之后到达的完成事件 id 对不上会被忽略
+		su_cancel(ss->uring, URING_DATA(s->id, s->uring));
+		s->uring = 0;
+	}
+#endif
+	_free_wb_list(ss,&s->high);
+	_free_wb_list(ss,&s->low);
+	s->coalesce_pending = false;
+	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
+		sp_del(ss->event_fd, s->fd);
+	}
+    socket_lock(l);
+	if (s->type != SOCKET_TYPE_BIND) {
+		if (close(s->fd) < 0) {
+			perror("close socket:");
+		}
+	}
+	if (s->protocol == PROTOCOL_TCP) {
+		// 拿着锁 不会再有直接写 统计不再变化
+		ss->closed_wcall += s->stat.wcall + s->stat.dwcall;
+		ss->closed_write += s->stat.write + s->stat.dwrite;
+	}
+	s->type = SOCKET_TYPE_INVALID;
+    if (s->dw_buffer) {
+        _free_buffer(ss, s->dw_buffer, s->dw_size);
+        s->dw_buffer = NULL;
+    }
+    socket_unlock(l);
+}
+
+static void
+_release_shard(socket_server_t *ss)
+{
+	int i;
+	socket_message_t dummy;
+	for (i=0;i<ss->slot_max;i++) {
+		struct socket *page = ss->slot[i >> SLOT_PAGE_P];
+		if (page == NULL) {
+			i += SLOT_PAGE - 1;
+			continue;
+		}
+		struct socket *s = &page[i & (SLOT_PAGE - 1)];
+        struct socket_lock l;
+        socket_lock_init(s, &l);
+		if (s->type != SOCKET_TYPE_RESERVE) {
+			_force_close(ss, s, &l, &dummy);
+		}
+	}
+	for (i=0;i<ss->slot_max/SLOT_PAGE;i++) {
+		FREE(ss->slot[i]);
+	}
+	FREE(ss->slot);
+#ifdef SOCKET_MMSG
+	FREE(ss->udp_batch);
+#endif
+	_recv_pool_release(ss);
+#ifdef SOCKET_URING
+	if (ss->uring) {
+		su_release(ss->uring);
+		FREE(ss->uring);
+	}
+#endif
+	struct request_node * node = ss->ctrl_list;
+	while (node) {
+		struct request_node * next = node->next;
+		FREE(node);
+		node = next;
+	}
+	node = ss->ctrl_head;
+	while (node) {
+		struct request_node * next = node->next;
+		FREE(node);
+		node = next;
+	}
+	if (ss->sendctrl_fd != ss->recvctrl_fd) {
+		close(ss->sendctrl_fd);
+	}
+	close(ss->recvctrl_fd);
+	if (ss->coalesce_fd >= 0) {
+		close(ss->coalesce_fd);
+	}
+	FREE(ss->coalesce_id);
+	sp_release(ss->event_fd);
+	FREE(ss);
+}
+
+void
+socket_server_release(socket_server_t *ss)
+{
+	socket_server_t ** group = ss->group;
+	int n = ss->shard_n;
+	int i;
+	// 先停掉解析线程 它们会向分片发送请求
+	_dns_release(ss->resolver);
+	for (i=0;i<n;i++) {
+		_release_shard(group[i]);
+	}
+	FREE(group);
+}
+
+static inline void
+_check_wb_list(struct wb_list *s)
+{
+	assert(s->head == NULL);
+	assert(s->tail == NULL);
+}
+// 打开或关闭可写事件 暂停读的 socket 不关注可读 io_uring 收数据的 socket 在 epoll 中也不关注可读
+// 工作线程直接写没写完时也会调用 那时持有 socket 锁 改 reading 的地方同样要拿着锁
+static inline void
+_sp_write(socket_server_t *ss, struct socket *s, bool enable)
+{
+#ifdef SOCKET_URING
+	if (s->uring) {
+		su_write(ss->event_fd, s->fd, s, enable);
+		return;
+	}
+#endif
+	if (sp_enable(ss->event_fd, s->fd, s, s->reading, enable)) {
+		fprintf(stderr, "socket-server: enable events on fd %d failed (%s).\n", s->fd, strerror(errno));
+	}
+}
+
+#ifdef SOCKET_URING
+static void _uring_start(socket_server_t *ss, struct socket *s);
+#endif
+
+//当有新的描述符需要加入时调用此函数
+static struct socket *
+_new_fd(socket_server_t *ss, int id, int fd, int protocol, uintptr_t opaque, bool add)
+{
+	struct socket * s = _get_socket(ss, id);
+	assert(s->type == SOCKET_TYPE_RESERVE);
+
+	if (add) {
+		if (sp_add(ss->event_fd, fd, s)) {
+			s->type = SOCKET_TYPE_INVALID;
+			return NULL;
+		}
+	}
+
+	s->id = id;
+	s->fd = fd;
+	s->protocol = protocol;
+	s->p.size = MIN_READ_BUFFER;
+	s->opaque = opaque; // 调用监听动作的服务的地址
+	s->wb_size = 0;
+	s->warn_size = 0;
+	_check_wb_list(&s->high);
+	_check_wb_list(&s->low);
+    spinlock_init(&s->dw_lock);
+    s->dw_buffer = NULL;
+    s->dw_size = 0;
+    s->group_id = id;
+    s->group_next = -1;
+    s->uring = 0;
+    s->reading = true;
+    s->uring_idle = false;
+    s->coalesce_pending = false;
+    s->coalesce_listed = false;
+    s->coalesce_usec = 0;
+    s->coalesce_size = 0;
+    s->coalesce_deadline = 0;
+    memset(&s->stat, 0, sizeof(s->stat));
+	return s;
+}
+
+// return -1 when connecting
+static int
+_open_socket(socket_server_t *ss, struct request_open * request, socket_message_t *result)
+{
+	int id = request->id;
+	result->opaque = request->opaque;
+	result->id = id;
+	result->ud = 0;
+	result->data = NULL;
+	struct socket *ns;
 	int status;
 	struct addrinfo ai_hints;
 	struct addrinfo *ai_list = NULL;
@@ -514,31 +1505,80 @@ _open_socket(socket_server_t *ss, struct request_open * request, socket_message_
 	ai_hints.ai_family = AF_UNSPEC;
 	ai_hints.ai_socktype = SOCK_STREAM;
 	ai_hints.ai_protocol = IPPROTO_TCP;
+	ai_hints.ai_flags = AI_NUMERICHOST;
 
-	status = getaddrinfo( request->host, port, &ai_hints, &ai_list );
-	if ( status != 0 ) {
-		result->data = (void *)gai_strerror(status);
-		goto _failed;
+	if (request->resolved != 0) {
+		// 解析线程发回的请求 解析期间 socket 可能已经被关闭了
+		struct socket * s = _get_socket(ss, id);
+		if (s->type != SOCKET_TYPE_RESERVE || s->id != id)
+			return -1;
+		if (request->resolved < 0) {
+			result->data = (void *)gai_strerror(request->status);
+			goto _failed;
+		}
+	}
+	// socket 线程只解析数字地址 域名查缓存或者交给解析线程
+	char addr_list[DNS_ADDR_MAX];
+	const char * addr = request->host;
+	if (request->resolved == 0) {
+		status = getaddrinfo( request->host, port, &ai_hints, &ai_list );
+		if (status == EAI_NONAME) {
+			if (!_dns_cache_lookup(ss->resolver, request->host, addr_list)) {
+				_dns_query(ss, request);
+				return -1;
+			}
+			addr = addr_list;
+		} else {
+			addr = NULL;
+		}
 	}
 	int sock= -1;
-	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
-		sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
-		if ( sock < 0 ) {
-			continue;
+	int error = 0;
+	for (;;) {
+		if (addr) {
+			// 域名解析的结果是空格分开的多个数字地址 依次取一个 前一个连不上时再试下一个
+			char numeric[INET6_ADDRSTRLEN];
+			const char * sep = strchr(addr, ' ');
+			size_t len = sep ? (size_t)(sep - addr) : strlen(addr);
+			if (len >= sizeof(numeric))
+				len = sizeof(numeric) - 1;
+			memcpy(numeric, addr, len);
+			numeric[len] = '\0';
+			addr = sep ? sep + 1 : NULL;
+			status = getaddrinfo( numeric, port, &ai_hints, &ai_list );
 		}
-		_socket_keepalive(sock);
-		sp_nonblocking(sock);
-		status = connect( sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
-		if ( status != 0 && errno != EINPROGRESS) {
-			close(sock);
-			sock = -1;
-			continue;
+		if ( status != 0 ) {
+			ai_list = NULL;
+			result->data = (void *)gai_strerror(status);
+		} else {
+			for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
+				sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
+				if ( sock < 0 ) {
+					error = errno;
+					continue;
+				}
+				_socket_keepalive(sock);
+				sp_nonblocking(sock);
+				status = connect( sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+				if ( status != 0 && errno != EINPROGRESS) {
+					error = errno;
+					close(sock);
+					sock = -1;
+					continue;
+				}
+				break;
+			}
+			if (sock >= 0)
+				break;
+			result->data = strerror(error);
+			freeaddrinfo( ai_list );
+			ai_list = NULL;
 		}
-		break;
+		if (addr == NULL)
+			break;
 	}
 
 	if (sock < 0) {
-		result->data = strerror(errno);
 		goto _failed;
 	}
 
@@ -551,6 +1591,11 @@ _open_socket(socket_server_t *ss, struct request_open * request, socket_message_
 
 	if(status == 0) {
 		ns->type = SOCKET_TYPE_CONNECTED;
+#ifdef SOCKET_URING
+		if (ss->uring) {
+			_uring_start(ss, ns);
+		}
+#endif
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
 		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
@@ -560,25 +1605,34 @@ _open_socket(socket_server_t *ss, struct request_open * request, socket_message_
 		return SOCKET_OPEN;
 	} else {
 		ns->type = SOCKET_TYPE_CONNECTING;
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		_sp_write(ss, ns, true);
 	}
 
 	freeaddrinfo( ai_list );
 	return -1;
 _failed:
 	freeaddrinfo( ai_list );
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	_get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 	return SOCKET_ERROR;
 }
 
+// 一次 writev 收集队列前面最多 MAX_IOV 个缓冲 写出后释放写完的缓冲 只写出一部分的缓冲推进 ptr
 static int
 _send_list_tcp(socket_server_t *ss, struct socket *s, struct wb_list *list,
                struct socket_lock *l, socket_message_t *result)
 {
+	struct iovec *iov = ss->iov;
 	while (list->head) {
-		struct write_buffer * tmp = list->head;
+		struct write_buffer * tmp;
+		int n = 0;
+		for (tmp = list->head; tmp && n < MAX_IOV; tmp = tmp->next) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			++n;
+		}
+		ssize_t sz;
 		for (;;) {
-			ssize_t sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, iov, n);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
@@ -589,16 +1643,24 @@ _send_list_tcp(socket_server_t *ss, struct socket *s, struct wb_list *list,
 				_force_close(ss,s,l,result);
 				return SOCKET_CLOSE;
 			}
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
+			break;
+		}
+		s->stat.wcall++;
+		s->stat.write += sz;
+		s->stat.wtime = ss->time;
+		s->wb_size -= sz;
+		int i;
+		for (i=0;i<n;i++) {
+			tmp = list->head;
+			if (sz < tmp->sz) {
 				tmp->ptr += sz;
 				tmp->sz -= sz;
 				return -1;
 			}
-			break;
+			sz -= tmp->sz;
+			list->head = tmp->next;
+			_write_buffer_free(ss,tmp);
 		}
-		list->head = tmp->next;
-		_write_buffer_free(ss,tmp);
 	}
 	list->tail = NULL;
 
@@ -630,6 +1692,77 @@ udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE]
 	return 0;
 }
 
+#ifdef SOCKET_MMSG
+static struct udp_batch *
+_udp_batch(socket_server_t *ss)
+{
+	struct udp_batch *b = ss->udp_batch;
+	if (b == NULL) {
+		b = MALLOC(sizeof(*b));
+		b->id = -1;
+		b->n = 0;
+		b->index = 0;
+		b->drained = 0;
+		int i;
+		for (i=0;i<UDP_BATCH;i++) {
+			memset(&b->msg[i], 0, sizeof(b->msg[i]));
+			b->iov[i].iov_base = b->buffer[i];
+			b->iov[i].iov_len = MAX_UDP_PACKAGE;
+			b->msg[i].msg_hdr.msg_name = &b->addr[i];
+			b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msg[i].msg_hdr.msg_iovlen = 1;
+			memset(&b->send[i], 0, sizeof(b->send[i]));
+			b->send[i].msg_hdr.msg_name = &b->send_addr[i];
+			b->send[i].msg_hdr.msg_iov = &b->send_iov[i];
+			b->send[i].msg_hdr.msg_iovlen = 1;
+		}
+		ss->udp_batch = b;
+	}
+	return b;
+}
+// 一次 sendmmsg 发出队列前面最多 UDP_BATCH 个包 只发出一部分时说明内核缓冲满了 等下次可写
+static int
+_send_list_udp(socket_server_t *ss, struct socket *s, struct wb_list *list, socket_message_t *result)
+{
+	struct udp_batch *b = _udp_batch(ss);
+	while (list->head) {
+		struct write_buffer * tmp;
+		int n = 0;
+		for (tmp = list->head; tmp && n < UDP_BATCH; tmp = tmp->next) {
+			b->send[n].msg_hdr.msg_namelen = udp_socket_address(s, tmp->udp_address, &b->send_addr[n]);
+			b->send_iov[n].iov_base = tmp->ptr;
+			b->send_iov[n].iov_len = tmp->sz;
+			++n;
+		}
+		int m = sendmmsg(s->fd, b->send, n, 0);
+		s->stat.wcall++;
+		if (m < 0) {
+			switch(errno) {
+			case EINTR:
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			fprintf(stderr, "socket-server : udp (%d) sendmmsg error %s.\n",s->id, strerror(errno));
+			return -1;
+		}
+		int i;
+		s->stat.wtime = ss->time;
+		for (i=0;i<m;i++) {
+			tmp = list->head;
+			s->stat.write += tmp->sz;
+			s->wb_size -= tmp->sz;
+			list->head = tmp->next;
+			_write_buffer_free(ss,tmp);
+		}
+		if (m < n) {
+			return -1;
+		}
+	}
+	list->tail = NULL;
+
+	return -1;
+}
+#else
 static int
 _send_list_udp(socket_server_t *ss, struct socket *s, struct wb_list *list, socket_message_t *result)
 {
@@ -638,6 +1771,7 @@ _send_list_udp(socket_server_t *ss, struct socket *s, struct wb_list *list, sock
 		union sockaddr_all sa;
 		socklen_t sasz = udp_socket_address(s, tmp->udp_address, &sa);
 		int err = (int)sendto(s->fd, tmp->ptr, tmp->sz, 0, &sa.s, sasz);
+		s->stat.wcall++;
 		if (err < 0) {
 			switch(errno) {
 			case EINTR:
@@ -648,6 +1782,8 @@ _send_list_udp(socket_server_t *ss, struct socket *s, struct wb_list *list, sock
 			return -1;
 		}
 
+		s->stat.write += tmp->sz;
+		s->stat.wtime = ss->time;
 		s->wb_size -= tmp->sz;
 		list->head = tmp->next;
 		_write_buffer_free(ss,tmp);
@@ -656,6 +1792,7 @@ _send_list_udp(socket_server_t *ss, struct socket *s, struct wb_list *list, sock
 
 	return -1;
 }
+#endif
 
 static int
 _send_list(socket_server_t *ss, struct socket *s, struct wb_list *list,
@@ -732,7 +1869,8 @@ _send_buffer_(socket_server_t *ss, struct socket *s,
 		}
 			// step 4
 			assert(_send_buffer_empty(s) && s->wb_size == 0);
-			sp_write(ss->event_fd, s->fd, s, false);
+			s->coalesce_pending = false;
+			_sp_write(ss, s, false);
 
 			if (s->type == SOCKET_TYPE_HALFCLOSE) {
 				_force_close(ss, s, l, result);
@@ -776,6 +1914,9 @@ _send_buffer(socket_server_t *ss, struct socket *s,
             s->high.head = buf;
         }
         s->dw_buffer = NULL;
+        if (s->wb_size > s->stat.wb_max) {
+            s->stat.wb_max = s->wb_size;
+        }
     }
     int r = _send_buffer_(ss, s, l, result);
     socket_unlock(l);
@@ -814,20 +1955,198 @@ _append_sendbuffer_udp(socket_server_t *ss, struct socket *s, int priority, stru
 	s->wb_size += buf->sz;
 }
 
-static inline void
-_append_sendbuffer(socket_server_t *ss, struct socket *s, struct request_send * request)
+static inline void
+_append_sendbuffer(socket_server_t *ss, struct socket *s, struct request_send * request)
+{
+	struct write_buffer *buf = _append_sendbuffer_(ss, &s->high, request, SIZEOF_TCPBUFFER);
+	s->wb_size += buf->sz;
+}
+
+static inline void
+__append_sendbuffer_low(socket_server_t *ss,struct socket *s, struct request_send * request)
+{
+	struct write_buffer *buf = _append_sendbuffer_(ss, &s->low, request, SIZEOF_TCPBUFFER);
+	s->wb_size += buf->sz;
+}
+
+
+/*
+	合并写: 设置了合并的 tcp socket 不在工作线程直接写 数据先留在发送队列里不关注可写
+	发送队列达到 coalesce_size 字节、时间窗口结束或者 socket_server_flush 时打开可写 用 writev 一起写出
+ */
+static inline bool
+_coalesce_enabled(struct socket *s)
+{
+	return s->coalesce_usec > 0 || s->coalesce_size > 0;
+}
+
+static uint64_t
+_coalesce_now()
+{
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000;
+}
+
+static void
+_coalesce_flush(socket_server_t *ss, struct socket *s)
+{
+	s->coalesce_pending = false;
+	_sp_write(ss, s, true);
+}
+
+#ifdef SOCKET_COALESCE_TIMER
+static void
+_coalesce_arm(socket_server_t *ss, uint64_t deadline)
+{
+	struct itimerspec it;
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = deadline / 1000000;
+	it.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	timerfd_settime(ss->coalesce_fd, TFD_TIMER_ABSTIME, &it, NULL);
+	ss->coalesce_next = deadline;
+}
+#endif
+
+// 去掉已经写出或者关闭的 id
+static void
+_coalesce_compact(socket_server_t *ss)
+{
+	int i, n = 0;
+	for (i=0;i<ss->coalesce_n;i++) {
+		int id = ss->coalesce_id[i];
+		struct socket *s = _get_socket(ss, id);
+		if (s == NULL || s->id != id)
+			continue;
+		if (!s->coalesce_pending) {
+			s->coalesce_listed = false;
+			continue;
+		}
+		ss->coalesce_id[n++] = id;
+	}
+	ss->coalesce_n = n;
+}
+
+// 新数据进了发送队列 到了字节阈值就写出 否则开始等窗口结束
+static void
+_coalesce_add(socket_server_t *ss, struct socket *s)
+{
+	if (s->coalesce_size > 0 && s->wb_size >= s->coalesce_size) {
+		_coalesce_flush(ss, s);
+		return;
+	}
+	if (s->coalesce_pending) {
+		return;
+	}
+	s->coalesce_pending = true;
+	if (!s->coalesce_listed) {
+		if (ss->coalesce_n == ss->coalesce_cap) {
+			_coalesce_compact(ss);
+		}
+		if (ss->coalesce_n == ss->coalesce_cap) {
+			int cap = ss->coalesce_cap ? ss->coalesce_cap * 2 : 64;
+			int * id = MALLOC(cap * sizeof(int));
+			if (ss->coalesce_n > 0) {
+				memcpy(id, ss->coalesce_id, ss->coalesce_n * sizeof(int));
+			}
+			FREE(ss->coalesce_id);
+			ss->coalesce_id = id;
+			ss->coalesce_cap = cap;
+		}
+		ss->coalesce_id[ss->coalesce_n++] = s->id;
+		s->coalesce_listed = true;
+	}
+	s->coalesce_deadline = 0;
+	if (s->coalesce_usec > 0) {
+#ifdef SOCKET_COALESCE_TIMER
+		if (ss->coalesce_fd >= 0) {
+			s->coalesce_deadline = _coalesce_now() + s->coalesce_usec;
+			if (ss->coalesce_next == 0 || s->coalesce_deadline < ss->coalesce_next) {
+				_coalesce_arm(ss, s->coalesce_deadline);
+			}
+			return;
+		}
+#endif
+		// 没有定时器 窗口在 socket 线程睡眠之前结束
+		s->coalesce_deadline = 1;
+		ss->coalesce_next = 1;
+	}
+}
+
+// 写出窗口已经结束的 socket 去掉已经写出或者关闭的 id
+static void
+_coalesce_check(socket_server_t *ss)
 {
-	struct write_buffer *buf = _append_sendbuffer_(ss, &s->high, request, SIZEOF_TCPBUFFER);
-	s->wb_size += buf->sz;
+	uint64_t now = _coalesce_now();
+	uint64_t next = 0;
+	int i, n = 0;
+	for (i=0;i<ss->coalesce_n;i++) {
+		int id = ss->coalesce_id[i];
+		struct socket *s = _get_socket(ss, id);
+		if (s == NULL || s->id != id)
+			continue;
+		if (s->coalesce_pending && s->coalesce_deadline != 0 && s->coalesce_deadline <= now) {
+			_coalesce_flush(ss, s);
+		}
+		if (!s->coalesce_pending) {
+			s->coalesce_listed = false;
+			continue;
+		}
+		if (s->coalesce_deadline != 0 && (next == 0 || s->coalesce_deadline < next)) {
+			next = s->coalesce_deadline;
+		}
+		ss->coalesce_id[n++] = id;
+	}
+	ss->coalesce_n = n;
+	ss->coalesce_next = 0;
+#ifdef SOCKET_COALESCE_TIMER
+	if (next && ss->coalesce_fd >= 0) {
+		_coalesce_arm(ss, next);
+	}
+#endif
 }
 
-static inline void
-__append_sendbuffer_low(socket_server_t *ss,struct socket *s, struct request_send * request)
+// 设置合并写 usec 和 size 都为 0 时关闭并写出合并中的数据
+static void
+_coalesce_socket(socket_server_t *ss, struct request_coalesce *request)
 {
-	struct write_buffer *buf = _append_sendbuffer_(ss, &s->low, request, SIZEOF_TCPBUFFER);
-	s->wb_size += buf->sz;
+	int id = request->id;
+	struct socket *s = _get_socket(ss, id);
+	if (s == NULL || s->type == SOCKET_TYPE_INVALID || s->type == SOCKET_TYPE_RESERVE || s->id != id
+		|| s->protocol != PROTOCOL_TCP || s->type == SOCKET_TYPE_PLISTEN || s->type == SOCKET_TYPE_LISTEN) {
+		return;
+	}
+#ifdef SOCKET_COALESCE_TIMER
+	if (request->usec > 0 && ss->coalesce_fd < 0) {
+		int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0 || sp_add(ss->event_fd, fd, &ss->coalesce_fd)) {
+			fprintf(stderr, "socket-server: create coalesce timer failed (%s).\n", strerror(errno));
+			if (fd >= 0)
+				close(fd);
+		} else {
+			ss->coalesce_fd = fd;
+		}
+	}
+#endif
+	s->coalesce_usec = request->usec > 0 ? request->usec : 0;
+	s->coalesce_size = request->size > 0 ? request->size : 0;
+	if (s->coalesce_pending && !_coalesce_enabled(s)) {
+		_coalesce_flush(ss, s);
+	}
 }
 
+static void
+_flush_socket(socket_server_t *ss, struct request_pause *request)
+{
+	int id = request->id;
+	struct socket *s = _get_socket(ss, id);
+	if (s == NULL || s->type == SOCKET_TYPE_INVALID || s->id != id) {
+		return;
+	}
+	if (s->coalesce_pending) {
+		_coalesce_flush(ss, s);
+	}
+}
 
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
@@ -840,10 +2159,12 @@ static int
 _send_socket(socket_server_t *ss, struct request_send * request, socket_message_t *result, int priority, const uint8_t *udp_address)
 {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = _get_socket(ss, id);
 	struct send_object so;
 	_send_object_init(ss, &so, request->buffer, request->sz);
-	if (s->type == SOCKET_TYPE_INVALID || s->id != id 
+	// RESERVE 是还在等待域名解析的 connect 这时还没有 fd 不能写 数据直接丢掉
+	if (s == NULL || s->type == SOCKET_TYPE_INVALID || s->id != id 
+		|| s->type == SOCKET_TYPE_RESERVE
 		|| s->type == SOCKET_TYPE_HALFCLOSE
 		|| s->type == SOCKET_TYPE_PACCEPT) {
 		so.free_func(request->buffer);
@@ -854,6 +2175,7 @@ _send_socket(socket_server_t *ss, struct request_send * request, socket_message_
 		so.free_func(request->buffer);
 		return -1;
 	}
+	s->stat.wmsg++;
 	if (_send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED) {
 		if (s->protocol == PROTOCOL_TCP) {
 			_append_sendbuffer(ss, s, request);	// add to high priority list, even priority == PRIORITY_LOW
@@ -865,14 +2187,21 @@ _send_socket(socket_server_t *ss, struct request_send * request, socket_message_
 			union sockaddr_all sa;
 			socklen_t sasz = udp_socket_address(s, udp_address, &sa);
 			int n = (int)sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
+			s->stat.wcall++;
 			if (n != so.sz) {
 				_append_sendbuffer_udp(ss,s,priority,request,udp_address);
 			} else {
+				s->stat.write += n;
+				s->stat.wtime = ss->time;
 				so.free_func(request->buffer);
 				return -1;
 			}
 		}
-		sp_write(ss->event_fd, s->fd, s, true);
+		if (s->protocol == PROTOCOL_TCP && _coalesce_enabled(s)) {
+			_coalesce_add(ss, s);
+		} else {
+			_sp_write(ss, s, true);
+		}
 	} else {
 		if (s->protocol == PROTOCOL_TCP) {
 			if (priority == PRIORITY_LOW) {
@@ -886,6 +2215,12 @@ _send_socket(socket_server_t *ss, struct request_send * request, socket_message_
 			}
 			_append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
+		if (s->coalesce_pending) {
+			_coalesce_add(ss, s);
+		}
+	}
+	if (s->wb_size > s->stat.wb_max) {
+		s->stat.wb_max = s->wb_size;
 	}
 	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
 		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
@@ -908,6 +2243,8 @@ _listen_socket(socket_server_t *ss, struct request_listen * request, socket_mess
 		goto _failed;
 	}
 	s->type = SOCKET_TYPE_PLISTEN;
+	s->group_id = request->group;
+	s->group_next = request->next;
 	return -1;
 _failed:
 	close(listen_fd);
@@ -915,7 +2252,7 @@ _failed:
 	result->id = id;
 	result->ud = 0;
 	result->data = "reach mtask socket number limit";
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	_get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 
 	return SOCKET_ERROR;
 }
@@ -927,12 +2264,30 @@ _nomore_send_data(struct socket *s)
     return _send_buffer_empty(s) && s->dw_buffer == NULL;
 }
 
+// 有数据要写并且不在合并写的窗口里 才需要关注可写 窗口里的数据等定时器或者 flush 写出
+static inline bool
+_need_write(struct socket *s)
+{
+    return !_nomore_send_data(s) && !s->coalesce_pending;
+}
+
 static int
 _close_socket(socket_server_t *ss, struct request_close *request, socket_message_t *result)
 {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
-	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
+	struct socket * s = _get_socket(ss, id);
+	if (s == NULL || s->type == SOCKET_TYPE_INVALID || s->id != id) {
+		result->id = id;
+		result->opaque = request->opaque;
+		result->ud = 0;
+		result->data = NULL;
+		return SOCKET_CLOSE;
+	}
+	if (s->type == SOCKET_TYPE_RESERVE) {
+		// connect 还在等待域名解析 解析完成后发回的请求会被丢弃
+		_free_wb_list(ss,&s->high);
+		_free_wb_list(ss,&s->low);
+		s->type = SOCKET_TYPE_INVALID;
 		result->id = id;
 		result->opaque = request->opaque;
 		result->ud = 0;
@@ -941,6 +2296,19 @@ _close_socket(socket_server_t *ss, struct request_close *request, socket_message
 	}
     struct socket_lock l;
     socket_lock_init(s, &l);
+	if (s->group_next >= 0) {
+		// 关闭监听组中的下一个 socket
+		socket_server_close(ss, request->opaque, s->group_next);
+		s->group_next = -1;
+	}
+	if (s->group_id != id) {
+		// 监听组中的其它 socket 对上层不可见 不必上报
+		_force_close(ss,s,&l,result);
+		return -1;
+	}
+	if (s->coalesce_pending) {
+		_coalesce_flush(ss, s);
+	}
 	if (!_nomore_send_data(s)) {
 		int type = _send_buffer(ss,s,&l,result);
 		// type : -1 or SOCKET_WARNING or SOCKET_CLOSE, SOCKET_WARNING means _nomore_send_data
@@ -984,21 +2352,38 @@ _start_socket(socket_server_t *ss, struct request_start *request, socket_message
 	result->opaque = request->opaque; // 服务的地址
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[HASH_ID(id)];
-	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
+	struct socket *s = _get_socket(ss, id);
+	if (s == NULL || s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		result->data = "invalid socket";
 		return SOCKET_ERROR;
 	}
     struct socket_lock l;
     socket_lock_init(s, &l);
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {
-		if (sp_add(ss->event_fd, s->fd, s)) {
+		int add = 1;
+#ifdef SOCKET_URING
+		// io_uring 的监听 socket 用 multishot accept 不需要加入 epoll
+		add = !(ss->uring && s->type == SOCKET_TYPE_PLISTEN);
+#endif
+		if (add && sp_add(ss->event_fd, s->fd, s)) {
 			_force_close(ss, s, &l, result);
 			result->data = strerror(errno);
 			return SOCKET_ERROR;
 		}
 		s->type = (s->type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN;
 		s->opaque = request->opaque;
+#ifdef SOCKET_URING
+		if (ss->uring) {
+			_uring_start(ss, s);
+		}
+#endif
+		if (s->group_next >= 0) {
+			// 监听组中的 socket 依次加入各自分片的 epoll
+			socket_server_start(ss, request->opaque, s->group_next);
+		}
+		if (s->group_id != id) {
+			return -1;
+		}
 		result->data = "start";
 		return SOCKET_OPEN;
 	} else if (s->type == SOCKET_TYPE_CONNECTED) {
@@ -1015,14 +2400,67 @@ static void
 _setopt_socket(socket_server_t *ss, struct request_setopt *request)
 {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
-	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
+	struct socket *s = _get_socket(ss, id);
+	if (s == NULL || s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return;
 	}
 	int v = request->value;
 	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
+// 暂停读: epoll 去掉可读事件 io_uring 取消 multishot recv 已经在路上的数据照常上报
+// 数据留在内核缓冲区里 缓冲区满了对端就被 tcp 流控挡住 只对已经 start 的连接和 udp socket 有效
+static void
+_pause_socket(socket_server_t *ss, struct request_pause *request)
+{
+	int id = request->id;
+	struct socket *s = _get_socket(ss, id);
+	if (s == NULL || s->type != SOCKET_TYPE_CONNECTED || s->id != id || !s->reading) {
+		return;
+	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	s->reading = false;
+#ifdef SOCKET_URING
+	if (s->uring) {
+		socket_unlock(&l);
+		su_cancel(ss->uring, URING_DATA(s->id, URING_OP_RECV));
+		return;
+	}
+#endif
+	_sp_write(ss, s, _need_write(s));
+	socket_unlock(&l);
+}
+
+static void
+_resume_socket(socket_server_t *ss, struct request_pause *request)
+{
+	int id = request->id;
+	struct socket *s = _get_socket(ss, id);
+	if (s == NULL || s->type != SOCKET_TYPE_CONNECTED || s->id != id || s->reading) {
+		return;
+	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	s->reading = true;
+#ifdef SOCKET_URING
+	if (s->uring) {
+		socket_unlock(&l);
+		// 取消还没有完成时 recv 还挂着 等 ECANCELED 到达时重新挂上
+		if (s->uring_idle) {
+			s->uring_idle = false;
+			su_recv(ss->uring, s->fd, URING_DATA(s->id, URING_OP_RECV));
+		}
+		return;
+	}
+#endif
+	_sp_write(ss, s, _need_write(s));
+	socket_unlock(&l);
+}
+
+#ifndef SOCKET_CTRL_QUEUE
 static void
 _block_readpipe(int pipefd, void *buffer, int sz) 
 {
@@ -1039,6 +2477,39 @@ _block_readpipe(int pipefd, void *buffer, int sz)
 		return;
 	}
 }
+#endif
+#ifdef SOCKET_CTRL_QUEUE
+//取出队列中所有的请求 一次 epoll 循环中依次处理
+static int
+_has_cmd(socket_server_t *ss)
+{
+	if (ss->ctrl_list) {
+		return 1;
+	}
+	struct request_node * node = ATOM_XCHG(&ss->ctrl_head, NULL);
+	if (node == NULL) {
+		return 0;
+	}
+	// 压入时是栈 反转成压入的顺序
+	struct request_node * list = NULL;
+	while (node) {
+		struct request_node * next = node->next;
+		node->next = list;
+		list = node;
+		node = next;
+	}
+	ss->ctrl_list = list;
+	return 1;
+}
+//消耗 eventfd 的计数
+static void
+_clear_ctrl_event(socket_server_t *ss)
+{
+	uint64_t v;
+	while (read(ss->recvctrl_fd, &v, sizeof(v)) < 0 && errno == EINTR) {
+	}
+}
+#else
 //判断管道的接收描述符是不是有请求过来
 static int
 _has_cmd(socket_server_t *ss) 
@@ -1054,6 +2525,7 @@ _has_cmd(socket_server_t *ss)
 	}
 	return 0;
 }
+#endif
 
 static void
 _add_udp_socket(socket_server_t *ss, struct request_udp *udp)
@@ -1068,7 +2540,7 @@ _add_udp_socket(socket_server_t *ss, struct request_udp *udp)
 	struct socket *ns = _new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
 	if (ns == NULL) {
 		close(udp->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		_get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 		return;
 	}
 	ns->type = SOCKET_TYPE_CONNECTED;
@@ -1079,8 +2551,8 @@ static int
 _set_udp_address(socket_server_t *ss, struct request_setudp *request, socket_message_t *result) 
 {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
-	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
+	struct socket *s = _get_socket(ss, id);
+	if (s == NULL || s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return -1;
 	}
 	int type = request->address[0];
@@ -1108,19 +2580,10 @@ _set_udp_address(socket_server_t *ss, struct request_setudp *request, socket_mes
  * 绑定在调用socket_server_listen时已经发生了
  * 发包给客户端:'D'
  ******************************************************************/
-//检查 从写管道中发送的 本地命令（解析）
+//处理一个本地命令
 static int
-_ctrl_cmd(socket_server_t *ss, socket_message_t *result) 
+_ctrl_dispatch(socket_server_t *ss, int type, uint8_t *buffer, socket_message_t *result)
 {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256+8 buffer size is enough.
-	uint8_t buffer[256];
-	uint8_t header[2];
-	_block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	_block_readpipe(fd, buffer, len);
-	// ctrl command only exist in local fd, so don't worry about endian.
 	switch (type) {
         case 'S'://listen与accept后都会调用'S' 返回:SOCKET_ERROR、SOCKET_OPEN
             return _start_socket(ss,(struct request_start *)buffer, result);
@@ -1154,6 +2617,18 @@ _ctrl_cmd(socket_server_t *ss, socket_message_t *result)
         case 'U':
             _add_udp_socket(ss, (struct request_udp *)buffer);
             return -1;
+        case 'Q':
+            _pause_socket(ss, (struct request_pause *)buffer);
+            return -1;
+        case 'R':
+            _resume_socket(ss, (struct request_pause *)buffer);
+            return -1;
+        case 'W':
+            _coalesce_socket(ss, (struct request_coalesce *)buffer);
+            return -1;
+        case 'F':
+            _flush_socket(ss, (struct request_pause *)buffer);
+            return -1;
         default:
             fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
             return -1;
@@ -1161,18 +2636,193 @@ _ctrl_cmd(socket_server_t *ss, socket_message_t *result)
 
 	return -1;
 }
+#ifdef SOCKET_CTRL_QUEUE
+//处理队列中的下一个请求
+static int
+_ctrl_cmd(socket_server_t *ss, socket_message_t *result)
+{
+	struct request_node * node = ss->ctrl_list;
+	ss->ctrl_list = node->next;
+	int type = _ctrl_dispatch(ss, node->type, (uint8_t *)node->buffer, result);
+	FREE(node);
+	return type;
+}
+#else
+//检查 从写管道中发送的 本地命令（解析）
+static int
+_ctrl_cmd(socket_server_t *ss, socket_message_t *result) 
+{
+	int fd = ss->recvctrl_fd;
+	// the length of message is one byte, so 256+8 buffer size is enough.
+	uint8_t buffer[256];
+	uint8_t header[2];
+	_block_readpipe(fd, header, sizeof(header));
+	int type = header[0];
+	int len = header[1];
+	_block_readpipe(fd, buffer, len);
+	// ctrl command only exist in local fd, so don't worry about endian.
+	return _ctrl_dispatch(ss, type, buffer, result);
+}
+#endif
 
 // return -1 (ignore) when error
+// 能放下 sz 字节的最小类别 超过最大类别返回 RECV_TAG_NONE
+static inline int
+_recv_class(int sz)
+{
+	int cls = 0;
+	while ((1 << (RECV_CLASS_P + cls)) < sz) {
+		if (++cls == RECV_CLASS)
+			return RECV_TAG_NONE;
+	}
+	return cls;
+}
+static inline void
+_recv_tag(char *buffer, int sz, int cls)
+{
+	uint32_t tag = RECV_TAG_MAGIC | (uint8_t)cls;
+	memcpy(buffer + sz, &tag, sizeof(tag));
+}
+// 把其它线程还回来的块按类别放进池 超过池容量的释放
+static void
+_recv_collect(socket_server_t *ss)
+{
+	struct recv_block * b = ATOM_XCHG(&ss->recv_return, NULL);
+	while (b) {
+		struct recv_block * next = b->next;
+		int cls = b->cls;
+		if (ss->recv_free_n[cls] < (RECV_POOL_SIZE >> (RECV_CLASS_P + cls))) {
+			b->next = ss->recv_free[cls];
+			ss->recv_free[cls] = b;
+			++ss->recv_free_n[cls];
+		} else {
+			FREE(b);
+		}
+		b = next;
+	}
+}
+// 取一块 cls 类的块 池里没有时先收回其它线程还回来的
+static char *
+_recv_alloc(socket_server_t *ss, int cls, int sz)
+{
+	if (cls == RECV_TAG_NONE) {
+		return MALLOC(sz);
+	}
+	struct recv_block * b = ss->recv_free[cls];
+	if (b == NULL && ss->recv_return) {
+		_recv_collect(ss);
+		b = ss->recv_free[cls];
+	}
+	if (b == NULL) {
+		return MALLOC(1 << (RECV_CLASS_P + cls));
+	}
+	ss->recv_free[cls] = b->next;
+	--ss->recv_free_n[cls];
+	return (char *)b;
+}
+// socket 线程自己用不上的块直接放回池
+static void
+_recv_free(socket_server_t *ss, char *buffer, int cls)
+{
+	if (cls == RECV_TAG_NONE) {
+		FREE(buffer);
+		return;
+	}
+	struct recv_block * b = (struct recv_block *)buffer;
+	b->next = ss->recv_free[cls];
+	ss->recv_free[cls] = b;
+	++ss->recv_free_n[cls];
+}
+
+static void
+_recv_pool_release(socket_server_t *ss)
+{
+	int i;
+	_recv_collect(ss);
+	for (i=0;i<RECV_CLASS;i++) {
+		struct recv_block * b = ss->recv_free[i];
+		while (b) {
+			struct recv_block * next = b->next;
+			FREE(b);
+			b = next;
+		}
+		ss->recv_free[i] = NULL;
+		ss->recv_free_n[i] = 0;
+	}
+}
+
+// 各个工作线程攒着要还的块 整批压进一个分片的 recv_return
+static __thread struct recv_block * recycle_head = NULL;
+static __thread struct recv_block * recycle_tail = NULL;
+static __thread int recycle_n = 0;
+static __thread int recycle_size = 0;
+
+// 整批压进一个分片的 recv_return
+static void
+_recycle_flush(socket_server_t *ss)
+{
+	if (recycle_head == NULL)
+		return;
+	ss = ss->group[(unsigned)ATOM_FINC(&ss->group[0]->recv_return_next) % ss->shard_n];
+	struct recv_block * head;
+	do {
+		head = ss->recv_return;
+		recycle_tail->next = head;
+	} while (!ATOM_CAS_POINTER(&ss->recv_return, head, recycle_head));
+	recycle_head = recycle_tail = NULL;
+	recycle_n = 0;
+	recycle_size = 0;
+}
+
+void
+socket_server_recycle(socket_server_t *ss, void *buffer, int sz)
+{
+	uint32_t tag;
+	int cls = RECV_TAG_NONE;
+	if (sz >= 0) {
+		memcpy(&tag, (char *)buffer + sz, sizeof(tag));
+		if ((tag & ~0xffu) == RECV_TAG_MAGIC) {
+			cls = tag & 0xff;
+		}
+	}
+	// 标记对不上 或者数据和标记放不进这一类的块 都不是池里的块
+	if (cls >= RECV_CLASS || sz + RECV_TAG_SIZE > (1 << (RECV_CLASS_P + cls))) {
+		FREE(buffer);
+		return;
+	}
+	struct recv_block * b = buffer;
+	b->cls = cls;
+	b->next = recycle_head;
+	recycle_head = b;
+	if (recycle_tail == NULL) {
+		recycle_tail = b;
+	}
+	++recycle_n;
+	recycle_size += 1 << (RECV_CLASS_P + cls);
+	if (recycle_n < RECV_RECYCLE_N && recycle_size < RECV_RECYCLE_SIZE) {
+		return;
+	}
+	_recycle_flush(ss);
+}
+
+void
+socket_server_recycle_flush(socket_server_t *ss)
+{
+	_recycle_flush(ss);
+}
+
 static int
 _forward_message_tcp(socket_server_t *ss, struct socket *s, struct socket_lock *l,
                      socket_message_t * result)
 {
-    // 先接收预设的字节数,即在new_fd函数中设置的 MIN_READ_BUFFER
+    // 先接收预设的字节数,即在new_fd函数中设置的 MIN_READ_BUFFER 块的最后 RECV_TAG_SIZE 个字节留给标记
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
-	int n = (int)read(s->fd, buffer, sz);
+	int cls = _recv_class(sz);
+	char * buffer = _recv_alloc(ss, cls, sz);
+	int n = (int)read(s->fd, buffer, sz - RECV_TAG_SIZE);
+	s->stat.rcall++;
 	if (n<0) {
-		FREE(buffer);
+		_recv_free(ss, buffer, cls);
 		switch(errno) {
             case EINTR:
                 break;
@@ -1188,49 +2838,207 @@ _forward_message_tcp(socket_server_t *ss, struct socket *s, struct socket_lock *
 		return -1;
 	}
 	if (n==0) {
-		FREE(buffer);
+		_recv_free(ss, buffer, cls);
 		_force_close(ss, s, l, result);
 		return SOCKET_CLOSE;
 	}
 
-	if (s->type == SOCKET_TYPE_HALFCLOSE) {
-		// discard recv data
-		FREE(buffer);
-		return -1;
+	if (s->type == SOCKET_TYPE_HALFCLOSE) {
+		// discard recv data
+		_recv_free(ss, buffer, cls);
+		return -1;
+	}
+
+	if (n == sz - RECV_TAG_SIZE) {
+		s->p.size *= 2;
+	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
+		s->p.size /= 2;
+	}
+	_recv_tag(buffer, n, cls);
+	s->stat.read += n;
+	s->stat.rmsg++;
+	s->stat.rtime = ss->time;
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n; // 收到了多少个字节数的网络数据
+	result->data = buffer;
+	return SOCKET_DATA;
+}
+
+static int
+_gen_udp_address(int protocol, const union sockaddr_all *sa, uint8_t * udp_address)
+{
+	int addrsz = 1;
+	udp_address[0] = (uint8_t)protocol;
+	if (protocol == PROTOCOL_UDP) {
+		memcpy(udp_address+addrsz, &sa->v4.sin_port, sizeof(sa->v4.sin_port));
+		addrsz += sizeof(sa->v4.sin_port);
+		memcpy(udp_address+addrsz, &sa->v4.sin_addr, sizeof(sa->v4.sin_addr));
+		addrsz += sizeof(sa->v4.sin_addr);
+	} else {
+		memcpy(udp_address+addrsz, &sa->v6.sin6_port, sizeof(sa->v6.sin6_port));
+		addrsz += sizeof(sa->v6.sin6_port);
+		memcpy(udp_address+addrsz, &sa->v6.sin6_addr, sizeof(sa->v6.sin6_addr));
+		addrsz += sizeof(sa->v6.sin6_addr);
+	}
+	return addrsz;
+}
+
+#ifndef SOCKET_MMSG
+// 收到的一个包复制出来 后面跟着对端地址 地址类型和 socket 不一致时丢弃返回 -1
+static int
+_udp_message(socket_server_t *ss, struct socket *s, const uint8_t *buffer, int n,
+             const union sockaddr_all *sa, socklen_t slen, socket_message_t * result)
+{
+	uint8_t * data;
+	if (slen == sizeof(sa->v4)) {
+		if (s->protocol != PROTOCOL_UDP)
+			return -1;
+		data = MALLOC(n + 1 + 2 + 4);
+		_gen_udp_address(PROTOCOL_UDP, sa, data + n);
+	} else {
+		if (s->protocol != PROTOCOL_UDPv6)
+			return -1;
+		data = MALLOC(n + 1 + 2 + 16);
+		_gen_udp_address(PROTOCOL_UDPv6, sa, data + n);
+	}
+	memcpy(data, buffer, n);
+	s->stat.read += n;
+	s->stat.rmsg++;
+	s->stat.rtime = ss->time;
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = (char *)data;
+
+	return SOCKET_UDP;
+}
+#endif
+
+// SOCKET_UDP_BATCH 的块: 开头是包数 接着每个包一条记录 后面依次是包的数据 最后是收数据块的标记
+struct udp_record {
+	int offset;         // 包的数据在块中的偏移
+	int sz;
+	uint8_t address[UDP_ADDRESS_SIZE];
+};
+
+const char *
+socket_server_udp_batch(socket_server_t *ss, const char *buffer, int index, int *sz, const char **address, int *addrsz)
+{
+	int n;
+	memcpy(&n, buffer, sizeof(n));
+	if (index < 0 || index >= n)
+		return NULL;
+	const struct udp_record * r = (const struct udp_record *)(buffer + sizeof(int)) + index;
+	*sz = r->sz;
+	*address = (const char *)r->address;
+	*addrsz = r->address[0] == PROTOCOL_UDP ? 1+2+4 : 1+2+16;
+	return buffer + r->offset;
+}
+
+#ifdef SOCKET_MMSG
+static inline int
+_udp_protocol(socklen_t slen)
+{
+	return slen == sizeof(((union sockaddr_all *)0)->v4) ? PROTOCOL_UDP : PROTOCOL_UDPv6;
+}
+
+// 从 b->index 开始 把能放进一个最大的收数据块的包拷进池里的块 地址类型和 socket 不一致的包丢掉
+// 一个包也放不下时单独分配 交出的包一个都没有时返回 -1
+static int
+_udp_batch_message(socket_server_t *ss, struct socket *s, struct udp_batch *b, socket_message_t * result)
+{
+	const int max = (1 << (RECV_CLASS_P + RECV_CLASS - 1)) - RECV_TAG_SIZE;
+	int size = sizeof(int);
+	int n = 0;
+	int i;
+	for (i=b->index;i<b->n;i++) {
+		struct mmsghdr *m = &b->msg[i];
+		if (_udp_protocol(m->msg_hdr.msg_namelen) != s->protocol)
+			continue;
+		int need = (int)(sizeof(struct udp_record) + m->msg_len);
+		if (n > 0 && size + need > max)
+			break;
+		size += need;
+		++n;
 	}
-
-	if (n == sz) {
-		s->p.size *= 2;
-	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
-		s->p.size /= 2;
+	int from = b->index;
+	int to = i;
+	b->index = to;
+	if (n == 0)
+		return -1;
+	int cls = _recv_class(size + RECV_TAG_SIZE);
+	char * buffer = _recv_alloc(ss, cls, size + RECV_TAG_SIZE);
+	struct udp_record * r = (struct udp_record *)(buffer + sizeof(int));
+	int offset = sizeof(int) + n * sizeof(struct udp_record);
+	memcpy(buffer, &n, sizeof(n));
+	for (i=from;i<to;i++) {
+		struct mmsghdr *m = &b->msg[i];
+		if (_udp_protocol(m->msg_hdr.msg_namelen) != s->protocol)
+			continue;
+		r->offset = offset;
+		r->sz = (int)m->msg_len;
+		_gen_udp_address(s->protocol, &b->addr[i], r->address);
+		memcpy(buffer + offset, b->buffer[i], r->sz);
+		offset += r->sz;
+		++r;
 	}
+	_recv_tag(buffer, size, cls);
+	s->stat.read += size - sizeof(int) - n * sizeof(struct udp_record);
+	s->stat.rmsg++;
+	s->stat.rtime = ss->time;
 
 	result->opaque = s->opaque;
 	result->id = s->id;
-	result->ud = n; // 收到了多少个字节数的网络数据
+	result->ud = size;
 	result->data = buffer;
-	return SOCKET_DATA;
+	return SOCKET_UDP_BATCH;
 }
 
+// 先交出上次 recvmmsg 收到的包 交完再收下一批 每次返回一块包 poll 会回到同一个事件继续读
 static int
-_gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address)
+_forward_message_udp(socket_server_t *ss, struct socket *s,
+                     struct socket_lock *l, socket_message_t * result)
 {
-	int addrsz = 1;
-	udp_address[0] = (uint8_t)protocol;
-	if (protocol == PROTOCOL_UDP) {
-		memcpy(udp_address+addrsz, &sa->v4.sin_port, sizeof(sa->v4.sin_port));
-		addrsz += sizeof(sa->v4.sin_port);
-		memcpy(udp_address+addrsz, &sa->v4.sin_addr, sizeof(sa->v4.sin_addr));
-		addrsz += sizeof(sa->v4.sin_addr);
-	} else {
-		memcpy(udp_address+addrsz, &sa->v6.sin6_port, sizeof(sa->v6.sin6_port));
-		addrsz += sizeof(sa->v6.sin6_port);
-		memcpy(udp_address+addrsz, &sa->v6.sin6_addr, sizeof(sa->v6.sin6_addr));
-		addrsz += sizeof(sa->v6.sin6_addr);
+	struct udp_batch *b = _udp_batch(ss);
+	for (;;) {
+		while (b->id == s->id && b->index < b->n) {
+			if (_udp_batch_message(ss, s, b, result) == SOCKET_UDP_BATCH)
+				return SOCKET_UDP_BATCH;
+		}
+		if (b->id == s->id && b->drained) {
+			b->id = -1;
+			return -1;
+		}
+		int i;
+		for (i=0;i<UDP_BATCH;i++) {
+			b->msg[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+		}
+		int n = recvmmsg(s->fd, b->msg, UDP_BATCH, 0, NULL);
+		s->stat.rcall++;
+		if (n<0) {
+			b->id = -1;
+			switch(errno) {
+			case EINTR:
+			case AGAIN_WOULDBLOCK:
+				break;
+			default:
+				// close when error
+				_force_close(ss, s, l, result);
+				result->data = strerror(errno);
+				return SOCKET_ERROR;
+			}
+			return -1;
+		}
+		b->id = s->id;
+		b->n = n;
+		b->index = 0;
+		b->drained = n < UDP_BATCH;
 	}
-	return addrsz;
 }
-
+#else
 static int
 _forward_message_udp(socket_server_t *ss, struct socket *s,
                      struct socket_lock *l, socket_message_t * result)
@@ -1238,6 +3046,7 @@ _forward_message_udp(socket_server_t *ss, struct socket *s,
 	union sockaddr_all sa;
 	socklen_t slen = sizeof(sa);
 	int n = (int)recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
+	s->stat.rcall++;
 	if (n<0) {
 		switch(errno) {
 		case EINTR:
@@ -1251,27 +3060,9 @@ _forward_message_udp(socket_server_t *ss, struct socket *s,
 		}
 		return -1;
 	}
-	uint8_t * data;
-	if (slen == sizeof(sa.v4)) {
-		if (s->protocol != PROTOCOL_UDP)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 4);
-		_gen_udp_address(PROTOCOL_UDP, &sa, data + n);
-	} else {
-		if (s->protocol != PROTOCOL_UDPv6)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 16);
-		_gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
-	}
-	memcpy(data, ss->udpbuffer, n);
-
-	result->opaque = s->opaque;
-	result->id = s->id;
-	result->ud = n;
-	result->data = (char *)data;
-
-	return SOCKET_UDP;
+	return _udp_message(ss, s, ss->udpbuffer, n, &sa, slen, result);
 }
+#endif
 
 static int
 _report_connect(socket_server_t *ss, struct socket *s, struct socket_lock *l,
@@ -1292,8 +3083,13 @@ _report_connect(socket_server_t *ss, struct socket *s, struct socket_lock *l,
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = 0;
-		if (_nomore_send_data(s)) {
-			sp_write(ss->event_fd, s->fd, s, false);
+#ifdef SOCKET_URING
+		if (ss->uring) {
+			_uring_start(ss, s);
+		} else
+#endif
+		if (!_need_write(s)) {
+			_sp_write(ss, s, false);
 		}
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
@@ -1309,48 +3105,34 @@ _report_connect(socket_server_t *ss, struct socket *s, struct socket_lock *l,
 	}
 }
 
-// return 0 when failed,or -1 when file limit
+// 新连接 client_fd 由监听 socket s accept 得到 addr 为对端地址 返回 1 成功 0 失败
 static int
-_report_accept(socket_server_t *ss, struct socket *s, socket_message_t *result)
+_accept_fd(socket_server_t *ss, struct socket *s, int client_fd, union sockaddr_all *addr, socket_message_t *result)
 {
-	union sockaddr_all u;
-	socklen_t len = sizeof(u);
-    // 返回已连接描述符
-	int client_fd = accept(s->fd, &u.s, &len);
-	if (client_fd < 0) {
-	if (errno == EMFILE || errno == ENFILE) {
-			result->opaque = s->opaque;
-			result->id = s->id;
-			result->ud = 0;
-			result->data = strerror(errno);
-			return -1;
-		} else {
-			return 0;
-		}
-
-	}
-	int id = _reserve_id(ss);
+	// 新连接轮流分配到各分片 start 时加入所在分片的 epoll
+	socket_server_t *ts = _alloc_shard(ss);
+	int id = _reserve_id(ts);
 	if (id < 0) {
 		close(client_fd);
 		return 0;
 	}
 	_socket_keepalive(client_fd);
 	sp_nonblocking(client_fd);
-	struct socket *ns = _new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
+	struct socket *ns = _new_fd(ts, id, client_fd, PROTOCOL_TCP, s->opaque, false);
 	if (ns == NULL) {
 		close(client_fd);
 		return 0;
 	}
 	ns->type = SOCKET_TYPE_PACCEPT;
 	result->opaque = s->opaque;
-	result->id = s->id;
+	result->id = s->group_id;
 	result->ud = id;
 	result->data = NULL;
 
-	void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-	int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
+	void * sin_addr = (addr->s.sa_family == AF_INET) ? (void*)&addr->v4.sin_addr : (void *)&addr->v6.sin6_addr;
+	int sin_port = ntohs((addr->s.sa_family == AF_INET) ? addr->v4.sin_port : addr->v6.sin6_port);
 	char tmp[INET6_ADDRSTRLEN];
-	if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
+	if (inet_ntop(addr->s.sa_family, sin_addr, tmp, sizeof(tmp))) {
 		snprintf(ss->buffer, sizeof(ss->buffer), "%s:%d", tmp, sin_port);
 		result->data = ss->buffer;
 	}
@@ -1358,6 +3140,29 @@ _report_accept(socket_server_t *ss, struct socket *s, socket_message_t *result)
 	return 1;
 }
 
+// return 0 when failed,or -1 when file limit
+static int
+_report_accept(socket_server_t *ss, struct socket *s, socket_message_t *result)
+{
+	union sockaddr_all u;
+	socklen_t len = sizeof(u);
+    // 返回已连接描述符
+	int client_fd = accept(s->fd, &u.s, &len);
+	if (client_fd < 0) {
+	if (errno == EMFILE || errno == ENFILE) {
+			result->opaque = s->opaque;
+			result->id = s->group_id;
+			result->ud = 0;
+			result->data = strerror(errno);
+			return -1;
+		} else {
+			return 0;
+		}
+
+	}
+	return _accept_fd(ss, s, client_fd, &u, result);
+}
+
 static inline void 
 _clear_closed_event(socket_server_t *ss, socket_message_t * result, int type) 
 {
@@ -1367,6 +3172,13 @@ _clear_closed_event(socket_server_t *ss, socket_message_t * result, int type)
 		for (i=ss->event_index; i<ss->event_n; i++) {
 			event_t *e = &ss->ev[i];
 			struct socket *s = e->s;
+#ifdef SOCKET_URING
+			if (s && e->s == (void *)ss->uring)
+				continue;
+#endif
+			// 合并写的 timerfd 事件 e->s 指向 ss->coalesce_fd 不是 socket
+			if (s && e->s == (void *)&ss->coalesce_fd)
+				continue;
 			if (s) {
 				if (s->type == SOCKET_TYPE_INVALID && s->id == id) {
 					e->s = NULL;
@@ -1377,6 +3189,192 @@ _clear_closed_event(socket_server_t *ss, socket_message_t * result, int type)
 	}
 }
 
+#ifdef SOCKET_URING
+// socket 开始用 io_uring: 监听 socket 挂 multishot accept ，连接挂 multishot recv 并且在 epoll 中只关注可写
+static void
+_uring_start(socket_server_t *ss, struct socket *s)
+{
+	if (s->type == SOCKET_TYPE_LISTEN) {
+		s->uring = URING_OP_ACCEPT;
+		su_accept(ss->uring, s->fd, URING_DATA(s->id, URING_OP_ACCEPT));
+	} else if (s->protocol == PROTOCOL_TCP) {
+		s->uring = URING_OP_RECV;
+		su_write(ss->event_fd, s->fd, s, _need_write(s));
+		su_recv(ss->uring, s->fd, URING_DATA(s->id, URING_OP_RECV));
+	}
+}
+
+static int
+_uring_accept(socket_server_t *ss, struct socket *s, int res, unsigned flags, socket_message_t *result)
+{
+	if (!(flags & IORING_CQE_F_MORE) && res != -ECANCELED) {
+		// multishot accept 结束了 重新挂上
+		su_accept(ss->uring, s->fd, URING_DATA(s->id, URING_OP_ACCEPT));
+	}
+	if (res < 0) {
+		if (res == -EMFILE || res == -ENFILE) {
+			result->opaque = s->opaque;
+			result->id = s->group_id;
+			result->ud = 0;
+			result->data = strerror(-res);
+			return SOCKET_ERROR;
+		}
+		return -1;
+	}
+	union sockaddr_all u;
+	socklen_t len = sizeof(u);
+	if (getpeername(res, &u.s, &len)) {
+		memset(&u, 0, sizeof(u));
+		u.s.sa_family = AF_INET;
+	}
+	return _accept_fd(ss, s, res, &u, result) ? SOCKET_ACCEPT : -1;
+}
+
+// multishot recv 结束了 暂停读时不再挂上 等恢复读
+static void
+_uring_rearm(socket_server_t *ss, struct socket *s)
+{
+	if (s->reading) {
+		su_recv(ss->uring, s->fd, URING_DATA(s->id, URING_OP_RECV));
+	} else {
+		s->uring_idle = true;
+	}
+}
+
+static int
+_uring_recv(socket_server_t *ss, struct socket *s, struct socket_lock *l, int res, unsigned flags, const char *data, socket_message_t *result)
+{
+	if (res > 0 && !(flags & IORING_CQE_F_MORE)) {
+		_uring_rearm(ss, s);
+	}
+	if (res < 0) {
+		switch (-res) {
+		case ENOBUFS:
+			// provided buffer 暂时用完了 收割完的 buffer 已经还回去了 重新挂上
+			_uring_rearm(ss, s);
+			return -1;
+		case ECANCELED:
+		case EINTR:
+		case EAGAIN:
+			if (!(flags & IORING_CQE_F_MORE)) {
+				_uring_rearm(ss, s);
+			}
+			return -1;
+		}
+		_force_close(ss, s, l, result);
+		result->data = strerror(-res);
+		return SOCKET_ERROR;
+	}
+	if (res == 0) {
+		_force_close(ss, s, l, result);
+		return SOCKET_CLOSE;
+	}
+	if (s->type == SOCKET_TYPE_HALFCLOSE) {
+		// discard recv data
+		return -1;
+	}
+	// 同一个 socket 紧接着的完成事件合并成一个消息 和 epoll 一样一次最多上报 64K 不必每个 buffer 一个消息
+	struct uring * u = ss->uring;
+	uint64_t ud = URING_DATA(s->id, URING_OP_RECV);
+	int sz = res;
+	unsigned i, n = 0;
+	struct io_uring_cqe * next;
+	while ((next = su_cqe_next(u, n + 1)) != NULL && next->user_data == ud && next->res > 0
+		&& (next->flags & IORING_CQE_F_BUFFER) && sz + next->res + RECV_TAG_SIZE <= (1 << (RECV_CLASS_P + RECV_CLASS - 1))) {
+		sz += next->res;
+		++n;
+	}
+	int cls = _recv_class(sz + RECV_TAG_SIZE);
+	char * buffer = _recv_alloc(ss, cls, sz + RECV_TAG_SIZE);
+	memcpy(buffer, data, res);
+	int offset = res;
+	for (i=1;i<=n;i++) {
+		next = su_cqe_next(u, i);
+		int bid = (int)(next->flags >> IORING_CQE_BUFFER_SHIFT);
+		memcpy(buffer + offset, su_buffer(u, bid), next->res);
+		offset += next->res;
+		if (!(next->flags & IORING_CQE_F_MORE)) {
+			_uring_rearm(ss, s);
+		}
+		su_recycle(u, bid);
+	}
+	// 第一个完成事件由 _uring_poll 标记 这里标记合并进来的 n 个
+	for (i=0;i<n;i++) {
+		su_cqe_seen(u);
+	}
+	_recv_tag(buffer, sz, cls);
+	s->stat.read += sz;
+	s->stat.rmsg++;
+	s->stat.rtime = ss->time;
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = sz;
+	result->data = buffer;
+	return SOCKET_DATA;
+}
+
+// 处理一个完成事件 返回 -1 表示没有要上报的消息
+static int
+_uring_event(socket_server_t *ss, struct io_uring_cqe *cqe, socket_message_t *result)
+{
+	struct uring * u = ss->uring;
+	uint64_t ud = cqe->user_data;
+	int res = cqe->res;
+	unsigned flags = cqe->flags;
+	int op = (int)(ud & 0xff);
+	int id = (int)(ud >> 8);
+	int bid = -1;
+	const char * data = NULL;
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+		data = su_buffer(u, bid);
+	}
+	int type = -1;
+	struct socket * s = _get_socket(ss, id);
+	if (op != 0 && s->id == id && s->uring == op) {
+		struct socket_lock l;
+		socket_lock_init(s, &l);
+		if (op == URING_OP_ACCEPT) {
+			type = _uring_accept(ss, s, res, flags, result);
+		} else {
+			type = _uring_recv(ss, s, &l, res, flags, data, result);
+			if (type == SOCKET_CLOSE || type == SOCKET_ERROR) {
+				_clear_closed_event(ss, result, type);
+			}
+		}
+	} else if (op == URING_OP_ACCEPT && res >= 0) {
+		// 监听 socket 已经关闭
+		close(res);
+	}
+	if (bid >= 0) {
+		su_recycle(u, bid);
+	}
+	return type;
+}
+
+// 收割完成事件 cq 空了返回 -1
+static int
+_uring_poll(socket_server_t *ss, socket_message_t *result)
+{
+	struct uring * u = ss->uring;
+	for (;;) {
+		struct io_uring_cqe * cqe = su_cqe(u);
+		if (cqe == NULL) {
+			if (su_overflow(u))
+				continue;
+			ss->uring_check = 0;
+			// 处理完成事件时挂上的请求
+			su_submit(u);
+			return -1;
+		}
+		int type = _uring_event(ss, cqe, result);
+		su_cqe_seen(u);
+		if (type != -1)
+			return type;
+	}
+}
+#endif
+
 /*
  1、socket_server_poll监控有没有事件发生
  2、如果有事件发生，看是不是从管道过来的，如果是管道过来的就调用_ctrl_cmd去处理，如果是从 socket 描述符过来的，根据 s->type 进行相应的处理
@@ -1402,10 +3400,27 @@ socket_server_poll(socket_server_t *ss, socket_message_t * result, int * more)
 				ss->checkctrl = 0;
 			}
 		}
+#ifdef SOCKET_URING
+		if (ss->uring_check) {
+			int type = _uring_poll(ss, result);
+			if (type != -1)
+				return type;
+		}
+#endif
         //如果event_index等于event_n，说明已经处理完了
 		if (ss->event_index == ss->event_n) {
+#ifdef SOCKET_URING
+			if (ss->uring) {
+				su_submit(ss->uring);
+			}
+#endif
+			if (ss->coalesce_next == 1) {
+				// 没有定时器 睡眠之前写出有时间窗口的数据 可写事件马上就会返回
+				_coalesce_check(ss);
+			}
             //等待有事情发生， 返回的是需要处理的事件个数
 			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			ss->time = mtask_now_ms();
 			ss->checkctrl = 1;
 			if (more) {
 				*more = 0;
@@ -1422,9 +3437,31 @@ socket_server_poll(socket_server_t *ss, socket_message_t * result, int * more)
 		event_t *e = &ss->ev[ss->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
+#ifdef SOCKET_CTRL_QUEUE
+			// 清掉 eventfd 后重新检查队列，清除之前压入的请求不会再有通知
+			_clear_ctrl_event(ss);
+			ss->checkctrl = 1;
+#endif
 			// dispatch pipe message at beginning
 			continue;
 		}
+#ifdef SOCKET_URING
+		if (e->s == (void *)ss->uring) {
+			// ring fd 可读 有完成事件
+			ss->uring_check = 1;
+			continue;
+		}
+#endif
+#ifdef SOCKET_COALESCE_TIMER
+		if (e->s == (void *)&ss->coalesce_fd) {
+			// 合并写的窗口结束了
+			uint64_t expire;
+			while (read(ss->coalesce_fd, &expire, sizeof(expire)) < 0 && errno == EINTR) {
+			}
+			_coalesce_check(ss);
+			continue;
+		}
+#endif
         struct socket_lock l;
         socket_lock_init(s, &l);
 		switch (s->type) {
@@ -1447,19 +3484,22 @@ socket_server_poll(socket_server_t *ss, socket_message_t * result, int * more)
             case SOCKET_TYPE_INVALID:
                 fprintf(stderr, "socket-server: invalid socket\n");
                 break;
-            default:
+            default: {
+                // io_uring 暂停读以后 recv 已经结束 epoll 还会报告挂断和错误 要按 epoll 的方式读出来
+                // 不处理的话水平触发的事件每次 sp_wait 都会返回 socket 线程空转到恢复读为止
+                bool poll_read = !s->uring || s->uring_idle;
                 //有数据可读,在sp_wait中进行设置
-                if (e->read) {
+                if (e->read && poll_read) {
                     int type;
                     if (s->protocol == PROTOCOL_TCP) {
                         // 正常的话返回 SOCKET_DATA
                         type = _forward_message_tcp(ss, s, &l, result);
                     } else {
                         type = _forward_message_udp(ss, s, &l, result);
-                        if (type == SOCKET_UDP) {
+                        if (type == SOCKET_UDP || type == SOCKET_UDP_BATCH) {
                             // try read again
                             --ss->event_index;
-                            return SOCKET_UDP;
+                            return type;
                         }
                     }
                     if (e->write && type != SOCKET_CLOSE && type != SOCKET_ERROR) {
@@ -1478,7 +3518,7 @@ socket_server_poll(socket_server_t *ss, socket_message_t * result, int * more)
                         break;
                     return type;
                 }
-                if (e->error) {
+                if (e->error && poll_read) {
                     // close when error
                     int error;
                     socklen_t len = sizeof(error);  
@@ -1494,9 +3534,38 @@ socket_server_poll(socket_server_t *ss, socket_message_t * result, int * more)
                     return SOCKET_ERROR;
                 }
                 break;
+            }
+		}
+	}
+}
+#ifdef SOCKET_CTRL_QUEUE
+// 请求压入队列 队列原来为空时用 eventfd 唤醒 socket 线程
+static void
+_send_request(socket_server_t *ss, struct request_package *request, char type, int len)
+{
+	struct request_node * node = MALLOC(sizeof(*node) + len);
+	node->type = type;
+	node->len = len;
+	memcpy(node->buffer, &request->u, len);
+	struct request_node * head;
+	do {
+		head = ATOM_LOAD(&ss->ctrl_head);
+		node->next = head;
+	} while (!ATOM_CAS_POINTER(&ss->ctrl_head, head, node));
+	if (head == NULL) {
+		uint64_t v = 1;
+		while (write(ss->sendctrl_fd, &v, sizeof(v)) < 0) {
+			if (errno != EINTR) {
+				// EAGAIN 说明计数已经很大，socket 线程一定会被唤醒
+				if (errno != EAGAIN) {
+					fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
+				}
+				break;
+			}
 		}
 	}
 }
+#else
 // 管道中写 命令
 static void
 _send_request(socket_server_t *ss, struct request_package *request, char type, int len)
@@ -1516,6 +3585,7 @@ _send_request(socket_server_t *ss, struct request_package *request, char type, i
 		return;
 	}
 }
+#endif
 
 static int
 _open_request(socket_server_t *ss, struct request_package *req, uintptr_t opaque, const char *addr, int port)
@@ -1531,6 +3601,8 @@ _open_request(socket_server_t *ss, struct request_package *req, uintptr_t opaque
 	req->u.open.opaque = opaque;
 	req->u.open.id = id;
 	req->u.open.port = port;
+	req->u.open.resolved = 0;
+	req->u.open.status = 0;
 	memcpy(req->u.open.host, addr, len);
 	req->u.open.host[len] = '\0';
 
@@ -1541,6 +3613,7 @@ int
 socket_server_connect(socket_server_t *ss, uintptr_t opaque, const char * addr, int port) 
 {
 	struct request_package request;
+	ss = _alloc_shard(ss);
 	int len = _open_request(ss, &request, opaque, addr, port);
 	if (len < 0)
 		return -1;
@@ -1552,7 +3625,7 @@ static inline int
 can_direct_write(struct socket *s, int id)
 {
     return s->id == id && _nomore_send_data(s) && s->type == SOCKET_TYPE_CONNECTED
-                &&  s->udpconnecting == 0;
+                &&  s->udpconnecting == 0 && !_coalesce_enabled(s);
 }
 
 // return -1 when error, 0 when success
@@ -1560,8 +3633,9 @@ can_direct_write(struct socket *s, int id)
 int
 socket_server_send(socket_server_t *ss, int id, const void * buffer, int sz)
 {
-    struct socket * s = &ss->slot[HASH_ID(id)];
-    if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+    ss = _shard(ss, id);
+    struct socket * s = _get_socket(ss, id);
+    if (s == NULL || s->id != id || s->type == SOCKET_TYPE_INVALID) {
         _free_buffer(ss, buffer, sz);
         return -1;
     }
@@ -1583,9 +3657,14 @@ socket_server_send(socket_server_t *ss, int id, const void * buffer, int sz)
                 socklen_t sasz = udp_socket_address(s, s->p.udp_address, &sa);
                 n = sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
             }
+            s->stat.dwmsg++;
+            s->stat.dwcall++;
             if (n<0) {
                 // ignore error, let socket thread try again
                 n = 0;
+            } else {
+                s->stat.dwrite += n;
+                s->stat.dwtime = mtask_now_ms();
             }
             if (n == so.sz) {
                 // write done
@@ -1598,7 +3677,7 @@ socket_server_send(socket_server_t *ss, int id, const void * buffer, int sz)
             s->dw_size = sz;
             s->dw_offset = (int)n;
             
-            sp_write(ss->event_fd, s->fd, s, true);
+            _sp_write(ss, s, true);
             
             socket_unlock(&l);
             return 0;
@@ -1620,8 +3699,9 @@ socket_server_send(socket_server_t *ss, int id, const void * buffer, int sz)
 int
 socket_server_send_lowpriority(socket_server_t *ss, int id, const void * buffer, int sz)
 {
-    struct socket * s = &ss->slot[HASH_ID(id)];
-    if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+    ss = _shard(ss, id);
+    struct socket * s = _get_socket(ss, id);
+    if (s == NULL || s->id != id || s->type == SOCKET_TYPE_INVALID) {
         _free_buffer(ss, buffer, sz);
         return -1;
     }
@@ -1639,7 +3719,10 @@ void
 socket_server_exit(socket_server_t *ss)
 {
 	struct request_package request;
-	_send_request(ss, &request, 'X', 0);
+	int i;
+	for (i=0;i<ss->shard_n;i++) {
+		_send_request(ss->group[i], &request, 'X', 0);
+	}
 }
 //"K"
 void
@@ -1649,7 +3732,7 @@ socket_server_close(socket_server_t *ss, uintptr_t opaque, int id)
 	request.u.close.id = id;
 	request.u.close.shutdown = 0;
 	request.u.close.opaque = opaque;
-	_send_request(ss, &request, 'K', sizeof(request.u.close));
+	_send_request(_shard(ss, id), &request, 'K', sizeof(request.u.close));
 }
 //"K"
 void
@@ -1659,7 +3742,7 @@ socket_server_shutdown(socket_server_t *ss, uintptr_t opaque, int id)
     request.u.close.id = id;
     request.u.close.shutdown = 1;
     request.u.close.opaque = opaque;
-    _send_request(ss, &request, 'K', sizeof(request.u.close));
+    _send_request(_shard(ss, id), &request, 'K', sizeof(request.u.close));
 }
 
 
@@ -1667,7 +3750,7 @@ socket_server_shutdown(socket_server_t *ss, uintptr_t opaque, int id)
 // return -1 means failed
 // or return AF_INET or AF_INET6
 static int
-_do_bind(const char *host, int port, int protocol, int *family)
+_do_bind(const char *host, int port, int protocol, int *family, int reuseport)
 {
 	int fd;
 	int status;
@@ -1701,6 +3784,11 @@ _do_bind(const char *host, int port, int protocol, int *family)
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+		goto _failed;
+	}
+#endif
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0)
 		goto _failed;
@@ -1715,10 +3803,10 @@ _failed_fd:
 }
 
 static int
-_do_listen(const char * host, int port, int backlog)
+_do_listen(const char * host, int port, int backlog, int reuseport)
 {
 	int family = 0;
-	int listen_fd = _do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = _do_bind(host, port, IPPROTO_TCP, &family, reuseport);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -1729,6 +3817,43 @@ _do_listen(const char * host, int port, int backlog)
 	return listen_fd;
 }
 
+#ifdef SO_REUSEPORT
+// 每个分片 listen 一个 SO_REUSEPORT 的 fd，由内核分散新连接，各分片的线程各自 accept
+// 组成一个监听组 对上层只有第一个 socket 的 id
+static int
+_listen_group(socket_server_t *ss, uintptr_t opaque, const char * addr, int port, int backlog)
+{
+	int n = ss->shard_n;
+	int fd[MAX_SHARD];
+	int id[MAX_SHARD];
+	int i;
+	for (i=0;i<n;i++) {
+		fd[i] = _do_listen(addr, port, backlog, 1);
+		id[i] = fd[i] < 0 ? -1 : _reserve_id(ss->group[i]);
+		if (id[i] < 0) {
+			if (fd[i] >= 0) {
+				close(fd[i]);
+			}
+			while (--i >= 0) {
+				close(fd[i]);
+				_get_socket(ss->group[i], id[i])->type = SOCKET_TYPE_INVALID;
+			}
+			return -1;
+		}
+	}
+	struct request_package request;
+	for (i=0;i<n;i++) {
+		request.u.listen.opaque = opaque;
+		request.u.listen.id = id[i];
+		request.u.listen.fd = fd[i];
+		request.u.listen.group = id[0];
+		request.u.listen.next = i+1 < n ? id[i+1] : -1;
+		_send_request(ss->group[i], &request, 'L', sizeof(request.u.listen));
+	}
+	return id[0];
+}
+#endif
+
 /**
  socketdriver.listen发生的事情主要为: 
  1. 调用bind绑定端口 
@@ -1739,12 +3864,18 @@ _do_listen(const char * host, int port, int backlog)
 int 
 socket_server_listen(socket_server_t *ss, uintptr_t opaque, const char * addr, int port, int backlog) 
 {
-	int fd = _do_listen(addr, port, backlog);
+#ifdef SO_REUSEPORT
+	if (ss->reuseport && ss->shard_n > 1) {
+		return _listen_group(ss, opaque, addr, port, backlog);
+	}
+#endif
+	int fd = _do_listen(addr, port, backlog, 0);
 	if (fd < 0) {
 		return -1;
 	}
 	struct request_package request;
-    //为此socket描述符分配一个id给上层使用，为s->slot的一个下标，一个数组索引而已
+	ss = _alloc_shard(ss);
+    //为此socket描述符分配一个id给上层使用，低位是分片号和槽位下标，高位是槽位的复用代数
 	int id = _reserve_id(ss);
 	if (id < 0) {
 		close(fd);
@@ -1754,6 +3885,8 @@ socket_server_listen(socket_server_t *ss, uintptr_t opaque, const char * addr, i
 	request.u.listen.opaque = opaque;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
+	request.u.listen.group = id;
+	request.u.listen.next = -1;
 	_send_request(ss, &request, 'L', sizeof(request.u.listen));
 	return id;
 }
@@ -1762,6 +3895,7 @@ int
 socket_server_bind(socket_server_t *ss, uintptr_t opaque, int fd) 
 {
 	struct request_package request;
+	ss = _alloc_shard(ss);
 	int id = _reserve_id(ss);
 	if (id < 0)
 		return -1;
@@ -1778,7 +3912,41 @@ socket_server_start(socket_server_t *ss, uintptr_t opaque, int id)
 	struct request_package request;
 	request.u.start.id = id;
 	request.u.start.opaque = opaque;
-	_send_request(ss, &request, 'S', sizeof(request.u.start));
+	_send_request(_shard(ss, id), &request, 'S', sizeof(request.u.start));
+}
+// "Q"
+void
+socket_server_pause(socket_server_t *ss, int id)
+{
+	struct request_package request;
+	request.u.pause.id = id;
+	_send_request(_shard(ss, id), &request, 'Q', sizeof(request.u.pause));
+}
+// "R"
+void
+socket_server_resume(socket_server_t *ss, int id)
+{
+	struct request_package request;
+	request.u.pause.id = id;
+	_send_request(_shard(ss, id), &request, 'R', sizeof(request.u.pause));
+}
+// "W"
+void
+socket_server_coalesce(socket_server_t *ss, int id, int usec, int size)
+{
+	struct request_package request;
+	request.u.coalesce.id = id;
+	request.u.coalesce.usec = usec;
+	request.u.coalesce.size = size;
+	_send_request(_shard(ss, id), &request, 'W', sizeof(request.u.coalesce));
+}
+// "F"
+void
+socket_server_flush(socket_server_t *ss, int id)
+{
+	struct request_package request;
+	request.u.pause.id = id;
+	_send_request(_shard(ss, id), &request, 'F', sizeof(request.u.pause));
 }
 // "T"
 void
@@ -1788,13 +3956,16 @@ socket_server_nodelay(socket_server_t *ss, int id)
 	request.u.setopt.id = id;
 	request.u.setopt.what = TCP_NODELAY;
 	request.u.setopt.value = 1;
-	_send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	_send_request(_shard(ss, id), &request, 'T', sizeof(request.u.setopt));
 }
 
 void 
 socket_server_userobject(socket_server_t *ss, struct socket_object_interface *soi) 
 {
-	ss->soi = *soi;
+	int i;
+	for (i=0;i<ss->shard_n;i++) {
+		ss->group[i]->soi = *soi;
+	}
 }
 
 // UDP
@@ -1806,7 +3977,7 @@ socket_server_udp(socket_server_t *ss, uintptr_t opaque, const char * addr, int
 	int family;
 	if (port != 0 || addr != NULL) {
 		// bind
-		fd = _do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = _do_bind(addr, port, IPPROTO_UDP, &family, 0);
 		if (fd < 0) {
 			return -1;
 		}
@@ -1819,6 +3990,7 @@ socket_server_udp(socket_server_t *ss, uintptr_t opaque, const char * addr, int
 	}
 	sp_nonblocking(fd);
 
+	ss = _alloc_shard(ss);
 	int id = _reserve_id(ss);
 	if (id < 0) {
 		close(fd);
@@ -1837,8 +4009,9 @@ socket_server_udp(socket_server_t *ss, uintptr_t opaque, const char * addr, int
 int
 socket_server_udp_send(socket_server_t *ss, int id, const struct socket_udp_address *addr, const void *buffer, int sz)
 {
-    struct socket * s = &ss->slot[HASH_ID(id)];
-    if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+    ss = _shard(ss, id);
+    struct socket * s = _get_socket(ss, id);
+    if (s == NULL || s->id != id || s->type == SOCKET_TYPE_INVALID) {
         _free_buffer(ss, buffer, sz);
         return -1;
     }
@@ -1869,8 +4042,12 @@ socket_server_udp_send(socket_server_t *ss, int id, const struct socket_udp_addr
             union sockaddr_all sa;
             socklen_t sasz = udp_socket_address(s, udp_address, &sa);
             ssize_t n = sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
+            s->stat.dwcall++;
             if (n >= 0) {
                 // sendto succ
+                s->stat.dwmsg++;
+                s->stat.dwrite += n;
+                s->stat.dwtime = mtask_now_ms();
                 socket_unlock(&l);
                 so.free_func((void *)buffer);
                 return 0;
@@ -1894,8 +4071,9 @@ socket_server_udp_send(socket_server_t *ss, int id, const struct socket_udp_addr
 int
 socket_server_udp_connect(socket_server_t *ss, int id, const char * addr, int port) 
 {
-    struct socket * s = &ss->slot[HASH_ID(id)];
-    if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+    ss = _shard(ss, id);
+    struct socket * s = _get_socket(ss, id);
+    if (s == NULL || s->id != id || s->type == SOCKET_TYPE_INVALID) {
         return -1;
     }
     struct socket_lock l;
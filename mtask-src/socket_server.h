@@ -11,6 +11,7 @@
 #define SOCKET_EXIT         5 // exit
 #define SOCKET_UDP          6
 #define SOCKET_WARNING      7
+#define SOCKET_UDP_BATCH    8 // recvmmsg 收到的多个 udp 包
 
 struct socket_message_s {
 	int id;             // 应用层的socket fd
@@ -24,6 +25,72 @@ typedef struct socket_message_s socket_message_t;
 typedef struct socket_server_s socket_server_t;
 
 socket_server_t * socket_server_create();
+// n socket threads, each polls one shard (socket_server_shard) with socket_server_poll
+// socket id encodes its shard, so the other api can be called with any shard
+// reuseport: listen creates a SO_REUSEPORT fd in every shard to spread accepts
+// max: socket limit over all shards (0: 64K per shard), slots are allocated in pages as needed
+socket_server_t * socket_server_create_shard(int n, int reuseport, int max);
+
+int socket_server_shard_n(socket_server_t *);
+
+socket_server_t * socket_server_shard(socket_server_t *, int shard);
+// SOCKET_DATA blocks come from per shard size-class pools and keep a 4 byte tag (magic and class) after the data (data[ud]).
+// recycle returns a block to the pools (batched per thread), buffers without a valid tag are freed, FREE still works for the blocks
+void socket_server_recycle(socket_server_t *, void *buffer, int sz);
+// hand the blocks batched by the calling thread back now, workers call it before they park
+void socket_server_recycle_flush(socket_server_t *);
+// stat[0] tcp write syscalls, stat[1] tcp bytes written, summed over all shards
+void socket_server_stat(socket_server_t *, uint64_t stat[2]);
+
+// per socket counters, kept by the socket thread (reads, queued sends) and under the socket lock (writes)
+// without atomics, so another thread reads approximate values
+#define SOCKET_INFO_UNKNOWN 0
+#define SOCKET_INFO_LISTEN 1
+#define SOCKET_INFO_TCP 2
+#define SOCKET_INFO_UDP 3
+#define SOCKET_INFO_BIND 4
+#define SOCKET_INFO_CLOSING 5
+
+struct socket_info {
+	int id;
+	int type;
+	int reading;        // 0 when reading is paused
+	uintptr_t opaque;
+	uint64_t read;      // bytes
+	uint64_t write;
+	uint64_t rmsg;      // data messages reported
+	uint64_t wmsg;      // send requests (queued or written directly)
+	uint64_t rcall;     // syscalls (io_uring receives are not counted)
+	uint64_t wcall;
+	uint64_t rtime;     // last read/write, ms since start (mtask_now_ms)
+	uint64_t wtime;
+	int64_t wbuffer;    // bytes waiting in the write buffer
+	int64_t wb_max;     // write buffer high-water mark
+	char name[128];     // peer address (local address for listen sockets)
+	struct socket_info *next;
+};
+
+// list of all sockets over all shards, release it with socket_server_info_release
+struct socket_info * socket_server_info(socket_server_t *);
+void socket_server_info_release(struct socket_info *);
+
+#define SOCKET_NETSTAT_READ 0
+#define SOCKET_NETSTAT_WRITE 1
+#define SOCKET_NETSTAT_RMSG 2
+#define SOCKET_NETSTAT_WMSG 3
+#define SOCKET_NETSTAT_RCALL 4
+#define SOCKET_NETSTAT_WCALL 5
+#define SOCKET_NETSTAT_WBUFFER 6
+#define SOCKET_NETSTAT_N 7
+// sum the counters of the sockets owned by opaque, return the socket count
+int socket_server_netstat(socket_server_t *, uintptr_t opaque, uint64_t stat[SOCKET_NETSTAT_N]);
+// connect resolves host names in resolver threads and caches the address for ttl seconds (0: no cache)
+// server "ip[:port]" overrides the system dns server (glibc only), NULL uses the system config
+// call it before the first connect, return -1 when server is invalid or unsupported
+int socket_server_resolver(socket_server_t *, int ttl, const char *server);
+// receive with io_uring (multishot accept/recv, provided buffers) instead of epoll readiness + read
+// call it before creating any socket, return -1 and keep epoll when io_uring is unavailable
+int socket_server_uring(socket_server_t *);
 
 void socket_server_release(socket_server_t *);
 
@@ -51,6 +118,16 @@ int socket_server_bind(socket_server_t *, uintptr_t opaque, int fd);
 // for tcp
 void socket_server_nodelay(socket_server_t *, int id);
 
+// pause/resume reading a connected socket , unread data stays in the kernel buffer (tcp flow control)
+void socket_server_pause(socket_server_t *, int id);
+void socket_server_resume(socket_server_t *, int id);
+
+// tcp write coalescing: sends stay in the write buffer and go out together (writev) when the buffer
+// reaches size bytes, usec microseconds after the first one, or on socket_server_flush.
+// usec = 0 waits for size or flush only, usec = size = 0 turns it off. sends don't write directly in the caller thread
+void socket_server_coalesce(socket_server_t *, int id, int usec, int size);
+void socket_server_flush(socket_server_t *, int id);
+
 struct socket_udp_address;
 
 // create an udp socket handle, attach opaque with it . udp socket don't need call socket_server_start to recv message
@@ -64,6 +141,9 @@ int socket_server_udp_connect(socket_server_t *, int id, const char * addr, int
 int socket_server_udp_send(socket_server_t *, int id, const struct socket_udp_address *, const void *buffer, int sz);
 // extract the address of the message, socket_message_t * should be SOCKET_UDP
 const struct socket_udp_address * socket_server_udp_address(socket_server_t *, socket_message_t *, int *addrsz);
+// SOCKET_UDP_BATCH data is one receive block (recycle it with sz = ud) holding several packages,
+// returns the index-th package and its address (same format as socket_server_udp_address), NULL past the last one
+const char * socket_server_udp_batch(socket_server_t *, const char *buffer, int index, int *sz, const char **address, int *addrsz);
 
 struct socket_object_interface {
 	void * (*buffer)(void *);
@@ -0,0 +1,394 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+// io_uring 后端 (linux 6.0 以上): 监听 socket 用 multishot accept ，连接用 multishot recv 从 provided buffer ring 收数据
+// ring fd 注册在 epoll 里，socket 线程仍然阻塞在 epoll_wait ，ring fd 可读时收割完成事件
+// 不依赖 liburing ，直接使用系统调用；头文件太旧时不定义 SOCKET_URING ，只使用 epoll
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define SOCKET_URING
+#endif
+#endif
+#endif
+
+#ifdef SOCKET_URING
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define URING_ENTRIES           4096    // sq 的大小 cq 为它的两倍
+#define URING_BUFFER_N          4096    // provided buffer 的个数 必须是 2 的幂
+#define URING_BUFFER_SZ         2048    // 每个 provided buffer 的大小
+#define URING_BGID              0       // provided buffer 组号
+#define URING_PROBE             (~(uint64_t)0xff)   // 探测用的 user_data 低 8 位为 0 完成事件会被忽略
+
+// sq 满了又提交不了时 请求先挂在这里 按顺序在下次 su_submit 时放进 sq
+struct uring_defer {
+	struct uring_defer * next;
+	struct io_uring_sqe sqe;
+};
+
+struct uring {
+	int fd;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_entries;
+	unsigned * sq_flags;
+	unsigned * sq_array;
+	struct io_uring_sqe * sqes;
+	unsigned sq_local;          // 已经填写的 sqe 的 tail
+	unsigned sq_submit;         // 已经提交给内核的 tail
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+	void * sq_ptr;
+	size_t sq_sz;
+	void * cq_ptr;
+	size_t cq_sz;
+	size_t sqes_sz;
+	struct io_uring_buf_ring * br;  // provided buffer ring
+	size_t br_sz;
+	uint16_t br_tail;
+	char * buffer;              // URING_BUFFER_N 个 buffer
+	struct uring_defer * defer_head;
+	struct uring_defer * defer_tail;
+};
+
+static int
+_su_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline bool
+_su_full(struct uring *u)
+{
+	return u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= *u->sq_entries;
+}
+
+static inline struct io_uring_sqe *
+_su_slot(struct uring *u)
+{
+	unsigned index = u->sq_local & *u->sq_mask;
+	struct io_uring_sqe * sqe = &u->sqes[index];
+	u->sq_array[index] = index;
+	++u->sq_local;
+	return sqe;
+}
+
+// 提交已经填写的 sqe 推迟的请求先放进空出来的位置 不等待内核
+static void
+su_submit(struct uring *u)
+{
+	for (;;) {
+		while (u->defer_head && !_su_full(u)) {
+			struct uring_defer * d = u->defer_head;
+			memcpy(_su_slot(u), &d->sqe, sizeof(d->sqe));
+			u->defer_head = d->next;
+			if (u->defer_head == NULL)
+				u->defer_tail = NULL;
+			free(d);
+		}
+		if (u->sq_submit == u->sq_local)
+			return;
+		__atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+		int n = _su_enter(u->fd, u->sq_local - u->sq_submit, 0, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			// EAGAIN/EBUSY: 内核暂时处理不了 下次再提交
+			return;
+		}
+		u->sq_submit += n;
+	}
+}
+
+// 取一个空的 sqe sq 满了先提交 还是满的话(cq 溢出时内核返回 EBUSY)不阻塞等待
+// 请求挂进推迟链表 收割完成事件后的 su_submit 会放进 sq ，已经有推迟的请求时也挂在后面 保持请求的顺序
+static struct io_uring_sqe *
+su_sqe(struct uring *u)
+{
+	struct io_uring_sqe * sqe;
+	if (u->defer_head == NULL && _su_full(u))
+		su_submit(u);
+	if (u->defer_head == NULL && !_su_full(u)) {
+		sqe = _su_slot(u);
+	} else {
+		struct uring_defer * d = malloc(sizeof(*d));
+		if (d == NULL) {
+			fprintf(stderr, "socket-server: io_uring defer request out of memory.\n");
+			abort();
+		}
+		d->next = NULL;
+		if (u->defer_tail)
+			u->defer_tail->next = d;
+		else
+			u->defer_head = d;
+		u->defer_tail = d;
+		sqe = &d->sqe;
+	}
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static struct io_uring_cqe *
+su_cqe(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & *u->cq_mask];
+}
+
+// 第 n 个还没有处理的完成事件 0 就是 su_cqe 拿到的那个
+static struct io_uring_cqe *
+su_cqe_next(struct uring *u, unsigned n)
+{
+	unsigned head = *u->cq_head;
+	if (__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - head <= n)
+		return NULL;
+	return &u->cqes[(head + n) & *u->cq_mask];
+}
+
+static inline void
+su_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// cq 满的时候内核把完成事件暂存起来 需要 enter 一次才会放回 cq ，返回 true 表示放回了
+static bool
+su_overflow(struct uring *u)
+{
+	if (__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+		_su_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS);
+		return su_cqe(u) != NULL;
+	}
+	return false;
+}
+
+static inline char *
+su_buffer(struct uring *u, int bid)
+{
+	return u->buffer + (size_t)bid * URING_BUFFER_SZ;
+}
+
+// 把用完的 buffer 还给内核
+static void
+su_recycle(struct uring *u, int bid)
+{
+	struct io_uring_buf * buf = &u->br->bufs[u->br_tail & (URING_BUFFER_N - 1)];
+	buf->addr = (uint64_t)(uintptr_t)su_buffer(u, bid);
+	buf->len = URING_BUFFER_SZ;
+	buf->bid = (uint16_t)bid;
+	++u->br_tail;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void
+su_accept(struct uring *u, int fd, uint64_t ud)
+{
+	struct io_uring_sqe * sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = ud;
+}
+
+static void
+su_recv(struct uring *u, int fd, uint64_t ud)
+{
+	struct io_uring_sqe * sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = ud;
+}
+
+// 取消 user_data 为 ud 的请求 取消本身的完成事件 user_data 为 0
+static void
+su_cancel(struct uring *u, uint64_t ud)
+{
+	struct io_uring_sqe * sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ud;
+	sqe->user_data = 0;
+}
+
+// 用 io_uring 收数据的 socket 在 epoll 里只关注可写
+static inline void
+su_write(int efd, int sock, void *ud, bool enable)
+{
+	struct epoll_event ev;
+	ev.events = enable ? EPOLLOUT : 0;
+	ev.data.ptr = ud;
+	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
+}
+
+static void
+su_release(struct uring *u)
+{
+	while (u->defer_head) {
+		struct uring_defer * d = u->defer_head;
+		u->defer_head = d->next;
+		free(d);
+	}
+	if (u->br) {
+		munmap(u->br, u->br_sz);
+	}
+	free(u->buffer);
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_sz);
+	}
+	if (u->cq_ptr && u->cq_ptr != u->sq_ptr) {
+		munmap(u->cq_ptr, u->cq_sz);
+	}
+	if (u->sq_ptr) {
+		munmap(u->sq_ptr, u->sq_sz);
+	}
+	if (u->fd >= 0) {
+		close(u->fd);
+	}
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+// 检查内核是否支持 multishot recv (6.0): 在 socketpair 上收一个字节
+static int
+_su_probe(struct uring *u)
+{
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd))
+		return -1;
+	su_recv(u, fd[0], URING_PROBE);
+	su_submit(u);
+	int ok = -1;
+	if (write(fd[1], "x", 1) == 1) {
+		for (;;) {
+			struct io_uring_cqe * cqe = su_cqe(u);
+			if (cqe == NULL) {
+				if (_su_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+					break;
+				continue;
+			}
+			if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER)) {
+				su_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+				ok = 0;
+			}
+			su_cqe_seen(u);
+			break;
+		}
+	}
+	su_cancel(u, URING_PROBE);
+	su_submit(u);
+	close(fd[0]);
+	close(fd[1]);
+	return ok;
+}
+
+// 返回 0 成功 失败返回 -1 并且 errno 为原因
+static int
+su_init(struct uring *u)
+{
+	struct io_uring_params p;
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->fd < 0)
+		return -1;
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) {
+		u->sq_ptr = NULL;
+		goto _failed;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			u->cq_ptr = NULL;
+			goto _failed;
+		}
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto _failed;
+	}
+	char * sq = u->sq_ptr;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+	u->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_local = u->sq_submit = *u->sq_tail;
+	char * cq = u->cq_ptr;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// provided buffer ring (5.19)
+	u->br_sz = URING_BUFFER_N * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		goto _failed;
+	}
+	u->buffer = malloc((size_t)URING_BUFFER_N * URING_BUFFER_SZ);
+	if (u->buffer == NULL)
+		goto _failed;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+	reg.ring_entries = URING_BUFFER_N;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto _failed;
+	int i;
+	for (i=0;i<URING_BUFFER_N;i++) {
+		su_recycle(u, i);
+	}
+	if (_su_probe(u)) {
+		errno = EOPNOTSUPP;
+		goto _failed;
+	}
+	return 0;
+_failed: {
+		int err = errno;
+		su_release(u);
+		errno = err;
+		return -1;
+	}
+}
+
+#endif
+
+#endif
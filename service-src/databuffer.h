@@ -5,6 +5,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include "mtask_socket.h"
+
 #define MESSAGEPOOL 1023
 // gate 服务中应用层msg的缓冲区实现
 
@@ -58,7 +60,7 @@ _return_message(struct databuffer *db, struct messagepool *mp)
 	} else {
 		db->head = m->next;
 	}
-	mtask_free(m->buffer);
+	mtask_socket_recycle(m->buffer, m->size);
 	m->buffer = NULL;
 	m->size = 0;
 	m->next = mp->freelist;
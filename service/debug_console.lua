@@ -158,6 +158,8 @@ function COMMAND.help()
 		shrtbl = "Show shared short string table info",
 		ping = "ping address",
 		call = "call address ...",
+		sched = "Show per-worker scheduler counters (work_steal mode)",
+		netstat = "netstat [address] : network traffic per service, or per socket of a service",
 	}
 end
 
@@ -335,6 +337,66 @@ function COMMAND.shrtbl()
 	return { n = n, total = total, longest = longest, space = space }
 end
 
+function COMMAND.sched()
+	local tmp = {}
+	local id = 0
+	while true do
+		local loc = core.intcommand("SCHED", id .. " local")
+		if not loc then
+			break
+		end
+		tmp[string.format("worker%d", id)] = string.format("local:%d global:%d steal:%d fail:%d",
+			loc,
+			core.intcommand("SCHED", id .. " global"),
+			core.intcommand("SCHED", id .. " steal"),
+			core.intcommand("SCHED", id .. " fail"))
+		id = id + 1
+	end
+	return tmp
+end
+
+-- 不带参数时按服务汇总，带服务地址时列出这个服务的每个 socket
+function COMMAND.netstat(address)
+	local list = socket.netstat()
+	local now = mtask.nowms()
+	local function ago(t)
+		return t == 0 and "-" or string.format("%.1fs", (now - t) / 1000)
+	end
+	local tmp = {}
+	if address then
+		address = adjust_address(address)
+		for _, s in ipairs(list) do
+			if s.address == address then
+				tmp[string.format("%d", s.id)] = string.format(
+					"%s %s read:%d(%d/%d) write:%d(%d/%d) rtime:%s wtime:%s wbuffer:%d wbmax:%d%s",
+					s.type, s.peer or "-", s.read, s.rmsg, s.rcall, s.write, s.wmsg, s.wcall,
+					ago(s.rtime), ago(s.wtime), s.wbuffer, s.wbmax, s.reading and "" or " paused")
+			end
+		end
+		return tmp
+	end
+	local sum = {}
+	for _, s in ipairs(list) do
+		local v = sum[s.address]
+		if not v then
+			v = { socket = 0, read = 0, write = 0, rmsg = 0, wmsg = 0, rcall = 0, wcall = 0, wbuffer = 0, rtime = 0, wtime = 0 }
+			sum[s.address] = v
+		end
+		v.socket = v.socket + 1
+		for _, k in ipairs { "read", "write", "rmsg", "wmsg", "rcall", "wcall", "wbuffer" } do
+			v[k] = v[k] + s[k]
+		end
+		v.rtime = math.max(v.rtime, s.rtime)
+		v.wtime = math.max(v.wtime, s.wtime)
+	end
+	for addr, v in pairs(sum) do
+		tmp[mtask.address(addr)] = string.format(
+			"socket:%d read:%d(%d/%d) write:%d(%d/%d) rtime:%s wtime:%s wbuffer:%d",
+			v.socket, v.read, v.rmsg, v.rcall, v.write, v.wmsg, v.wcall, ago(v.rtime), ago(v.wtime), v.wbuffer)
+	end
+	return tmp
+end
+
 function COMMAND.ping(address)
 	address = adjust_address(address)
 	local ti = mtask.now()
@@ -0,0 +1,62 @@
+local mtask = require "mtask"
+
+-- 每个 RPC 都挂一个超时定时器的压测: 对比 请求完成后取消定时器 和 让定时器到期再忽略
+-- 用法: start = "testcanceltimeout" ，参数 请求次数(默认 100000) 超时时间(默认 100 即1秒)
+
+local mode, round, deadline = ...
+
+if mode == "server" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function()
+		mtask.ret(mtask.pack())
+	end)
+end)
+
+elseif mode == "client" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function(_, _, server, cancel)
+		local start = mtask.now()
+		for i = 1, round do
+			local done
+			local id = mtask.timeout(deadline, function()
+				if not done then
+					error "request timeout"
+				end
+			end)
+			mtask.call(server, "lua")
+			done = true
+			if cancel then
+				mtask.canceltimeout(id)
+			end
+		end
+		local ti = mtask.now() - start
+		-- 等所有没取消的定时器到期
+		mtask.sleep(deadline + 10)
+		mtask.ret(mtask.pack(ti, mtask.stat "message"))
+	end)
+end)
+
+else
+
+round, deadline = tonumber(mode) or 100000, tonumber(round) or 100
+
+mtask.start(function()
+	-- 取消的定时器的协程要回到协程池 下一个 fork 拿到的还是它
+	local co = mtask.fork(function() end)
+	mtask.yield()
+	mtask.canceltimeout(mtask.timeout(100, function() error "cancelled timeout called" end))
+	assert(mtask.fork(function() end) == co, "coroutine of cancelled timeout not recycled")
+	local server = mtask.newservice(SERVICE_NAME, "server")
+	for _, cancel in ipairs { false, true } do
+		local client = mtask.newservice(SERVICE_NAME, "client", round, deadline)
+		local ti, message = mtask.call(client, "lua", server, cancel)
+		ti = math.max(ti, 1)
+		print(string.format("%s round=%d time=%.2fs rate=%d rpc/s client messages=%d",
+			cancel and "cancel" or "expire", round, ti / 100, math.floor(round / ti * 100), message))
+	end
+	mtask.exit()
+end)
+
+end
@@ -0,0 +1,115 @@
+local mtask = require "mtask"
+local c = require "mtask.core"
+
+-- 消息队列压测: 多个生产者服务同时向同一个接收者发送空消息 (fan-in)
+-- 分别在配置 mq_lockfree = false / true 下运行，对比两种服务消息队列的吞吐
+-- 之后一个服务先给自己塞满消息再一口气处理完 (drain) ，只量出队和分发每条消息的开销
+-- 用法: start = "testmq" ，或 mtask.newservice("testmq", producer, count)
+
+local mode, count = ...
+
+if mode == "receiver" then
+
+mtask.start(function()
+	local n = 0
+	local total, reporter, start
+	mtask.register_protocol {
+		name = "text",
+		id = mtask.PTYPE_TEXT,
+		unpack = function() end,
+		dispatch = function()
+			if n == 0 then
+				start = mtask.now()
+			end
+			n = n + 1
+			if n == total then
+				mtask.send(reporter, "lua", "receiver", mtask.now() - start)
+			end
+		end
+	}
+	mtask.dispatch("lua", function(_,_, t, r)
+		total, reporter = t, r
+		mtask.ret(mtask.pack())
+	end)
+end)
+
+elseif mode == "drain" then
+
+mtask.start(function()
+	local n, total = 0
+	local co
+	mtask.register_protocol {
+		name = "text",
+		id = mtask.PTYPE_TEXT,
+		unpack = function() end,
+		dispatch = function()
+			n = n + 1
+			if n == total then
+				mtask.wakeup(co)
+			end
+		end
+	}
+	mtask.dispatch("lua", function(_,_, count)
+		n, total = 0, count
+		local self = mtask.self()
+		for i = 1, count do
+			c.send(self, mtask.PTYPE_TEXT, 0, "")
+		end
+		-- 这些消息都在队列里 等这条消息处理完让出之后才开始出队
+		local start = mtask.hpc()
+		co = coroutine.running()
+		mtask.wait(co)
+		mtask.ret(mtask.pack(mtask.hpc() - start))
+	end)
+end)
+
+elseif mode == "producer" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function(_, source, receiver, n)
+		local start = mtask.now()
+		for i = 1, n do
+			c.send(receiver, mtask.PTYPE_TEXT, 0, "")
+		end
+		mtask.send(source, "lua", "producer", mtask.now() - start)
+	end)
+end)
+
+else
+
+mtask.start(function()
+	local producer = tonumber(mode) or 8
+	count = tonumber(count) or 1000000
+	local total = producer * count
+	local receiver = mtask.newservice(SERVICE_NAME, "receiver")
+	local ps = {}
+	for i = 1, producer do
+		ps[i] = mtask.newservice(SERVICE_NAME, "producer")
+	end
+	local push_time = 0
+	local finished = 0
+	mtask.dispatch("lua", function(_,_, who, ti)
+		ti = math.max(ti, 1)
+		if who == "producer" then
+			push_time = math.max(push_time, ti)
+			finished = finished + 1
+			if finished == producer then
+				print(string.format("mq_lockfree=%s producer=%d message=%d push %.2fs (%d/s)",
+					mtask.getenv "mq_lockfree", producer, total, push_time / 100, math.floor(total / push_time * 100)))
+			end
+		else
+			print(string.format("mq_lockfree=%s producer=%d message=%d dispatch %.2fs (%d/s)",
+				mtask.getenv "mq_lockfree", producer, total, ti / 100, math.floor(total / ti * 100)))
+			local drain = mtask.newservice(SERVICE_NAME, "drain")
+			local ns = mtask.call(drain, "lua", count)
+			print(string.format("mq_lockfree=%s drain message=%d %.2fs (%dns/message)",
+				mtask.getenv "mq_lockfree", count, ns / 1e9, ns // count))
+		end
+	end)
+	mtask.call(receiver, "lua", total, mtask.self())
+	for i = 1, producer do
+		mtask.send(ps[i], "lua", receiver, count)
+	end
+end)
+
+end
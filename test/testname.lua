@@ -0,0 +1,72 @@
+local mtask = require "mtask"
+require "mtask.manager"	-- import mtask.name
+
+-- 全局名字表压测: 注册/查询大量本地名字，再让持有名字的服务退出，检查名字是否随 retire 一起删除
+-- 用法: start = "testname" ，参数 服务数(默认 100) 每个服务的名字数(默认 1000)
+
+local mode, count = ...
+
+if mode == "holder" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function(_, _, cmd, prefix)
+		if cmd == "name" then
+			local self = mtask.self()
+			for i = 1, count do
+				mtask.name(string.format(".%s_%d", prefix, i), self)
+			end
+			mtask.ret(mtask.pack())
+		else
+			mtask.exit()
+		end
+	end)
+end)
+
+else
+
+local service_n = tonumber(mode) or 100
+local name_n = tonumber(count) or 1000
+
+local function stat()
+	return string.format("count=%d slot=%d lookup=%d probe=%d",
+		mtask.stat "namecount", mtask.stat "nameslot", mtask.stat "namelookup", mtask.stat "nameprobe")
+end
+
+mtask.start(function()
+	local base = mtask.stat "namecount"
+	local holder = {}
+	for i = 1, service_n do
+		holder[i] = mtask.newservice(SERVICE_NAME, "holder", name_n)
+	end
+
+	local start = mtask.now()
+	for i = 1, service_n do
+		mtask.call(holder[i], "lua", "name", "room" .. i)
+	end
+	local total = service_n * name_n
+	print(string.format("register %d names time=%.2fs %s", total, (mtask.now() - start) / 100, stat()))
+	assert(mtask.stat "namecount" == base + total)
+
+	start = mtask.now()
+	for i = 1, service_n do
+		local prefix = ".room" .. i .. "_"
+		for j = 1, name_n do
+			assert(mtask.localname(prefix .. j) == holder[i])
+		end
+	end
+	assert(mtask.localname ".room0_0" == nil)
+	print(string.format("query %d names time=%.2fs %s", total, (mtask.now() - start) / 100, stat()))
+
+	start = mtask.now()
+	for i = 1, service_n do
+		mtask.send(holder[i], "lua", "exit")
+	end
+	while mtask.stat "namecount" ~= base do
+		mtask.sleep(1)
+	end
+	print(string.format("retire %d services time=%.2fs %s", service_n, (mtask.now() - start) / 100, stat()))
+	assert(mtask.localname ".room1_1" == nil)
+	mtask.exit()
+end)
+
+end
@@ -0,0 +1,91 @@
+local mtask = require "mtask"
+local core = require "mtask.core"
+local socket = require "mtask.socket"
+
+-- 网络流量统计测试: 回显服务和客户端在不同的服务里，收发已知字节数后检查每个 socket 和每个服务的计数
+-- 用法: start = "testnetstat" ，参数 连接数(默认 4) 每个连接回显的次数(默认 100)
+
+local mode, round = ...
+local PORT = 8060
+local LINE = "hello netstat\n"
+
+if mode == "server" then
+
+mtask.start(function()
+	local listen = socket.listen("127.0.0.1", PORT)
+	socket.start(listen, function(id)
+		socket.start(id)
+		mtask.fork(function()
+			while true do
+				local line = socket.readline(id)
+				if not line then
+					return
+				end
+				socket.write(id, line .. "\n")
+			end
+		end)
+	end)
+	mtask.dispatch("lua", function()
+		mtask.ret()
+	end)
+end)
+
+else
+
+local conn_n = tonumber(mode) or 4
+round = tonumber(round) or 100
+
+local function netstat(address, what)
+	return core.intcommand("NETSTAT", mtask.address(address) .. " " .. what)
+end
+
+mtask.start(function()
+	local server = mtask.newservice(SERVICE_NAME, "server")
+	mtask.call(server, "lua")
+	local conn = {}
+	for i = 1, conn_n do
+		conn[i] = assert(socket.open("127.0.0.1", PORT))
+	end
+	for _, id in ipairs(conn) do
+		for i = 1, round do
+			socket.write(id, LINE)
+			assert(socket.readline(id) == LINE:sub(1, -2))
+		end
+	end
+	-- 回显服务的计数在写出之后才加，等一下再看
+	mtask.sleep(1)
+	local bytes = round * #LINE
+	local self = mtask.self()
+	local mine = {}
+	for _, s in ipairs(socket.netstat()) do
+		if s.address == self and s.type == "TCP" then
+			mine[s.id] = s
+		end
+	end
+	for _, id in ipairs(conn) do
+		local s = assert(mine[id], "socket missing in netstat")
+		assert(s.write == bytes and s.read == bytes, "socket bytes mismatch")
+		assert(s.wmsg == round and s.rmsg >= 1 and s.rmsg <= round, "socket message count mismatch")
+		-- io_uring 收数据不计读的系统调用
+		assert(s.wcall >= 1 and (s.rcall >= 1 or mtask.getenv "socket_backend" == "uring") and s.rtime > 0 and s.wtime > 0)
+		assert(s.peer == "127.0.0.1:" .. PORT, s.peer)
+		print(string.format("socket %d read=%d(%d/%d) write=%d(%d/%d) wbmax=%d",
+			id, s.read, s.rmsg, s.rcall, s.write, s.wmsg, s.wcall, s.wbmax))
+	end
+	assert(netstat(self, "socket") == conn_n)
+	assert(netstat(self, "read") == conn_n * bytes and netstat(self, "write") == conn_n * bytes)
+	assert(netstat(self, "wmsg") == conn_n * round)
+	-- 回显服务还有一个监听 socket
+	assert(netstat(server, "socket") == conn_n + 1)
+	assert(netstat(server, "read") == conn_n * bytes and netstat(server, "write") == conn_n * bytes)
+	print(string.format("service %s sockets=%d read=%d write=%d rcall=%d wcall=%d",
+		mtask.address(server), netstat(server, "socket"), netstat(server, "read"), netstat(server, "write"),
+		netstat(server, "rcall"), netstat(server, "wcall")))
+	for _, id in ipairs(conn) do
+		socket.close(id)
+	end
+	print("netstat test ok")
+	mtask.exit()
+end)
+
+end
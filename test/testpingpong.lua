@@ -0,0 +1,66 @@
+local mtask = require "mtask"
+local c = require "mtask.core"
+
+-- 两个 Lua 服务之间的 ping-pong 压测 消息为 size 字节的文本(每次发送都会拷贝一次)
+-- 用法: start = "testpingpong" ，参数 往返次数(默认 1000000) 消息大小(默认 32)
+
+local mode, round, size = ...
+
+if mode == "pong" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function()
+		mtask.ret(mtask.pack())
+	end)
+	mtask.register_protocol {
+		name = "text",
+		id = mtask.PTYPE_TEXT,
+		unpack = mtask.tostring,
+		dispatch = function(_, source, msg)
+			c.send(source, mtask.PTYPE_TEXT, 0, msg)
+		end
+	}
+end)
+
+elseif mode == "ping" then
+
+mtask.start(function()
+	local n, target, reporter, start
+	mtask.register_protocol {
+		name = "text",
+		id = mtask.PTYPE_TEXT,
+		unpack = mtask.tostring,
+		dispatch = function(_, _, msg)
+			n = n - 1
+			if n == 0 then
+				mtask.send(reporter, "lua", mtask.now() - start)
+			else
+				c.send(target, mtask.PTYPE_TEXT, 0, msg)
+			end
+		end
+	}
+	mtask.dispatch("lua", function(_, source, t, r, sz)
+		target, n, reporter = t, r, source
+		start = mtask.now()
+		c.send(target, mtask.PTYPE_TEXT, 0, string.rep("x", sz))
+	end)
+end)
+
+else
+
+-- 主服务的参数为 往返次数 消息大小
+round, size = tonumber(mode) or 1000000, tonumber(round) or 32
+
+mtask.start(function()
+	mtask.dispatch("lua", function(_,_, ti)
+		ti = math.max(ti, 1)
+		print(string.format("ping-pong round=%d size=%d time=%.2fs rate=%d msg/s",
+			round, size, ti / 100, math.floor(round * 2 / ti * 100)))
+	end)
+	local pong = mtask.newservice(SERVICE_NAME, "pong")
+	local ping = mtask.newservice(SERVICE_NAME, "ping")
+	mtask.call(pong, "lua")
+	mtask.send(ping, "lua", pong, round, size)
+end)
+
+end
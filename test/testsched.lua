@@ -0,0 +1,97 @@
+local mtask = require "mtask"
+local c = require "mtask.core"
+
+-- 调度压测: 多组服务两两互发消息(ping-pong)，让所有工作线程都忙起来
+-- 配置 work_steal = true 时打印每个工作线程的调度计数(本地弹出/全局弹出/窃取/窃取失败)
+-- 用法: start = "testsched" ，参数 服务对数(默认 64) 每对往返次数(默认 10000)
+
+local mode, round = ...
+
+if mode == "pong" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function()
+		mtask.ret(mtask.pack())
+	end)
+	mtask.register_protocol {
+		name = "text",
+		id = mtask.PTYPE_TEXT,
+		unpack = function() end,
+		dispatch = function(_, source)
+			c.send(source, mtask.PTYPE_TEXT, 0, "")
+		end
+	}
+end)
+
+elseif mode == "ping" then
+
+mtask.start(function()
+	local n, target, reporter, start
+	mtask.register_protocol {
+		name = "text",
+		id = mtask.PTYPE_TEXT,
+		unpack = function() end,
+		dispatch = function()
+			n = n - 1
+			if n == 0 then
+				mtask.send(reporter, "lua", mtask.now() - start)
+			else
+				c.send(target, mtask.PTYPE_TEXT, 0, "")
+			end
+		end
+	}
+	mtask.dispatch("lua", function(_, source, t, round)
+		target, n, reporter = t, round, source
+		start = mtask.now()
+		c.send(target, mtask.PTYPE_TEXT, 0, "")
+	end)
+end)
+
+else
+
+local function sched_stat()
+	local id = 0
+	while true do
+		local loc = c.intcommand("SCHED", id .. " local")
+		if not loc then
+			break
+		end
+		print(string.format("worker %d: local %d global %d steal %d fail %d", id, loc,
+			c.intcommand("SCHED", id .. " global"),
+			c.intcommand("SCHED", id .. " steal"),
+			c.intcommand("SCHED", id .. " fail")))
+		id = id + 1
+	end
+	if id == 0 then
+		print("work_steal is off")
+	end
+end
+
+mtask.start(function()
+	local pair = tonumber(mode) or 64
+	round = tonumber(round) or 10000
+	local finished = 0
+	local max_time = 0
+	mtask.dispatch("lua", function(_,_, ti)
+		finished = finished + 1
+		max_time = math.max(max_time, ti, 1)
+		if finished == pair then
+			local total = pair * round * 2
+			print(string.format("work_steal=%s thread=%s pair=%d message=%d time=%.2fs rate=%d/s",
+				mtask.getenv "work_steal", mtask.getenv "thread", pair, total, max_time / 100, math.floor(total / max_time * 100)))
+			sched_stat()
+		end
+	end)
+	local ping = {}
+	for i = 1, pair do
+		local pong = mtask.newservice(SERVICE_NAME, "pong")
+		ping[i] = mtask.newservice(SERVICE_NAME, "ping")
+		mtask.call(pong, "lua")
+		ping[i] = { ping[i], pong }
+	end
+	for i = 1, pair do
+		mtask.send(ping[i][1], "lua", ping[i][2], round)
+	end
+end)
+
+end
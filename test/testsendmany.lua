@@ -0,0 +1,71 @@
+local mtask = require "mtask"
+
+-- 广播压测: 同一条消息发给很多服务 对比逐个 mtask.send 和 mtask.sendmany(打包一次 共享同一份数据)
+-- 用法: start = "testsendmany" ，参数 接收服务数(默认 1000) 广播次数(默认 100) 消息大小(默认 1024)
+
+local mode, n, size = ...
+
+if mode == "receiver" then
+
+mtask.start(function()
+	local count, total, reporter
+	mtask.dispatch("lua", function(_, source, cmd, data)
+		if cmd == "start" then
+			count, total, reporter = 0, data, source
+			mtask.ret(mtask.pack())
+		else
+			count = count + 1
+			if count == total then
+				mtask.send(reporter, "lua", "done")
+			end
+		end
+	end)
+end)
+
+else
+
+local receiver_n = tonumber(mode) or 1000
+local round = tonumber(n) or 100
+size = tonumber(size) or 1024
+
+mtask.start(function()
+	local receivers = {}
+	for i = 1, receiver_n do
+		receivers[i] = mtask.newservice(SERVICE_NAME, "receiver")
+	end
+	local data = string.rep("x", size)
+	local done = 0
+	local co
+	mtask.dispatch("lua", function()
+		done = done + 1
+		if done == receiver_n then
+			mtask.wakeup(co)
+		end
+	end)
+	local function bench(name, broadcast)
+		for i = 1, receiver_n do
+			mtask.call(receivers[i], "lua", "start", round)
+		end
+		done = 0
+		co = coroutine.running()
+		local start = mtask.now()
+		for i = 1, round do
+			broadcast(data)
+		end
+		mtask.wait(co)
+		local ti = math.max(mtask.now() - start, 1)
+		print(string.format("%s receiver=%d round=%d size=%d time=%.2fs rate=%d msg/s",
+			name, receiver_n, round, size, ti / 100, math.floor(receiver_n * round / ti * 100)))
+	end
+	bench("send", function(data)
+		for i = 1, receiver_n do
+			mtask.send(receivers[i], "lua", "data", data)
+		end
+	end)
+	bench("sendmany", function(data)
+		assert(mtask.sendmany(receivers, "lua", "data", data) == receiver_n)
+	end)
+	mtask.exit()
+end)
+
+end
@@ -0,0 +1,108 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+
+-- socket 后端压测: 大量连接同时做回显，比较 socket_backend = "epoll" 和 "uring" 的吞吐
+-- 用法: start = "testsocketbackend" ，参数 连接数(默认 10000) 每个连接的往返次数(默认 100)
+-- 连接的两端都在本进程里，需要 ulimit -n 大于连接数的两倍；5 万连接时 socket_thread 至少为 2
+
+local mode, round = ...
+local PORT = 8010
+local PORT_N = 4	-- 连接分散到多个端口，避免连同一个地址时本地端口不够用
+local CLIENT_N = 8	-- 发起连接的服务数
+
+if mode == "server" then
+
+mtask.start(function()
+	for i = 0, PORT_N - 1 do
+		local listen = socket.listen("127.0.0.1", PORT + i, 4096)
+		socket.start(listen, function(id)
+			socket.start(id)
+			mtask.fork(function()
+				while true do
+					local data = socket.read(id)
+					if not data then
+						return
+					end
+					socket.write(id, data)
+				end
+			end)
+		end)
+	end
+	mtask.dispatch("lua", function()
+		mtask.ret()
+	end)
+end)
+
+elseif mode == "client" then
+
+mtask.start(function()
+	local conn = {}
+	mtask.dispatch("lua", function(_, _, cmd, n)
+		if cmd == "open" then
+			for i = 1, n do
+				conn[i] = assert(socket.open("127.0.0.1", PORT + i % PORT_N))
+			end
+			mtask.ret()
+			return
+		end
+		local round = n
+		local co = coroutine.running()
+		local done = 0
+		for _, id in ipairs(conn) do
+			mtask.fork(function()
+				for i = 1, round do
+					socket.write(id, "ping\n")
+					assert(socket.readline(id) == "ping")
+				end
+				done = done + 1
+				if done == #conn then
+					mtask.wakeup(co)
+				end
+			end)
+		end
+		mtask.wait()
+		for _, id in ipairs(conn) do
+			socket.close(id)
+		end
+		mtask.ret()
+	end)
+end)
+
+else
+
+local conn_n = tonumber(mode) or 10000
+round = tonumber(round) or 100
+
+mtask.start(function()
+	local server = mtask.newservice(SERVICE_NAME, "server")
+	mtask.call(server, "lua")
+	local client = {}
+	local t = mtask.hpc()
+	for i = 1, CLIENT_N do
+		client[i] = mtask.newservice(SERVICE_NAME, "client")
+		local n = conn_n // CLIENT_N + (i <= conn_n % CLIENT_N and 1 or 0)
+		mtask.call(client[i], "lua", "open", n)
+	end
+	local connect = (mtask.hpc() - t) / 1000000000
+
+	t = mtask.hpc()
+	local co = coroutine.running()
+	local done = 0
+	for i = 1, CLIENT_N do
+		mtask.fork(function()
+			mtask.call(client[i], "lua", "run", round)
+			done = done + 1
+			if done == CLIENT_N then
+				mtask.wakeup(co)
+			end
+		end)
+	end
+	mtask.wait()
+	local ti = (mtask.hpc() - t) / 1000000000
+	local n = conn_n * round
+	print(string.format("backend=%s connections=%d connect=%.2fs round trips=%d time=%.2fs rate=%d/s",
+		mtask.getenv "socket_backend", conn_n, connect, n, ti, math.floor(n / ti)))
+	mtask.exit()
+end)
+
+end
@@ -0,0 +1,92 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+local driver = require "mtask.socketdriver"
+
+-- 合并写测试: 打开 nodelay 的连接每个 tick 发一批小包，接收端检查数据并统计包的延迟
+-- 比较不合并、按时间窗口合并、按字节数合并加上每个 tick 手动 flush 时发送端 socket 的写系统调用次数
+-- 用法: start = "testsocketcoalesce" ，参数 tick 数(默认 200) 每个 tick 的包数(默认 50) 时间窗口微秒(默认 1000)
+
+local round, batch, usec = ...
+round = tonumber(round) or 200
+batch = tonumber(batch) or 50
+usec = tonumber(usec) or 1000
+
+local PORT = 8070
+local PACKET = 32	-- 包头 8 字节是发出时的 hpc ，4 字节是序号
+
+local function wcall(id)
+	for _, s in ipairs(socket.netstat()) do
+		if s.id == id then
+			return s.wcall
+		end
+	end
+end
+
+-- 返回 写调用次数 平均延迟(微秒) 最大延迟(微秒)
+local function run(coalesce, flush)
+	local co = coroutine.running()
+	local latency, max_latency = 0, 0
+	local waiting, done
+	local peer
+	local listen = socket.listen("127.0.0.1", PORT)
+	socket.start(listen, function(id)
+		socket.close(listen)
+		socket.start(id)
+		peer = id
+		mtask.fork(function()
+			for i = 1, round * batch do
+				local data = assert(socket.read(id, PACKET), "lost data")
+				local t, seq = string.unpack("<I8I4", data)
+				assert(seq == i, "out of order")
+				local ti = (mtask.hpc() - t) // 1000
+				latency = latency + ti
+				max_latency = math.max(max_latency, ti)
+			end
+			done = true
+			if waiting then
+				mtask.wakeup(co)
+			end
+		end)
+	end)
+	local c = assert(socket.open("127.0.0.1", PORT))
+	driver.nodelay(c)
+	if coalesce then
+		coalesce(c)
+	end
+	local pad = string.rep("x", PACKET - 12)
+	local seq = 0
+	for i = 1, round do
+		for j = 1, batch do
+			seq = seq + 1
+			socket.write(c, string.pack("<I8I4", mtask.hpc(), seq) .. pad)
+		end
+		if flush then
+			socket.flush(c)
+		end
+		mtask.sleep(1)
+	end
+	if not done then
+		waiting = true
+		mtask.wait()
+	end
+	-- 写的计数在写出之后才加，等一下再看
+	mtask.sleep(1)
+	local n = wcall(c)
+	socket.close(c)
+	socket.close(peer)
+	return n, latency // (round * batch), max_latency
+end
+
+mtask.start(function()
+	local off, avg, max = run()
+	print(string.format("coalesce off: packets=%d wcall=%d latency avg=%dus max=%dus", round * batch, off, avg, max))
+	local window, avg, max = run(function(id) socket.coalesce(id, usec) end)
+	print(string.format("coalesce %dus: packets=%d wcall=%d latency avg=%dus max=%dus", usec, round * batch, window, avg, max))
+	local flush, avg, max = run(function(id) socket.coalesce(id, 0, 64 * 1024) end, true)
+	print(string.format("coalesce 64K + flush: packets=%d wcall=%d latency avg=%dus max=%dus", round * batch, flush, avg, max))
+	assert(window < off and flush < off, "writes not coalesced")
+	-- 每个 tick 的包 flush 时一起写出
+	assert(flush <= round * 2, "flush not batched")
+	print("socket coalesce test ok")
+	mtask.exit()
+end)
@@ -0,0 +1,69 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+
+-- socket 控制命令压测: socket.lwrite 每次调用都会向 socket 线程发送一个控制命令
+-- 多个服务同时发送小包，统计控制命令的吞吐
+-- 用法: start = "testsocketctrl" ，参数 发送服务数(默认 8) 每个服务发送的包数(默认 100000)
+
+local mode, count = ...
+local PORT = 8002
+local PACKAGE = string.rep("x", 16)
+
+if mode == "sender" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function()
+		local id = assert(socket.open("127.0.0.1", PORT))
+		for i = 1, tonumber(count) do
+			socket.lwrite(id, PACKAGE)
+			if i % 1000 == 0 then
+				-- 让出给其它服务，模拟广播节点中多个服务交替发送
+				mtask.yield()
+			end
+		end
+		mtask.ret(mtask.pack(id))
+	end)
+end)
+
+else
+
+local sender_n = tonumber(mode) or 8
+local package_n = tonumber(count) or 100000
+
+mtask.start(function()
+	local total = sender_n * package_n * #PACKAGE
+	local recv = 0
+	local co = coroutine.running()
+	local listen = socket.listen("127.0.0.1", PORT)
+	socket.start(listen, function(id)
+		socket.start(id)
+		mtask.fork(function()
+			while true do
+				local data = socket.read(id)
+				if not data then
+					return
+				end
+				recv = recv + #data
+				if recv == total then
+					mtask.wakeup(co)
+				end
+			end
+		end)
+	end)
+	local sender = {}
+	for i = 1, sender_n do
+		sender[i] = mtask.newservice(SERVICE_NAME, "sender", package_n)
+	end
+	local start = mtask.hpc()
+	for i = 1, sender_n do
+		mtask.fork(mtask.call, sender[i], "lua")
+	end
+	mtask.wait()
+	local ti = (mtask.hpc() - start) / 1000000000
+	local n = sender_n * package_n
+	print(string.format("senders=%d requests=%d time=%.2fs rate=%d req/s", sender_n, n, ti, math.floor(n / ti)))
+	socket.close(listen)
+	mtask.exit()
+end)
+
+end
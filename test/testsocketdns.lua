@@ -0,0 +1,172 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+local driver = require "mtask.socketdriver"
+
+-- connect 域名解析测试: 本地起一个会延迟应答的 dns 服务器，socket.open 用域名连接
+-- 解析期间其它连接的收发不能停顿，再次连接同一个域名走缓存，不再查询 dns 服务器
+-- 域名有多个地址时全部缓存，connect 按 getaddrinfo 排好的顺序依次尝试，连不上的地址(组播)不影响连接
+-- 解析还没完成时往这个 socket 写数据或者关掉它 数据丢掉 不影响之后的连接
+-- 用法: start = "testsocketdns" ，配置 dns_server = "127.0.0.1:5354"
+
+local mode = ...
+local DNS_PORT = 5354
+local PORT = 8005
+local DELAY = 100	-- dns 服务器延迟 1 秒应答
+
+if mode == "dns" then
+
+-- 只回答 A 记录，域名以 fail. 开头时回答 NXDOMAIN ，以 multi. 开头时多回答一个连不上的组播地址
+local function answer(req)
+	local tid = string.unpack(">H", req)
+	local pos = 13
+	local name = {}
+	while true do
+		local label
+		label, pos = string.unpack("s1", req, pos)
+		if label == "" then
+			break
+		end
+		name[#name+1] = label
+	end
+	local qtype = string.unpack(">H", req, pos)
+	local question = req:sub(13, pos + 3)
+	if name[1] == "fail" then
+		return string.pack(">HHHHHH", tid, 0x8183, 1, 0, 0, 0) .. question
+	end
+	if qtype ~= 1 then
+		return string.pack(">HHHHHH", tid, 0x8180, 1, 0, 0, 0) .. question
+	end
+	local record = string.pack(">HHHI4s2", 0xc00c, 1, 1, 30, "\127\0\0\1")
+	if name[1] == "multi" then
+		return string.pack(">HHHHHH", tid, 0x8180, 1, 2, 0, 0) .. question ..
+			string.pack(">HHHI4s2", 0xc00c, 1, 1, 30, "\224\0\0\1") .. record
+	end
+	return string.pack(">HHHHHH", tid, 0x8180, 1, 1, 0, 0) .. question .. record
+end
+
+mtask.start(function()
+	local query = 0
+	local udp
+	udp = socket.udp(function(str, from)
+		query = query + 1
+		mtask.fork(function()
+			mtask.sleep(DELAY)
+			socket.sendto(udp, from, answer(str))
+		end)
+	end, "127.0.0.1", DNS_PORT)
+	mtask.dispatch("lua", function()
+		mtask.ret(mtask.pack(query))
+	end)
+end)
+
+else
+
+mtask.start(function()
+	assert(mtask.getenv "dns_server", "set dns_server = \"127.0.0.1:5354\" in config")
+	local dns = mtask.newservice(SERVICE_NAME, "dns")
+
+	local listen = socket.listen("127.0.0.1", PORT)
+	socket.start(listen, function(id)
+		socket.start(id)
+		mtask.fork(function()
+			while true do
+				local data = socket.read(id)
+				if not data then
+					return
+				end
+				socket.write(id, data)
+			end
+		end)
+	end)
+
+	-- 用数字地址连接的连接一直做回显，记录最长一次往返的时间
+	local running = true
+	local round, maxgap = 0, 0
+	local echo = assert(socket.open("127.0.0.1", PORT))
+	mtask.fork(function()
+		while running do
+			local t = mtask.hpc()
+			socket.write(echo, "ping\n")
+			assert(socket.readline(echo) == "ping")
+			maxgap = math.max(maxgap, mtask.hpc() - t)
+			round = round + 1
+		end
+	end)
+
+	local function open(host)
+		local t = mtask.hpc()
+		local id, err = socket.open(host, PORT)
+		local ti = (mtask.hpc() - t) / 1000000000
+		if id then
+			socket.close(id)
+		end
+		return id, ti, err
+	end
+
+	local id, ti = open "slow.mtask.test"
+	assert(id, "connect slow.mtask.test failed")
+	assert(ti >= 0.9, "resolved without asking the dns server")
+	print(string.format("resolve slow.mtask.test %.2fs, echo rounds=%d max round trip=%.2fms",
+		ti, round, maxgap / 1000000))
+	assert(round > 100 and maxgap < 100000000, "socket thread blocked while resolving")
+
+	-- 两个解析线程 两个域名同时解析
+	local t = mtask.hpc()
+	local co = coroutine.running()
+	local done = 0
+	for _, host in ipairs { "a.mtask.test", "b.mtask.test" } do
+		mtask.fork(function()
+			assert(open(host))
+			done = done + 1
+			if done == 2 then
+				mtask.wakeup(co)
+			end
+		end)
+	end
+	mtask.wait()
+	ti = (mtask.hpc() - t) / 1000000000
+	print(string.format("resolve two hosts in parallel %.2fs", ti))
+	assert(ti < 1.8)
+
+	local query = mtask.call(dns, "lua")
+	id, ti = open "slow.mtask.test"
+	assert(id)
+	print(string.format("cached slow.mtask.test %.3fs", ti))
+	assert(ti < 0.1 and mtask.call(dns, "lua") == query, "dns cache miss")
+
+	local err
+	id, ti, err = open "multi.mtask.test"
+	print(string.format("multi.mtask.test %.2fs %s", ti, err or "connected"))
+	assert(id, "connect multi.mtask.test failed")
+	id, ti, err = open "multi.mtask.test"
+	assert(id and ti < 0.1, "cached address list broken")
+
+	-- 解析期间写数据 解析完成后连上 再解析期间写数据后关闭 槽位之后还能正常使用
+	id = driver.connect("write.mtask.test", PORT)
+	driver.send(id, "lost")
+	mtask.sleep(DELAY + 20)
+	driver.close(id)
+	for i = 1, 4 do
+		id = driver.connect("close" .. i .. ".mtask.test", PORT)
+		driver.send(id, "lost")
+		driver.close(id)
+	end
+	mtask.sleep(DELAY + 20)
+	for i = 1, 4 do
+		id = assert(socket.open("127.0.0.1", PORT))
+		socket.write(id, "ping\n")
+		assert(socket.readline(id) == "ping")
+		socket.close(id)
+	end
+	print("write while resolving ok")
+
+	id, ti, err = open "fail.mtask.test"
+	print(string.format("fail.mtask.test %.2fs %s", ti, err))
+	assert(id == nil)
+
+	running = false
+	print("dns test ok")
+	mtask.exit()
+end)
+
+end
@@ -0,0 +1,122 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+
+-- 读侧背压测试: 发送端一次写出大量数据，接收端读得很慢
+-- buffer: 接收端每读 64K 睡一个 tick，比较不开/开 autopause 时缓冲区里未读数据的峰值
+-- mqlen: 发送四分之一的数据量，接收端每读 4K 空转 1ms 把服务卡住，打印不开/开 autopause 时消息队列长度的峰值
+-- 服务卡住时数据消息已经进了队列，自动暂停只能挡住之后的数据，这一项只检查数据完整，不比较峰值
+-- rst: 接收端暂停读以后对端发 RST ，暂停中的 socket 也要马上报告断开（io_uring 后端要用 epoll 看到挂断）
+-- 用法: start = "testsocketpause" ，参数 发送的数据量(默认 32M) 缓冲区阈值(默认 256K) 队列阈值(默认 8)
+
+local total, pause_size, pause_mqlen = ...
+total = tonumber(total) or 32 * 1024 * 1024
+pause_size = tonumber(pause_size) or 256 * 1024
+pause_mqlen = tonumber(pause_mqlen) or 8
+
+local PORT = 8050
+local CHUNK = 64 * 1024
+
+local function spin(ms)
+	local t = mtask.hpc() + ms * 1000000
+	while mtask.hpc() < t do
+	end
+end
+
+-- 返回 未读数据峰值 消息队列峰值 用时
+local function run(slow, total, size, mqlen)
+	local co = coroutine.running()
+	local max_unread, max_mqlen = 0, 0
+	local read = 0
+	local listen = socket.listen("127.0.0.1", PORT)
+	socket.start(listen, function(id)
+		socket.close(listen)
+		socket.start(id)
+		if size or mqlen then
+			socket.autopause(id, size, mqlen)
+		end
+		mtask.fork(function()
+			local sz = slow == "buffer" and CHUNK or 4096
+			while true do
+				max_unread = math.max(max_unread, socket.unread(id))
+				max_mqlen = math.max(max_mqlen, mtask.stat "mqlen")
+				local data = socket.read(id, sz)
+				if not data then
+					break
+				end
+				read = read + #data
+				if slow == "buffer" then
+					mtask.sleep(1)
+				else
+					spin(1)
+				end
+			end
+			socket.close(id)
+			mtask.wakeup(co)
+		end)
+	end)
+	local t = mtask.hpc()
+	local c = assert(socket.open("127.0.0.1", PORT))
+	local chunk = string.rep("x", CHUNK)
+	for i = 1, total // CHUNK do
+		socket.write(c, chunk)
+	end
+	socket.close(c)
+	mtask.wait()
+	assert(read == total // CHUNK * CHUNK, "lost data")
+	return max_unread, max_mqlen, (mtask.hpc() - t) / 1000000000
+end
+
+-- 返回 暂停中的 socket 从对端断开到读到断开的用时(秒) 超时返回 nil
+local function rst()
+	local co = coroutine.running()
+	local closed
+	local listen = socket.listen("127.0.0.1", PORT)
+	socket.start(listen, function(id)
+		socket.close(listen)
+		socket.start(id)
+		socket.pause(id)
+		mtask.fork(function()
+			-- 等客户端也暂停以后写一些数据 客户端不读 关闭时内核发 RST
+			mtask.sleep(10)
+			socket.write(id, string.rep("x", 4096))
+			mtask.sleep(10)
+			local t = mtask.hpc()
+			mtask.wakeup(co)
+			socket.read(id)
+			closed = (mtask.hpc() - t) / 1000000000
+			socket.close(id)
+		end)
+	end)
+	local c = assert(socket.open("127.0.0.1", PORT))
+	socket.pause(c)
+	mtask.wait()
+	socket.close(c)
+	for i = 1, 100 do
+		if closed then
+			break
+		end
+		mtask.sleep(1)
+	end
+	return closed
+end
+
+mtask.start(function()
+	local unread, _, ti = run("buffer", total)
+	print(string.format("buffer: autopause off max unread=%dK time=%.2fs", unread // 1024, ti))
+	local unread_pause, _, ti = run("buffer", total, pause_size)
+	print(string.format("buffer: autopause %dK max unread=%dK time=%.2fs", pause_size // 1024, unread_pause // 1024, ti))
+	-- 恢复读时内核缓冲区里积压的数据会一次读上来，峰值是阈值加上内核接收缓冲区，和发送总量无关
+	assert(unread_pause < unread // 2, "buffer not bounded")
+
+	local _, mqlen, ti = run("mqlen", total // 4)
+	print(string.format("mqlen: autopause off max mqlen=%d time=%.2fs", mqlen, ti))
+	local _, mqlen_pause, ti = run("mqlen", total // 4, nil, pause_mqlen)
+	print(string.format("mqlen: autopause %d max mqlen=%d time=%.2fs", pause_mqlen, mqlen_pause, ti))
+
+	local ti = rst()
+	print(string.format("rst: paused socket closed in %s", ti and string.format("%.3fs", ti) or "timeout"))
+	assert(ti, "paused socket missed the peer reset")
+
+	print("socket pause test ok")
+	mtask.exit()
+end)
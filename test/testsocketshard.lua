@@ -0,0 +1,84 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+
+-- 多 socket 线程测试: 建立多个连接做回显，统计 accept 和 connect 得到的 socket 分布在哪些分片
+-- 用法: start = "testsocketshard" ，配置 socket_thread = 4 (可选 socket_reuseport = true)
+-- 参数 连接数(默认 64) 每个连接回显的次数(默认 1000)
+
+local conn_n, round = ...
+conn_n = tonumber(conn_n) or 64
+round = tonumber(round) or 1000
+
+local PORT = 8003
+local thread = tonumber(mtask.getenv "socket_thread") or 1
+local bits = 0
+while (1 << bits) < thread do
+	bits = bits + 1
+end
+
+local function shard_count(ids)
+	local count = {}
+	for i = 0, thread - 1 do
+		count[i+1] = 0
+	end
+	for _, id in ipairs(ids) do
+		local s = id & ((1 << bits) - 1)
+		count[s+1] = count[s+1] + 1
+	end
+	return table.concat(count, ",")
+end
+
+mtask.start(function()
+	local accepted = {}
+	local listen = socket.listen("127.0.0.1", PORT)
+	socket.start(listen, function(id)
+		accepted[#accepted+1] = id
+		socket.start(id)
+		mtask.fork(function()
+			while true do
+				local data = socket.read(id)
+				if not data then
+					return
+				end
+				socket.write(id, data)
+			end
+		end)
+	end)
+
+	local connected = {}
+	local done = 0
+	local co = coroutine.running()
+	local start = mtask.now()
+	for i = 1, conn_n do
+		mtask.fork(function()
+			local id = assert(socket.open("127.0.0.1", PORT))
+			connected[#connected+1] = id
+			for j = 1, round do
+				local msg = string.format("%d:%d\n", i, j)
+				socket.write(id, msg)
+				assert(socket.readline(id) == msg:sub(1, -2))
+			end
+			socket.close(id)
+			done = done + 1
+			if done == conn_n then
+				mtask.wakeup(co)
+			end
+		end)
+	end
+	mtask.wait()
+	print(string.format("socket_thread=%d reuseport=%s connections=%d round=%d time=%.2fs",
+		thread, mtask.getenv "socket_reuseport", conn_n, round, (mtask.now() - start) / 100))
+	print("listen id", listen, "accept shards", shard_count(accepted), "connect shards", shard_count(connected))
+	assert(#accepted == conn_n)
+	socket.close(listen)
+	-- 监听关闭后不能再连接
+	assert(socket.open("127.0.0.1", PORT) == nil)
+	-- 分片数不是 2 的幂时 分片号那几位超出分片数的 id 也只是无效的 id
+	for i = 0, (1 << bits) - 1 do
+		local id = (12345 << bits) | i
+		assert(socket.write(id, "x") == false, "write to an invalid id")
+		socket.close_fd(id)
+	end
+	print("socket shard test ok")
+	mtask.exit()
+end)
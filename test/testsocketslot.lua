@@ -0,0 +1,94 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+
+-- socket 槽位表测试: 分批打开并关闭大量回环连接，槽位表按需扩大
+-- 检查所有分配过的 id 都不重复，已经关闭的 id 在槽位被复用后不能再写
+-- 用法: start = "testsocketslot" ，参数 连接总数(默认 250000) 同时打开的连接数(默认 8000)
+-- 每个连接两端各占一个 socket 和 fd，同时打开 20 万连接需要 socket_max = 524288 和足够大的 ulimit -n
+
+local total, concurrent = ...
+total = tonumber(total) or 250000
+concurrent = tonumber(concurrent) or 8000
+
+local PORT = 8020
+local PORT_N = 16	-- 连接分散到多个端口，避免连同一个地址时本地端口不够用
+local WORKER = 64	-- 同时发起连接和关闭连接的协程数
+
+mtask.start(function()
+	local seen = {}
+	local accepted = {}
+	local co = coroutine.running()
+	local waiting
+	local need = 0
+	local function wakeup()
+		if waiting and #accepted >= need and need > 0 then
+			waiting = nil
+			mtask.wakeup(co)
+		end
+	end
+	local function parallel(n, f)
+		local done = 0
+		local next = 0
+		for i = 1, WORKER do
+			mtask.fork(function()
+				while next < n do
+					next = next + 1
+					f(next)
+				end
+				done = done + 1
+				if done == WORKER then
+					mtask.wakeup(co)
+				end
+			end)
+		end
+		mtask.wait()
+	end
+
+	for i = 0, PORT_N - 1 do
+		local listen = socket.listen("127.0.0.1", PORT + i, 4096)
+		seen[listen] = true
+		-- accept 到的连接不 start，只记下 id
+		socket.start(listen, function(id)
+			assert(not seen[id], "socket id reused")
+			seen[id] = true
+			accepted[#accepted+1] = id
+			wakeup()
+		end)
+	end
+
+	local start = mtask.hpc()
+	local opened = 0
+	local stale
+	while opened < total do
+		local n = math.min(concurrent, total - opened)
+		local conn = {}
+		parallel(n, function(i)
+			local id = assert(socket.open("127.0.0.1", PORT + (opened + i) % PORT_N))
+			assert(not seen[id], "socket id reused")
+			seen[id] = true
+			conn[i] = id
+		end)
+		need = n
+		if #accepted < n then
+			waiting = true
+			mtask.wait()
+		end
+		need = 0
+		-- 上一批关闭的 id 所在的槽位已经被这一批复用了
+		if stale then
+			assert(socket.write(stale, "x") == false, "write to a closed socket id")
+		end
+		stale = conn[1]
+		parallel(n, function(i)
+			socket.close(conn[i])
+			socket.close_fd(accepted[i])
+		end)
+		accepted = {}
+		opened = opened + n
+	end
+	local ti = (mtask.hpc() - start) / 1000000000
+	print(string.format("connections=%d concurrent=%d time=%.2fs %d/s",
+		total, concurrent, ti, math.floor(total / ti)))
+	print("socket slot test ok")
+	mtask.exit()
+end)
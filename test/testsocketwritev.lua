@@ -0,0 +1,73 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+
+-- 小包广播压测: 向多个连接连续写大量小包，发送队列堆积后由 socket 线程刷出
+-- 统计每刷出 1M 数据的 tcp 写系统调用次数
+-- 用法: start = "testsocketwritev" ，参数 连接数(默认 8) 每个连接的包数(默认 200000) 包大小(默认 64)
+
+local conn_n, package_n, package_sz = ...
+conn_n = tonumber(conn_n) or 8
+package_n = tonumber(package_n) or 200000
+package_sz = tonumber(package_sz) or 64
+
+local PORT = 8004
+local PACKAGE = string.rep("x", package_sz)
+
+mtask.start(function()
+	local accepted = {}
+	local co = coroutine.running()
+	local waiting
+	local listen = socket.listen("127.0.0.1", PORT)
+	-- accept 到的连接先不 start，广播全部写完后才开始读，模拟接收慢的对端，让发送队列堆积
+	socket.start(listen, function(id)
+		accepted[#accepted+1] = id
+		if #accepted == conn_n and waiting then
+			mtask.wakeup(co)
+		end
+	end)
+	local clients = {}
+	for i = 1, conn_n do
+		clients[i] = assert(socket.open("127.0.0.1", PORT))
+	end
+	if #accepted < conn_n then
+		waiting = true
+		mtask.wait()
+		waiting = nil
+	end
+
+	local call, bytes = mtask.stat "socketwrite", mtask.stat "socketwbytes"
+	local start = mtask.hpc()
+	for i = 1, package_n do
+		for _, id in ipairs(clients) do
+			socket.write(id, PACKAGE)
+		end
+	end
+	local total = package_n * package_sz
+	local done = 0
+	for _, id in ipairs(accepted) do
+		mtask.fork(function()
+			socket.start(id)
+			local recv = 0
+			while recv < total do
+				local data = assert(socket.read(id))
+				recv = recv + #data
+			end
+			socket.close(id)
+			done = done + 1
+			if done == conn_n then
+				mtask.wakeup(co)
+			end
+		end)
+	end
+	mtask.wait()
+	local ti = (mtask.hpc() - start) / 1000000000
+	call = mtask.stat "socketwrite" - call
+	bytes = mtask.stat "socketwbytes" - bytes
+	print(string.format("connections=%d packages=%d size=%d time=%.2fs writes=%d bytes=%d syscalls/MB=%.1f",
+		conn_n, conn_n * package_n, package_sz, ti, call, bytes, call / (bytes / 1048576)))
+	for _, id in ipairs(clients) do
+		socket.close(id)
+	end
+	socket.close(listen)
+	mtask.exit()
+end)
@@ -0,0 +1,53 @@
+local mtask = require "mtask"
+
+-- 定时器合并投递压测: 大量协程 sleep 到同一时刻，对比逐条投递和 mtask.timerbatch 合并投递
+-- 用法: start = "testtimerbatch" ，参数 协程数(默认 100000)
+
+local mode, count = ...
+
+if mode == "worker" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function(_, _, batch)
+		local n = tonumber(count)
+		if batch then
+			mtask.timerbatch(true)
+		end
+		local main = coroutine.running()
+		local left = n
+		local message = mtask.stat "message"
+		local first
+		-- 所有协程都睡到同一时刻，留出注册定时器的时间
+		local deadline = mtask.nowms() + 1000 + n // 20
+		for i = 1, n do
+			mtask.fork(function()
+				mtask.sleepms(deadline - mtask.nowms())
+				first = first or mtask.hpc()
+				left = left - 1
+				if left == 0 then
+					mtask.wakeup(main)
+				end
+			end)
+		end
+		mtask.wait()
+		-- 第一个协程醒来到最后一个协程醒来的时间
+		local ti = (mtask.hpc() - first) // 1000000
+		mtask.ret(mtask.pack(ti, mtask.stat "message" - message))
+	end)
+end)
+
+else
+
+local n = tonumber(mode) or 100000
+
+mtask.start(function()
+	for _, batch in ipairs { false, true } do
+		local worker = mtask.newservice(SERVICE_NAME, "worker", n)
+		local ti, message = mtask.call(worker, "lua", batch)
+		print(string.format("%s timers=%d wakeup span=%dms messages=%d",
+			batch and "batch" or "single", n, ti, message))
+	end
+	mtask.exit()
+end)
+
+end
@@ -0,0 +1,55 @@
+local mtask = require "mtask"
+local c = require "mtask.core"
+
+-- 定时器触发抖动压测: 同时挂 n 个毫秒定时器，统计每个定时器实际触发时刻与预期时刻的偏差(微秒)
+-- 用法: start = "testtimerjitter" ，参数 定时器个数列表(默认 "10000,100000,1000000")
+-- 不同的精度分别用 timer_resolution = "1ms" / "10ms" 启动，可以同时打开 timer_tickless 对比
+-- 定时器加入时当前滴答已经过去了一部分，所以偏差可能为负，最多提前一个滴答
+
+local counts = ...
+
+local function percent(late, p)
+	return late[math.max(1, math.floor(#late * p))]
+end
+
+local function run(n)
+	local span = math.max(1000, n // 100)	-- 定时器分散在 span 毫秒内到期
+	local delay = n // 1000 + 100	-- 先全部加完再开始到期
+	local target = {}
+	local late = {}
+	local fired = 0
+	-- 直接用 c.timeout 注册定时器，不为每个定时器创建协程，到期消息走 unknown response
+	local prev = mtask.dispatch_unknown_response(function(session)
+		fired = fired + 1
+		late[fired] = mtask.hpc() - target[session]
+		target[session] = nil
+	end)
+	for i = 1, n do
+		local ms = delay + math.random(span)
+		local t = mtask.hpc() + ms * 1000000
+		target[c.timeout(ms, true)] = t
+	end
+	-- unknown response 不经过协程调度，不能在里面 mtask.wakeup，这里轮询
+	while fired < n do
+		mtask.sleep(10)
+	end
+	mtask.dispatch_unknown_response(prev)
+
+	local sum = 0
+	for i = 1, n do
+		local v = late[i] // 1000
+		late[i] = v
+		sum = sum + v
+	end
+	table.sort(late)
+	print(string.format("resolution=%s tickless=%s timers=%d jitter(us) min=%d avg=%d p50=%d p99=%d p999=%d max=%d",
+		mtask.getenv "timer_resolution", mtask.getenv "timer_tickless", n,
+		late[1], sum // n, percent(late, 0.5), percent(late, 0.99), percent(late, 0.999), late[n]))
+end
+
+mtask.start(function()
+	for n in (counts or "10000,100000,1000000"):gmatch "%d+" do
+		run(tonumber(n))
+	end
+	mtask.exit()
+end)
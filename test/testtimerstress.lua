@@ -0,0 +1,82 @@
+local mtask = require "mtask"
+local c = require "mtask.core"
+
+-- 定时器并发插入压测: 多个服务同时大量加入定时器，统计每次插入的平均耗时和定时器分片锁的冲突次数
+-- 用法: start = "testtimerstress" ，参数 服务数(默认 16) 每个服务加入的定时器个数(默认 100000)
+-- 一半用 1/100 秒为单位，一半用毫秒为单位，毫秒定时器中一半会在到期前取消
+
+local mode, count = ...
+
+if mode == "worker" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function()
+		local n = tonumber(count)
+		local fired = 0
+		-- 直接用 c.timeout 注册定时器，不为每个定时器创建协程，到期消息走 unknown response
+		mtask.dispatch_unknown_response(function()
+			fired = fired + 1
+		end)
+		local cancel = {}
+		local start = mtask.hpc()
+		for i = 1, n do
+			local ms = 100 + i % 1000
+			if i % 2 == 0 then
+				c.timeout(ms // 10)
+			elseif i % 4 == 1 then
+				-- 要取消的定时器放到足够远，保证取消时还没有到期
+				local session, id = c.timeout(ms + 600000, true)
+				cancel[#cancel+1] = id
+			else
+				c.timeout(ms, true)
+			end
+		end
+		local cost = mtask.hpc() - start
+		for _, id in ipairs(cancel) do
+			assert(c.canceltimeout(id))
+		end
+		local expect = n - #cancel
+		while fired < expect do
+			mtask.sleep(10)
+		end
+		assert(fired == expect)
+		mtask.ret(mtask.pack(cost, #cancel))
+	end)
+end)
+
+else
+
+local service_n = tonumber(mode) or 16
+local timer_n = tonumber(count) or 100000
+
+mtask.start(function()
+	local worker = {}
+	for i = 1, service_n do
+		worker[i] = mtask.newservice(SERVICE_NAME, "worker", timer_n)
+	end
+	local add, contend = mtask.stat "timeradd", mtask.stat "timercontend"
+	local cost, cancel = 0, 0
+	local start = mtask.now()
+	local co = coroutine.running()
+	local done = 0
+	for i = 1, service_n do
+		mtask.fork(function()
+			local ti, n = mtask.call(worker[i], "lua")
+			cost = cost + ti
+			cancel = cancel + n
+			done = done + 1
+			if done == service_n then
+				mtask.wakeup(co)
+			end
+		end)
+	end
+	mtask.wait()
+	local total = service_n * timer_n
+	add = mtask.stat "timeradd" - add
+	contend = mtask.stat "timercontend" - contend
+	print(string.format("services=%d timers=%d canceled=%d time=%.2fs insert=%dns/op added=%d contend=%d (%.3f%%)",
+		service_n, total, cancel, (mtask.now() - start) / 100, cost // total, add, contend, contend * 100 / math.max(add, 1)))
+	mtask.exit()
+end)
+
+end
@@ -0,0 +1,73 @@
+local mtask = require "mtask"
+local socket = require "mtask.socket"
+
+-- udp 压测: 多个服务同时向一个 udp socket 发包，统计收到的包数，报告每秒收包数
+-- 用法: start = "testudpflood" ，参数 发送服务数(默认 4) 每个服务发的包数(默认 200000) 包大小(默认 64)
+-- 发得比收得快时内核会丢包，丢包率一起打印
+
+local mode, package_n, package_sz = ...
+package_n = tonumber(package_n) or 200000
+package_sz = tonumber(package_sz) or 64
+
+local PORT = 8040
+
+if mode == "sender" then
+
+mtask.start(function()
+	mtask.dispatch("lua", function(_, _, n, sz)
+		local u = socket.udp(function() end)
+		socket.udp_connect(u, "127.0.0.1", PORT)
+		local package = string.rep("x", sz)
+		for i = 1, n do
+			socket.write(u, package)
+			if i % 256 == 0 then
+				mtask.yield()
+			end
+		end
+		socket.close(u)
+		mtask.ret()
+	end)
+end)
+
+else
+
+local sender_n = tonumber(mode) or 4
+
+mtask.start(function()
+	local recv, last = 0, 0
+	local start
+	local server = socket.udp(function(str, from)
+		recv = recv + 1
+		last = mtask.hpc()
+	end, "127.0.0.1", PORT)
+
+	local co = coroutine.running()
+	local done = 0
+	start = mtask.hpc()
+	for i = 1, sender_n do
+		local sender = mtask.newservice(SERVICE_NAME, "sender")
+		mtask.fork(function()
+			mtask.call(sender, "lua", package_n, package_sz)
+			done = done + 1
+			if done == sender_n then
+				mtask.wakeup(co)
+			end
+		end)
+	end
+	mtask.wait()
+	local send_ti = (mtask.hpc() - start) / 1000000000
+	-- 等到不再有包到达
+	local n
+	repeat
+		n = recv
+		mtask.sleep(10)
+	until recv == n
+	local ti = (last - start) / 1000000000
+	local total = sender_n * package_n
+	print(string.format("senders=%d packages=%d size=%d send=%.2fs sent=%d/s recv=%d loss=%.1f%% time=%.2fs recv=%d/s",
+		sender_n, total, package_sz, send_ti, math.floor(total / send_ti), recv, (total - recv) * 100 / total, ti, math.floor(recv / ti)))
+	socket.close(server)
+	mtask.exit()
+end)
+
+end